@@ -0,0 +1,581 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blc.h"
+
+#define LBLC_MAGIC "blc\x7f"
+#define LBLC_IMAGE_MAGIC "bli\x7f"
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  // The number of nodes and of wide numbers, and the size of the symbol
+  // table in bytes
+  uint32_t node_count;
+  uint32_t wide_count;
+  uint32_t sym_size;
+} lblc_header;
+
+// An image's header is followed by its bindings, sorted by name, and then
+// the same sections as a compiled file
+typedef struct {
+  lblc_header blc;
+  uint32_t binding_count;
+} lblc_image_header;
+
+// A binding's name, and the range of nodes holding its value, whose root
+// is the last of them
+typedef struct {
+  uint32_t name;
+  uint32_t first;
+  uint32_t last;
+} lblc_binding;
+
+// Node types, kept apart from the LVAL_* enum so it can change freely.
+// Numbers that don't fit in a node are kept in the wide number table, and
+// native functions are kept as the name they were registered under.
+enum {
+  LBLC_NUM, LBLC_WIDE, LBLC_ERR, LBLC_SYM, LBLC_SEXPR, LBLC_QEXPR, LBLC_FUN
+};
+
+#define LBLC_TYPE_BITS 3
+#define LBLC_MAX_COUNT (UINT32_MAX >> LBLC_TYPE_BITS)
+
+typedef struct {
+  // The type in the low bits, and above them the number of children,
+  // which come just before a list node
+  uint32_t tag;
+  // The number, its index in the wide number table, or the offset of the
+  // symbol, error message or function name in the symbol table
+  int32_t value;
+} lblc_node;
+
+/*
+ * Writing
+ */
+
+// The symbol table being built, with an open-addressed hash of the
+// offsets of the strings already in it
+typedef struct {
+  char* data;
+  size_t size;
+  size_t cap;
+
+  uint32_t* slots;
+  size_t slot_count;
+  size_t used;
+} lblc_syms;
+
+// A list being walked, and the next of its cells to visit
+typedef struct {
+  lval* val;
+  int next;
+} lblc_frame;
+
+// The sections being built, and the stack used to walk values into them
+typedef struct {
+  lblc_node* nodes;
+  size_t count;
+  size_t size;
+
+  int64_t* wide;
+  size_t wide_count;
+  size_t wide_size;
+
+  lblc_syms syms;
+
+  lblc_frame* stack;
+  int stack_size;
+} lblc_writer;
+
+static size_t lblc_hash(const char* s) {
+  size_t h = 5381;
+  while (*s) h = h * 33 + (unsigned char)*s++;
+  return h;
+}
+
+// Slots hold offset + 1, so that zero marks an empty one
+static uint32_t* lblc_slot(lblc_syms* syms, const char* s) {
+  size_t mask = syms->slot_count - 1;
+  size_t i = lblc_hash(s) & mask;
+  while (syms->slots[i] && strcmp(syms->data + syms->slots[i] - 1, s) != 0) {
+    i = (i + 1) & mask;
+  }
+  return &syms->slots[i];
+}
+
+// The offset of a string in the table, adding it if it isn't there yet
+static uint32_t lblc_intern(lblc_syms* syms, const char* s) {
+  // Keep the hash at most half full
+  if (syms->used * 2 >= syms->slot_count) {
+    uint32_t* old = syms->slots;
+    size_t old_count = syms->slot_count;
+    syms->slot_count = old_count ? old_count * 2 : 256;
+    syms->slots = calloc(syms->slot_count, sizeof(uint32_t));
+    for (size_t i = 0; i < old_count; i++) {
+      if (old[i]) *lblc_slot(syms, syms->data + old[i] - 1) = old[i];
+    }
+    free(old);
+  }
+
+  uint32_t* slot = lblc_slot(syms, s);
+  if (*slot) return *slot - 1;
+
+  size_t len = strlen(s) + 1;
+  while (syms->size + len > syms->cap) {
+    syms->cap = syms->cap ? syms->cap * 2 : 4096;
+    syms->data = realloc(syms->data, syms->cap);
+  }
+  memcpy(syms->data + syms->size, s, len);
+  *slot = syms->size + 1;
+  syms->used++;
+  syms->size += len;
+  return *slot - 1;
+}
+
+// The name a native function was registered under, or NULL
+static const char* lblc_native_name(lenv* natives, lbuiltin fun) {
+  for (int i = 0; natives && i < natives->count; i++) {
+    if (natives->vals[i]->fun == fun) return natives->syms[i];
+  }
+  return NULL;
+}
+
+// Append the nodes for a value. Returns 0 if it holds a function that
+// isn't one of NATIVES, or something too big for the format.
+static int lblc_encode(lblc_writer* w, lval* val, lenv* natives) {
+  int depth = 0;
+  int ok = 1;
+
+  // Walk the value in post order without recursion, emitting each node
+  // once all of its children have been
+  while (val || depth > 0) {
+    if (val && (val->type == LVAL_SEXPR || val->type == LVAL_QEXPR)) {
+      if (depth == w->stack_size) {
+        w->stack_size = w->stack_size ? w->stack_size * 2 : 16;
+        w->stack = realloc(w->stack, sizeof(lblc_frame) * w->stack_size);
+      }
+      w->stack[depth].val = val;
+      w->stack[depth].next = 0;
+      depth++;
+      val = NULL;
+      continue;
+    }
+
+    lblc_node node;
+    if (val) {
+      // An atom, which is emitted straight away
+      const char* name;
+      node.tag = 0;
+      switch (val->type) {
+        case LVAL_NUM:
+          if (val->num >= INT32_MIN && val->num <= INT32_MAX) {
+            node.tag = LBLC_NUM;
+            node.value = (int32_t)val->num;
+            break;
+          }
+          if (w->wide_count == w->wide_size) {
+            w->wide_size = w->wide_size ? w->wide_size * 2 : 64;
+            w->wide = realloc(w->wide, sizeof(int64_t) * w->wide_size);
+          }
+          w->wide[w->wide_count] = val->num;
+          node.tag = LBLC_WIDE;
+          node.value = (int32_t)w->wide_count++;
+          break;
+        case LVAL_SYM:
+          node.tag = LBLC_SYM;
+          node.value = (int32_t)lblc_intern(&w->syms, val->sym);
+          break;
+        case LVAL_ERR:
+          node.tag = LBLC_ERR;
+          node.value = (int32_t)lblc_intern(&w->syms, val->err);
+          break;
+        case LVAL_FUN:
+          name = lblc_native_name(natives, val->fun);
+          if (name == NULL) {
+            ok = 0;
+            break;
+          }
+          node.tag = LBLC_FUN;
+          node.value = (int32_t)lblc_intern(&w->syms, name);
+          break;
+        default:
+          ok = 0;
+          break;
+      }
+      val = NULL;
+    } else {
+      // Visit the next child of the innermost list, or emit the list once
+      // its children are done
+      lblc_frame* top = &w->stack[depth - 1];
+      if (top->next < top->val->count) {
+        val = top->val->cell[top->next++];
+        continue;
+      }
+      if ((uint32_t)top->val->count > LBLC_MAX_COUNT) ok = 0;
+      node.tag = top->val->type == LVAL_SEXPR ? LBLC_SEXPR : LBLC_QEXPR;
+      node.tag |= (uint32_t)top->val->count << LBLC_TYPE_BITS;
+      node.value = 0;
+      depth--;
+    }
+
+    // Offsets, indices and counts have to fit in their fields
+    if (!ok || w->syms.size > INT32_MAX || w->wide_count > INT32_MAX ||
+        w->count >= UINT32_MAX) {
+      return 0;
+    }
+
+    if (w->count == w->size) {
+      w->size = w->size ? w->size * 2 : 1024;
+      w->nodes = realloc(w->nodes, sizeof(lblc_node) * w->size);
+    }
+    w->nodes[w->count++] = node;
+  }
+  return 1;
+}
+
+// Fill in the header for the sections built so far
+static void lblc_header_init(lblc_header* header, const char* magic,
+    lblc_writer* w) {
+  memcpy(header->magic, magic, 4);
+  header->version = LBLC_VERSION;
+  header->node_count = w->count;
+  header->wide_count = w->wide_count;
+  header->sym_size = w->syms.size;
+}
+
+// Write out the nodes and tables, which may be empty and never allocated
+static int lblc_write_sections(lblc_writer* w, FILE* f) {
+  return fwrite(w->nodes, sizeof(lblc_node), w->count, f) == w->count &&
+    (!w->wide ||
+      fwrite(w->wide, sizeof(int64_t), w->wide_count, f) == w->wide_count) &&
+    (!w->syms.data ||
+      fwrite(w->syms.data, 1, w->syms.size, f) == w->syms.size);
+}
+
+static void lblc_writer_free(lblc_writer* w) {
+  free(w->nodes);
+  free(w->wide);
+  free(w->syms.data);
+  free(w->syms.slots);
+  free(w->stack);
+}
+
+int lblc_write(lval* forms, FILE* f) {
+  lblc_writer w;
+  memset(&w, 0, sizeof(w));
+
+  int ok = lblc_encode(&w, forms, NULL);
+  if (ok) {
+    lblc_header header;
+    lblc_header_init(&header, LBLC_MAGIC, &w);
+    ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+      lblc_write_sections(&w, f);
+  }
+
+  lblc_writer_free(&w);
+  return ok;
+}
+
+// A binding of the environment being written, by name and by its index
+// in the environment, so they can be sorted without reaching back into it
+typedef struct {
+  const char* name;
+  int index;
+} lblc_entry;
+
+static int lblc_compare_entries(const void* a, const void* b) {
+  return strcmp(((const lblc_entry*)a)->name, ((const lblc_entry*)b)->name);
+}
+
+int lblc_write_image(lenv* env, lenv* natives, lblc_image* base, FILE* f) {
+  lblc_writer w;
+  memset(&w, 0, sizeof(w));
+
+  // Write the bindings sorted by name, so they can be found by bisection
+  lblc_entry* order = malloc(sizeof(lblc_entry) * (env->count + 1));
+  for (int i = 0; i < env->count; i++) {
+    order[i].name = env->syms[i];
+    order[i].index = i;
+  }
+  qsort(order, env->count, sizeof(lblc_entry), lblc_compare_entries);
+
+  // Merge in the base image's bindings, which are sorted too, taking the
+  // environment's where both have one
+  int base_count = base ? lblc_image_count(base) : 0;
+  size_t size = (size_t)env->count + base_count + 1;
+  lblc_binding* bindings = malloc(sizeof(lblc_binding) * size);
+  uint32_t count = 0;
+  int i = 0;
+  int j = 0;
+  int ok = 1;
+  while ((i < env->count || j < base_count) && ok) {
+    const char* name = j < base_count ? lblc_image_name(base, j) : NULL;
+    if (j < base_count && name == NULL) {
+      ok = 0;
+      break;
+    }
+
+    int cmp = i == env->count ? 1
+      : j == base_count ? -1
+      : strcmp(order[i].name, name);
+    lval* val;
+    if (cmp <= 0) {
+      name = order[i].name;
+      val = env->vals[order[i].index];
+      i++;
+      if (cmp == 0) j++;
+    } else {
+      val = lblc_image_get(base, name);
+      j++;
+      if (val == NULL) {
+        ok = 0;
+        break;
+      }
+    }
+
+    lblc_binding* b = &bindings[count++];
+    b->name = lblc_intern(&w.syms, name);
+    b->first = w.count;
+    ok = lblc_encode(&w, val, natives);
+    b->last = w.count - 1;
+    if (cmp > 0) lval_del(val);
+  }
+
+  if (ok) {
+    lblc_image_header header;
+    lblc_header_init(&header.blc, LBLC_IMAGE_MAGIC, &w);
+    header.binding_count = count;
+    ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+      fwrite(bindings, sizeof(lblc_binding), count, f) == count &&
+      lblc_write_sections(&w, f);
+  }
+
+  free(order);
+  free(bindings);
+  lblc_writer_free(&w);
+  return ok;
+}
+
+/*
+ * Reading
+ */
+
+// The sections of a file, as they lie in memory
+typedef struct {
+  const lblc_node* nodes;
+  uint32_t node_count;
+  const char* wide;
+  uint32_t wide_count;
+  const char* syms;
+  uint32_t sym_size;
+} lblc_sections;
+
+// Find the sections following a header in the SIZE bytes at DATA.
+// Returns 0 if they don't fill them exactly.
+static int lblc_sections_init(lblc_sections* s, const lblc_header* header,
+    const char* data, size_t size) {
+  size_t node_bytes = (size_t)header->node_count * sizeof(lblc_node);
+  size_t wide_bytes = (size_t)header->wide_count * sizeof(int64_t);
+  if (header->version != LBLC_VERSION || size < node_bytes ||
+      size - node_bytes < wide_bytes ||
+      size - node_bytes - wide_bytes != header->sym_size) {
+    return 0;
+  }
+
+  // The nodes are used where they lie, which the headers keep aligned.
+  // The wide numbers may not be, so they are copied out one at a time.
+  s->nodes = (const lblc_node*)data;
+  s->node_count = header->node_count;
+  s->wide = data + node_bytes;
+  s->wide_count = header->wide_count;
+  s->syms = s->wide + wide_bytes;
+  s->sym_size = header->sym_size;
+
+  // Every string ends in a NUL, so one at the end bounds them all
+  return s->sym_size == 0 || s->syms[s->sym_size - 1] == '\0';
+}
+
+// True if VALUE is the offset of a string in the symbol table
+static int lblc_is_string(const lblc_sections* s, int64_t value) {
+  return value >= 0 && value < s->sym_size;
+}
+
+// Rebuild the value held in nodes FIRST to LAST as lval_read does, each
+// list taking the cells for its children off the top of the stack.
+// Functions are looked up by name in NATIVES. Returns NULL if the nodes
+// don't make up exactly one value.
+static lval* lblc_build(const lblc_sections* s, uint32_t first,
+    uint32_t last, lenv* natives) {
+  if (first > last || last >= s->node_count) return NULL;
+
+  lval** stack = malloc(sizeof(lval*) * (last - first + 1));
+  uint32_t count = 0;
+  int ok = 1;
+
+  for (uint32_t i = first; i <= last && ok; i++) {
+    uint32_t type = s->nodes[i].tag & ((1 << LBLC_TYPE_BITS) - 1);
+    uint32_t n = s->nodes[i].tag >> LBLC_TYPE_BITS;
+    int32_t value = s->nodes[i].value;
+    lval* val = NULL;
+
+    switch (type) {
+      case LBLC_NUM:
+        val = lval_num(value);
+        break;
+      case LBLC_WIDE: {
+        if (value < 0 || (uint32_t)value >= s->wide_count) {
+          ok = 0;
+          break;
+        }
+        int64_t num;
+        memcpy(&num, s->wide + value * sizeof(int64_t), sizeof(num));
+        val = lval_num((long)num);
+        break;
+      }
+      case LBLC_SYM:
+      case LBLC_ERR:
+        if (!lblc_is_string(s, value)) {
+          ok = 0;
+          break;
+        }
+        val = type == LBLC_SYM
+          ? lval_sym((char*)s->syms + value)
+          : lval_err((char*)s->syms + value);
+        break;
+      case LBLC_FUN: {
+        if (!lblc_is_string(s, value)) {
+          ok = 0;
+          break;
+        }
+        // A function the loading program hasn't registered can't be
+        // called, so it comes back as an error
+        lval* fun = natives ? lenv_lookup(natives, s->syms + value) : NULL;
+        val = fun ? lval_copy(fun) : lval_err("Native function not registered");
+        break;
+      }
+      case LBLC_SEXPR:
+      case LBLC_QEXPR:
+        if (n > count) {
+          ok = 0;
+          break;
+        }
+        val = type == LBLC_SEXPR ? lval_sexpr() : lval_qexpr();
+        if (n > 0) {
+          val->count = n;
+          val->cell = malloc(sizeof(lval*) * n);
+          count -= n;
+          memcpy(val->cell, stack + count, sizeof(lval*) * n);
+        }
+        break;
+      default:
+        ok = 0;
+        break;
+    }
+
+    if (ok) stack[count++] = val;
+  }
+
+  if (ok && count != 1) ok = 0;
+
+  lval* val = ok ? stack[0] : NULL;
+  if (!ok) {
+    for (uint32_t i = 0; i < count; i++) lval_del(stack[i]);
+  }
+  free(stack);
+  return val;
+}
+
+int lblc_check(const void* data, size_t size) {
+  return size >= sizeof(lblc_header) && memcmp(data, LBLC_MAGIC, 4) == 0;
+}
+
+lval* lblc_read(const void* data, size_t size) {
+  if (!lblc_check(data, size)) return NULL;
+
+  lblc_header header;
+  memcpy(&header, data, sizeof(header));
+  lblc_sections s;
+  if (!lblc_sections_init(&s, &header, (const char*)data + sizeof(header),
+        size - sizeof(header)) || s.node_count == 0) {
+    return NULL;
+  }
+
+  // A whole file reads back to exactly one S-expression of the forms
+  lval* val = lblc_build(&s, 0, s.node_count - 1, NULL);
+  if (val && val->type != LVAL_SEXPR) {
+    lval_del(val);
+    val = NULL;
+  }
+  return val;
+}
+
+struct lblc_image {
+  const lblc_binding* bindings;
+  uint32_t binding_count;
+  lblc_sections sections;
+  lenv* natives;
+};
+
+lblc_image* lblc_image_open(const void* data, size_t size, lenv* natives) {
+  if (size < sizeof(lblc_image_header) ||
+      memcmp(data, LBLC_IMAGE_MAGIC, 4) != 0) {
+    return NULL;
+  }
+
+  lblc_image_header header;
+  memcpy(&header, data, sizeof(header));
+  size_t binding_bytes = (size_t)header.binding_count * sizeof(lblc_binding);
+  size -= sizeof(header);
+  if (size < binding_bytes) return NULL;
+
+  lblc_image* image = malloc(sizeof(lblc_image));
+  image->bindings =
+    (const lblc_binding*)((const char*)data + sizeof(header));
+  image->binding_count = header.binding_count;
+  image->natives = natives;
+  if (!lblc_sections_init(&image->sections, &header.blc,
+        (const char*)image->bindings + binding_bytes, size - binding_bytes)) {
+    free(image);
+    return NULL;
+  }
+  return image;
+}
+
+void lblc_image_close(lblc_image* image) {
+  free(image);
+}
+
+int lblc_image_count(lblc_image* image) {
+  return image->binding_count;
+}
+
+const char* lblc_image_name(lblc_image* image, int i) {
+  uint32_t name = image->bindings[i].name;
+  return lblc_is_string(&image->sections, name)
+    ? image->sections.syms + name : NULL;
+}
+
+lval* lblc_image_get(lblc_image* image, const char* sym) {
+  // Bisect the bindings, so only the pages along the way are touched
+  uint32_t lo = 0;
+  uint32_t hi = image->binding_count;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    const char* name = lblc_image_name(image, mid);
+    if (name == NULL) return NULL;
+
+    int cmp = strcmp(sym, name);
+    if (cmp == 0) {
+      const lblc_binding* b = &image->bindings[mid];
+      return lblc_build(&image->sections, b->first, b->last, image->natives);
+    }
+    if (cmp < 0) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return NULL;
+}
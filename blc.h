@@ -0,0 +1,78 @@
+#ifndef BLISP_BLC_H
+#define BLISP_BLC_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "lval.h"
+
+/*
+ * The compiled form (.blc) of a script: its forms as read, so loading it
+ * skips the parser entirely. A file is laid out as
+ *
+ *     header | nodes | wide numbers | symbol table
+ *
+ * The header holds a magic number, the format version, the number of nodes
+ * and of wide numbers, and the size of the symbol table in bytes. The
+ * nodes are 8-byte records in post order, so the children of a list come
+ * just before it. A node holds its number directly if it fits in 32 bits,
+ * and otherwise the index of a 64-bit number in the wide number table.
+ * Symbols and error messages are referred to by their offset in the
+ * symbol table, which holds each distinct one once, NUL-terminated.
+ *
+ * Fields are written in the byte order of the machine that compiled the
+ * file. A file from a machine of the other order fails the version check.
+ */
+
+// Bumped whenever the layout changes, so stale files are rejected
+#define LBLC_VERSION 1
+
+// Write the forms read from a script, an S-expression of them, to F.
+// Returns 0 if the forms hold a function or the file can't be written.
+int lblc_write(lval* forms, FILE* f);
+
+// True if DATA starts with the magic number of a compiled file
+int lblc_check(const void* data, size_t size);
+
+// Read the forms back out of a compiled file held in DATA, such as a
+// mapping of it, without copying the nodes. Returns NULL if the file is
+// truncated, corrupt or of another version.
+lval* lblc_read(const void* data, size_t size);
+
+/*
+ * An image of an environment, laid out as
+ *
+ *     header | bindings | nodes | wide numbers | symbol table
+ *
+ * The header is a compiled file's, with its own magic number, followed by
+ * the number of bindings. The bindings are sorted by name, and each holds
+ * the offset of its name in the symbol table and the range of nodes
+ * holding its value. Native functions are written as the name they were
+ * registered under in NATIVES, and found by that name again when read.
+ *
+ * An image is read in place, and each value only rebuilt when it is asked
+ * for, so of a mapped image only the pages that are used are read in.
+ */
+typedef struct lblc_image lblc_image;
+
+// Write every binding in ENV as an image, along with those of BASE, if
+// given, that ENV doesn't have. Returns 0 if a value holds a function that
+// isn't one of NATIVES, or the file can't be written.
+int lblc_write_image(lenv* env, lenv* natives, lblc_image* base, FILE* f);
+
+// Open the image held in DATA, which must outlive it. Returns NULL if it
+// isn't one, or is truncated or of another version.
+lblc_image* lblc_image_open(const void* data, size_t size, lenv* natives);
+
+// Close an image, leaving its data alone
+void lblc_image_close(lblc_image* image);
+
+// The number of bindings, and the name of each, or NULL if it is corrupt
+int lblc_image_count(lblc_image* image);
+const char* lblc_image_name(lblc_image* image, int i);
+
+// Rebuild the value bound to SYM, or return NULL if there is none or it is
+// corrupt. A function that NATIVES lacks comes back as an error.
+lval* lblc_image_get(lblc_image* image, const char* sym);
+
+#endif
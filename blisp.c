@@ -0,0 +1,664 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mpc.h"
+#include "blc.h"
+#include "blisp.h"
+#include "io.h"
+#include "lval.h"
+#include "reader.h"
+
+// Parse modes used for all input, as only the AST is kept after a parse
+#define BLISP_PARSE_MODE (MPC_PARSE_AST_ARENA | MPC_PARSE_LAZY_ERRORS)
+
+// The size of the buffer results are printed into
+#define BLISP_OUT_SIZE 65536
+
+// The prelude, built from prelude.blisp as an image in static data
+#ifdef BLISP_PRELUDE
+#include BLISP_PRELUDE
+#endif
+
+struct blisp_ctx {
+  // The parsers for the blisp grammar
+  lreader* reader;
+  // Bindings, including the native functions registered with
+  // blisp_register
+  lenv* env;
+  // Just the native functions, by the name they were registered under,
+  // which is how images refer to them
+  lenv* natives;
+
+  // The image loaded last, mapped for as long as it may be looked in
+  lblc_image* image;
+  void* image_data;
+  size_t image_size;
+  // The prelude compiled in, if any, looked in after the image
+  lblc_image* prelude;
+
+  // Where results are printed, if anywhere, and the buffer they are
+  // printed into
+  FILE* out;
+  char* out_buf;
+  size_t out_len;
+  size_t out_size;
+
+  // The buffer files are read into, kept between calls
+  char* in_buf;
+  size_t in_size;
+
+  // The message for the last failed call
+  char* error;
+};
+
+// Bind symbols from the loaded image or the prelude the first time they
+// are looked up
+static lval* blisp_lazy(void* data, const char* sym) {
+  blisp_ctx* ctx = data;
+  lval* val = ctx->image ? lblc_image_get(ctx->image, sym) : NULL;
+  if (val == NULL && ctx->prelude) val = lblc_image_get(ctx->prelude, sym);
+  return val;
+}
+
+blisp_ctx* blisp_ctx_new() {
+  blisp_ctx* ctx = malloc(sizeof(blisp_ctx));
+  ctx->reader = lreader_new();
+  ctx->env = lenv_new();
+  ctx->natives = lenv_new();
+  ctx->image = NULL;
+  ctx->prelude = NULL;
+  ctx->out = NULL;
+  ctx->out_buf = NULL;
+  ctx->out_len = 0;
+  ctx->out_size = 0;
+  ctx->in_buf = NULL;
+  ctx->in_size = 0;
+  ctx->error = NULL;
+
+  // Opening the prelude only checks its header, so this costs the same
+  // however large it grows
+#ifdef BLISP_PRELUDE
+  ctx->prelude = lblc_image_open(blisp_prelude, blisp_prelude_size,
+    ctx->natives);
+  ctx->env->lazy = blisp_lazy;
+  ctx->env->lazy_data = ctx;
+#endif
+  return ctx;
+}
+
+static void blisp_unload_image(blisp_ctx* ctx) {
+  if (ctx->image == NULL) return;
+  lblc_image_close(ctx->image);
+  munmap(ctx->image_data, ctx->image_size);
+  ctx->image = NULL;
+}
+
+void blisp_ctx_del(blisp_ctx* ctx) {
+  lreader_del(ctx->reader);
+  lenv_del(ctx->env);
+  lenv_del(ctx->natives);
+  blisp_unload_image(ctx);
+  if (ctx->prelude) lblc_image_close(ctx->prelude);
+  free(ctx->out_buf);
+  free(ctx->in_buf);
+  free(ctx->error);
+  free(ctx);
+}
+
+void blisp_ctx_output(blisp_ctx* ctx, FILE* out) {
+  ctx->out = out;
+  if (out && ctx->out_buf == NULL) {
+    ctx->out_size = BLISP_OUT_SIZE;
+    ctx->out_buf = malloc(ctx->out_size);
+  }
+}
+
+void blisp_register(blisp_ctx* ctx, const char* name, lbuiltin func) {
+  lval* key = lval_sym((char*)name);
+  lval* val = lval_fun(func);
+  lenv_put(ctx->env, key, val);
+  lenv_put(ctx->natives, key, val);
+  lval_del(key);
+  lval_del(val);
+}
+
+void blisp_register_files(blisp_ctx* ctx) {
+  blisp_register(ctx, "read-file", builtin_read_file);
+  blisp_register(ctx, "read-lines", builtin_read_lines);
+  blisp_register(ctx, "write-file", builtin_write_file);
+}
+
+void blisp_define(blisp_ctx* ctx, const char* name, lval* val) {
+  lval* key = lval_sym((char*)name);
+  lenv_put(ctx->env, key, val);
+  lval_del(key);
+}
+
+const char* blisp_error(blisp_ctx* ctx) {
+  return ctx->error ? ctx->error : "";
+}
+
+static void blisp_set_error(blisp_ctx* ctx, char* error) {
+  free(ctx->error);
+  ctx->error = error;
+}
+
+static void blisp_flush(blisp_ctx* ctx) {
+  if (ctx->out_len > 0) {
+    fwrite(ctx->out_buf, 1, ctx->out_len, ctx->out);
+    fflush(ctx->out);
+    ctx->out_len = 0;
+  }
+}
+
+// Print a result into the output buffer, writing out what is waiting
+// first if it doesn't fit, and growing the buffer if it still doesn't
+static void blisp_print(blisp_ctx* ctx, lval* val) {
+  if (ctx->out == NULL) return;
+
+  size_t n = lval_to_string(val, ctx->out_buf + ctx->out_len,
+    ctx->out_size - ctx->out_len);
+  if (ctx->out_len + n + 1 > ctx->out_size) {
+    blisp_flush(ctx);
+    if (n + 1 > ctx->out_size) {
+      ctx->out_size = n + 1;
+      ctx->out_buf = realloc(ctx->out_buf, ctx->out_size);
+    }
+    lval_to_string(val, ctx->out_buf, n + 1);
+  }
+  ctx->out_len += n;
+  ctx->out_buf[ctx->out_len++] = '\n';
+}
+
+// Parse the input and read it into an S-expression of its top-level
+// expressions, or return NULL and set the error
+static lval* blisp_read(blisp_ctx* ctx, const char* name, const char* input) {
+  mpc_result_t mpc_result;
+  if (!mpc_parse_mode(name, input, ctx->reader->blisp, &mpc_result,
+        BLISP_PARSE_MODE, NULL)) {
+    blisp_set_error(ctx, mpc_err_string(mpc_result.error));
+    mpc_err_delete(mpc_result.error);
+    return NULL;
+  }
+
+#ifdef BLISP_PRINT_AST
+  mpc_ast_print(mpc_result.output);
+#endif
+  lval* val = lval_read(ctx->reader, mpc_result.output);
+  mpc_ast_delete(mpc_result.output);
+  return val;
+}
+
+lval* blisp_eval_string(blisp_ctx* ctx, const char* name, const char* input) {
+  lval* val = blisp_read(ctx, name, input);
+  if (val == NULL) return NULL;
+
+  val = lval_eval(ctx->env, val);
+  blisp_print(ctx, val);
+  blisp_flush(ctx);
+  return val;
+}
+
+// Read the whole of a file into the context's input buffer. Reads in
+// blocks rather than seeking to the end, so pipes such as /dev/stdin work.
+static int blisp_read_file(blisp_ctx* ctx, const char* filename) {
+  FILE* f = fopen(filename, "rb");
+  if (f == NULL) return 0;
+
+  if (ctx->in_size == 0) {
+    ctx->in_size = 4096;
+    ctx->in_buf = malloc(ctx->in_size);
+  }
+
+  size_t len = 0;
+  size_t n;
+  while ((n = fread(ctx->in_buf + len, 1, ctx->in_size - len - 1, f)) > 0) {
+    len += n;
+    if (ctx->in_size - len - 1 == 0) {
+      ctx->in_size *= 2;
+      ctx->in_buf = realloc(ctx->in_buf, ctx->in_size);
+    }
+  }
+
+  int ok = !ferror(f);
+  ctx->in_buf[len] = '\0';
+  fclose(f);
+  return ok;
+}
+
+// Set the error to a message about a file, formatted with its name
+static void blisp_file_error(blisp_ctx* ctx, const char* fmt,
+    const char* filename) {
+  char* error = malloc(strlen(fmt) + strlen(filename) + 1);
+  sprintf(error, fmt, filename);
+  blisp_set_error(ctx, error);
+}
+
+// Read a file into the input buffer, or set the error
+static int blisp_load(blisp_ctx* ctx, const char* filename) {
+  if (blisp_read_file(ctx, filename)) return 1;
+
+  blisp_file_error(ctx, "cannot read '%s'\n", filename);
+  return 0;
+}
+
+// Map a file read-only, or return NULL if it can't be. Pipes and empty
+// files can't be mapped.
+static void* blisp_map(const char* filename, size_t* size) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return NULL;
+
+  struct stat st;
+  void* data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (data == MAP_FAILED) return NULL;
+
+  *size = st.st_size;
+  return data;
+}
+
+// Read the forms of a compiled file out of a mapping of it. Returns 0 if
+// the file isn't a compiled one, and otherwise 1, with the forms in FORMS,
+// or NULL there and the error set if the file is corrupt.
+static int blisp_map_compiled(blisp_ctx* ctx, const char* filename,
+    lval** forms) {
+  size_t size;
+  void* data = blisp_map(filename, &size);
+  if (data == NULL) return 0;
+
+  int compiled = lblc_check(data, size);
+  if (compiled) {
+    *forms = lblc_read(data, size);
+    if (*forms == NULL) {
+      blisp_file_error(ctx, "'%s' is not a valid compiled file\n", filename);
+    }
+  }
+  munmap(data, size);
+  return compiled;
+}
+
+int blisp_compile_file(blisp_ctx* ctx, const char* filename,
+    const char* output) {
+  if (!blisp_load(ctx, filename)) return 0;
+
+  lval* val = blisp_read(ctx, filename, ctx->in_buf);
+  if (val == NULL) return 0;
+
+  FILE* f = fopen(output, "wb");
+  int ok = f && lblc_write(val, f);
+  if (f && fclose(f) != 0) ok = 0;
+  lval_del(val);
+
+  if (!ok) blisp_file_error(ctx, "cannot write '%s'\n", output);
+  return ok;
+}
+
+int blisp_save_image(blisp_ctx* ctx, const char* filename) {
+  // Write beside the file and move it over at the end, so an image being
+  // replaced stays whole for anything that has it mapped
+  const char* fmt = "%s.tmp";
+  char* tmp = malloc(strlen(fmt) + strlen(filename) + 1);
+  sprintf(tmp, fmt, filename);
+
+  FILE* f = fopen(tmp, "wb");
+  // What is still only in the loaded image is written out along with it
+  int ok = f && lblc_write_image(ctx->env, ctx->natives, ctx->image, f);
+  if (f && fclose(f) != 0) ok = 0;
+  if (ok) ok = rename(tmp, filename) == 0;
+  if (!ok) {
+    remove(tmp);
+    blisp_file_error(ctx, "cannot write '%s'\n", filename);
+  }
+  free(tmp);
+  return ok;
+}
+
+int blisp_load_image(blisp_ctx* ctx, const char* filename) {
+  size_t size;
+  void* data = blisp_map(filename, &size);
+  if (data == NULL) {
+    blisp_file_error(ctx, "cannot read '%s'\n", filename);
+    return 0;
+  }
+
+  lblc_image* image = lblc_image_open(data, size, ctx->natives);
+  if (image == NULL) {
+    munmap(data, size);
+    blisp_file_error(ctx, "'%s' is not a valid image\n", filename);
+    return 0;
+  }
+
+  // Start again from just the native functions, and leave the rest to be
+  // read from the image as it is needed
+  blisp_unload_image(ctx);
+  lenv_del(ctx->env);
+  ctx->env = lenv_new();
+  for (int i = 0; i < ctx->natives->count; i++) {
+    lval* key = lval_sym(ctx->natives->syms[i]);
+    lenv_put(ctx->env, key, ctx->natives->vals[i]);
+    lval_del(key);
+  }
+  ctx->env->lazy = blisp_lazy;
+  ctx->env->lazy_data = ctx;
+
+  ctx->image = image;
+  ctx->image_data = data;
+  ctx->image_size = size;
+  return 1;
+}
+
+// Evaluate each of the forms read from a file, deleting them
+static lval* blisp_eval_forms(blisp_ctx* ctx, lval* val) {
+  // Stop at the first error, leaving the rest of the file unevaluated.
+  // The forms are taken in place, rather than popped one at a time.
+  lval* result = lval_sexpr();
+  int i = 0;
+  while (i < val->count && result->type != LVAL_ERR) {
+    lval_del(result);
+    result = lval_eval(ctx->env, val->cell[i++]);
+    blisp_print(ctx, result);
+  }
+  blisp_flush(ctx);
+
+  while (i < val->count) lval_del(val->cell[i++]);
+  val->count = 0;
+  lval_del(val);
+  return result;
+}
+
+lval* blisp_eval_file(blisp_ctx* ctx, const char* filename) {
+  lval* val;
+  if (!blisp_map_compiled(ctx, filename, &val)) {
+    if (!blisp_load(ctx, filename)) return NULL;
+    val = blisp_read(ctx, filename, ctx->in_buf);
+  }
+  if (val == NULL) return NULL;
+
+  return blisp_eval_forms(ctx, val);
+}
+
+/*
+ * Pipelined evaluation
+ *
+ * A reader thread parses the file a chunk of whole lines at a time and
+ * reads the forms out of each, the calling thread evaluates them in order,
+ * and a writer thread prints the results. The stages hand lvals on through
+ * bounded single-producer, single-consumer rings, each ending with a NULL.
+ */
+
+// The number of lvals a ring holds, which must be a power of two
+#define BLISP_RING_SIZE 1024
+
+// The input is parsed in chunks of at least this many bytes
+#define BLISP_CHUNK_SIZE 65536
+
+// The head is only written by the consumer and the tail by the producer,
+// so each is kept on a cache line of its own
+typedef struct {
+  lval* slots[BLISP_RING_SIZE];
+  size_t head;
+  char head_pad[64 - sizeof(size_t)];
+  size_t tail;
+  char tail_pad[64 - sizeof(size_t)];
+} blisp_ring;
+
+typedef struct {
+  blisp_ctx* ctx;
+  const char* filename;
+
+  // Forms from the reader, and results for the writer
+  blisp_ring forms;
+  blisp_ring results;
+
+  // Set by the evaluator at the first error, to stop the reader early
+  int stop;
+  // The reader's parse error, if it had one
+  mpc_err_t* error;
+  // The last result printed, which the writer keeps to be returned
+  lval* last;
+} blisp_pipeline;
+
+// Spin for a while, then give up the CPU to the other stages
+static void blisp_ring_wait(int* spins) {
+  if (++(*spins) > 64) sched_yield();
+}
+
+static void blisp_ring_push(blisp_ring* ring, lval* val) {
+  size_t tail = ring->tail;
+  int spins = 0;
+  while (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)
+      == BLISP_RING_SIZE) {
+    blisp_ring_wait(&spins);
+  }
+  ring->slots[tail & (BLISP_RING_SIZE - 1)] = val;
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static lval* blisp_ring_pop(blisp_ring* ring) {
+  size_t head = ring->head;
+  int spins = 0;
+  while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == head) {
+    blisp_ring_wait(&spins);
+  }
+  lval* val = ring->slots[head & (BLISP_RING_SIZE - 1)];
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  return val;
+}
+
+static void* blisp_reader_run(void* arg) {
+  blisp_pipeline* pl = arg;
+  lreader* reader = pl->ctx->reader;
+  char* input = pl->ctx->in_buf;
+  long pos = 0;
+  long row = 0;
+
+  while (input[pos] != '\0' && !__atomic_load_n(&pl->stop, __ATOMIC_ACQUIRE)) {
+    // End the chunk at the first newline outside of any form once it is
+    // long enough, so it holds whole forms and starts a line
+    long end = pos;
+    long rows = 0;
+    int depth = 0;
+    char c;
+    while ((c = input[end]) != '\0') {
+      end++;
+      if (c == '(' || c == '{') depth++;
+      if (c == ')' || c == '}') depth--;
+      if (c == '\n') {
+        rows++;
+        if (depth <= 0 && end - pos >= BLISP_CHUNK_SIZE) break;
+      }
+    }
+
+    // Parse the chunk as input of its own, by ending the string after it
+    mpc_result_t mpc_result;
+    char saved = input[end];
+    input[end] = '\0';
+    int ok = mpc_parse_mode(pl->filename, input + pos, reader->blisp,
+      &mpc_result, BLISP_PARSE_MODE, NULL);
+    input[end] = saved;
+
+    if (!ok) {
+      // Report the position in the whole file
+      mpc_result.error->state.pos += pos;
+      mpc_result.error->state.row += row;
+      pl->error = mpc_result.error;
+      break;
+    }
+
+    lval* val = lval_read(reader, mpc_result.output);
+    mpc_ast_delete(mpc_result.output);
+    for (int i = 0; i < val->count; i++) {
+      blisp_ring_push(&pl->forms, val->cell[i]);
+    }
+    val->count = 0;
+    lval_del(val);
+
+    pos = end;
+    row += rows;
+  }
+
+  blisp_ring_push(&pl->forms, NULL);
+  return NULL;
+}
+
+static void* blisp_writer_run(void* arg) {
+  blisp_pipeline* pl = arg;
+
+  lval* result;
+  while ((result = blisp_ring_pop(&pl->results)) != NULL) {
+    blisp_print(pl->ctx, result);
+    if (pl->last) lval_del(pl->last);
+    pl->last = result;
+  }
+  blisp_flush(pl->ctx);
+  return NULL;
+}
+
+lval* blisp_eval_file_pipelined(blisp_ctx* ctx, const char* filename) {
+  // A compiled file needs no parsing, so there is nothing to overlap
+  lval* forms;
+  if (blisp_map_compiled(ctx, filename, &forms)) {
+    return forms ? blisp_eval_forms(ctx, forms) : NULL;
+  }
+
+  if (!blisp_load(ctx, filename)) return NULL;
+
+  blisp_pipeline* pl = malloc(sizeof(blisp_pipeline));
+  pl->ctx = ctx;
+  pl->filename = filename;
+  pl->forms.head = pl->forms.tail = 0;
+  pl->results.head = pl->results.tail = 0;
+  pl->stop = 0;
+  pl->error = NULL;
+  pl->last = NULL;
+
+  pthread_t reader;
+  pthread_t writer;
+  pthread_create(&reader, NULL, blisp_reader_run, pl);
+  pthread_create(&writer, NULL, blisp_writer_run, pl);
+
+  // Evaluate here, so native functions are only ever called from the
+  // thread that called in. After the first error, the forms still to
+  // come are dropped.
+  int failed = 0;
+  lval* form;
+  while ((form = blisp_ring_pop(&pl->forms)) != NULL) {
+    if (failed) {
+      lval_del(form);
+      continue;
+    }
+    lval* result = lval_eval(ctx->env, form);
+    if (result->type == LVAL_ERR) {
+      failed = 1;
+      __atomic_store_n(&pl->stop, 1, __ATOMIC_RELEASE);
+    }
+    blisp_ring_push(&pl->results, result);
+  }
+  blisp_ring_push(&pl->results, NULL);
+
+  pthread_join(reader, NULL);
+  pthread_join(writer, NULL);
+
+  lval* result = pl->last ? pl->last : lval_sexpr();
+  if (pl->error) {
+    blisp_set_error(ctx, mpc_err_string(pl->error));
+    mpc_err_delete(pl->error);
+    lval_del(result);
+    result = NULL;
+  }
+
+  free(pl);
+  return result;
+}
+
+/*
+ * Per-line evaluation
+ *
+ * The expression is read once, and each line of input is split into a
+ * Q-expression of its fields, bound to BLISP_EACH_SYM, and a copy of the
+ * expression evaluated against it. Lines are split with lval_read_fields
+ * rather than parsed, as a log line is rarely valid blisp, and this keeps
+ * the parser out of the loop entirely.
+ */
+
+// The symbol each line is bound to
+#define BLISP_EACH_SYM "line"
+
+// Bind a line's fields in the slot held for them, evaluate the expression
+// against them and print the result. Returns whether it was an error.
+static int blisp_each_line(blisp_ctx* ctx, lval* expr, int slot, char* line,
+    char* end) {
+  lval_del(ctx->env->vals[slot]);
+  ctx->env->vals[slot] = lval_read_fields(line, end);
+
+  lval* result = lval_eval(ctx->env, lval_copy(expr));
+  int failed = result->type == LVAL_ERR;
+  blisp_print(ctx, result);
+  lval_del(result);
+  return failed;
+}
+
+int blisp_eval_each(blisp_ctx* ctx, const char* expr, FILE* in) {
+  lval* val = blisp_read(ctx, "<each>", expr);
+  if (val == NULL) return -1;
+
+  // Bind the symbol once, and find its slot so each line can be swapped
+  // straight into it
+  lval* key = lval_sym(BLISP_EACH_SYM);
+  lval* fields = lval_qexpr();
+  lenv_put(ctx->env, key, fields);
+  lval_del(key);
+  lval_del(fields);
+  int slot = 0;
+  while (strcmp(ctx->env->syms[slot], BLISP_EACH_SYM) != 0) slot++;
+
+  if (ctx->in_size < BLISP_CHUNK_SIZE) {
+    ctx->in_size = BLISP_CHUNK_SIZE;
+    ctx->in_buf = realloc(ctx->in_buf, ctx->in_size);
+  }
+
+  // Read the input in blocks and evaluate each whole line in them, keeping
+  // a partial line at the end for the next block. One byte is left spare
+  // so the last field can always be terminated.
+  int errors = 0;
+  size_t len = 0;
+  size_t n;
+  while ((n = fread(ctx->in_buf + len, 1, ctx->in_size - len - 1, in)) > 0) {
+    len += n;
+
+    char* line = ctx->in_buf;
+    char* end = ctx->in_buf + len;
+    char* nl;
+    while ((nl = memchr(line, '\n', end - line)) != NULL) {
+      errors += blisp_each_line(ctx, val, slot, line, nl);
+      line = nl + 1;
+    }
+
+    len = end - line;
+    memmove(ctx->in_buf, line, len);
+    if (ctx->in_size - len - 1 == 0) {
+      ctx->in_size *= 2;
+      ctx->in_buf = realloc(ctx->in_buf, ctx->in_size);
+    }
+  }
+  if (len > 0) {
+    errors += blisp_each_line(ctx, val, slot, ctx->in_buf, ctx->in_buf + len);
+  }
+  blisp_flush(ctx);
+
+  lval_del(val);
+  return errors;
+}
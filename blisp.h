@@ -1,7 +1,124 @@
 #ifndef BLISP_H
 #define BLISP_H
 
+#include <stdio.h>
+
+#include "lval.h"
+
 // When enabled, prints the AST using the mpc library.
 //#define BLISP_PRINT_AST
 
+/*
+ * An interpreter context, for embedding blisp. It owns the parsers, the
+ * environment, and the buffers that input is read into and results are
+ * printed from, so each thread may run its own context without locking.
+ *
+ * The tag table that mpc interns rule names into is shared by every
+ * grammar, and is filled in when the first context is created. Create one
+ * context before starting threads that create their own.
+ */
+typedef struct blisp_ctx blisp_ctx;
+
+// Create a new context, which prints nothing until given an output
+blisp_ctx* blisp_ctx_new();
+
+// Delete a context along with its environment
+void blisp_ctx_del(blisp_ctx* ctx);
+
+/*
+ * Print every result evaluated to OUT, one per line, or nothing if it is
+ * NULL. The results of each eval call are written out before it returns.
+ */
+void blisp_ctx_output(blisp_ctx* ctx, FILE* out);
+
+/*
+ * Add a native function under NAME, replacing any earlier one and taking
+ * precedence over the built-in functions. It is passed the evaluated
+ * arguments as an S-expression, which it must delete, and returns its
+ * result, or an error made with lval_err.
+ */
+void blisp_register(blisp_ctx* ctx, const char* name, lbuiltin func);
+
+/*
+ * Add the file functions of io.h: `read-file`, `read-lines` and
+ * `write-file`, which name files by symbols such as ./data.txt, with the
+ * limits io.h gives. A context starts without them, since they read and
+ * write any file the process can. Only add them where the code being
+ * evaluated is trusted, never for input from the network.
+ */
+void blisp_register_files(blisp_ctx* ctx);
+
+// Bind NAME to a copy of VAL, which symbols of that name evaluate to
+void blisp_define(blisp_ctx* ctx, const char* name, lval* val);
+
+/*
+ * Evaluate the whole of INPUT as one S-expression, as the REPL does with a
+ * line. NAME is used for the position in parse errors. Returns the result,
+ * which the caller deletes, or NULL if the input could not be parsed.
+ */
+lval* blisp_eval_string(blisp_ctx* ctx, const char* name, const char* input);
+
+/*
+ * Evaluate each top-level expression in the file in turn, stopping at the
+ * first error. Returns the last result, which the caller deletes, or NULL
+ * if the file could not be read or parsed.
+ *
+ * Files written by blisp_compile_file are recognised by their header and
+ * mapped rather than parsed.
+ */
+lval* blisp_eval_file(blisp_ctx* ctx, const char* filename);
+
+/*
+ * Read a script and write its forms to OUTPUT in the compiled format of
+ * blc.h. Returns 0 with the error set if the script can't be read or
+ * parsed, or the output can't be written.
+ */
+int blisp_compile_file(blisp_ctx* ctx, const char* filename,
+    const char* output);
+
+/*
+ * Evaluate a file as blisp_eval_file does, but in three threads: one
+ * parsing the file a chunk at a time, the calling thread evaluating each
+ * form as soon as it is read, and one printing the results. Native
+ * functions are still only called from the calling thread.
+ *
+ * The file is parsed as it is evaluated, so forms some way before a parse
+ * error may have been evaluated and printed by the time NULL is returned.
+ */
+lval* blisp_eval_file_pipelined(blisp_ctx* ctx, const char* filename);
+
+/*
+ * Evaluate EXPR, as blisp_eval_string would, once for each line of IN,
+ * with the symbol `line` bound to a Q-expression of the line's fields.
+ * Fields are split on spaces and tabs, and are numbers where they read as
+ * one and symbols otherwise. Each result is printed, and `line` is left
+ * bound to the last line.
+ *
+ * Returns the number of lines whose result was an error, or -1 if EXPR
+ * could not be parsed.
+ */
+int blisp_eval_each(blisp_ctx* ctx, const char* expr, FILE* in);
+
+/*
+ * Save every binding in the context, including any still only in a loaded
+ * image, as an image that can be mapped back in with blisp_load_image.
+ * Native functions are saved by the name they were registered under.
+ * Returns 0 with the error set if the image can't be written.
+ */
+int blisp_save_image(blisp_ctx* ctx, const char* filename);
+
+/*
+ * Replace the context's bindings with those of an image, keeping the
+ * native functions registered. Register the natives the image refers to
+ * first: any missing are bound to an error.
+ *
+ * The image stays mapped, and each binding is only read from it the first
+ * time it is looked up, so loading costs the same however large it is.
+ * Returns 0 with the error set if the file isn't a valid image.
+ */
+int blisp_load_image(blisp_ctx* ctx, const char* filename);
+
+// The message for the last call that failed
+const char* blisp_error(blisp_ctx* ctx);
+
 #endif
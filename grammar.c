@@ -0,0 +1,18 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mpc.h"
+#include "reader.h"
+
+// Writes the blisp parsers out as static C data, to be compiled
+// into mpc.c with MPC_GRAMMAR so blisp starts without building them
+int main(int argc, char** argv) {
+  lreader* reader = malloc(sizeof(lreader));
+  lreader_build(reader);
+
+  int ok = mpc_emit(stdout, "blisp", 5, reader->symbol, reader->sexpr,
+    reader->qexpr, reader->expr, reader->blisp);
+
+  lreader_del(reader);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,523 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "io.h"
+#include "reader.h"
+
+// The most jobs in flight at once, which is also the size of the ring
+#define LIO_RING_SIZE 256
+
+// The most threads the fallback pool runs jobs in, the caller's included
+#define LIO_THREADS 8
+
+// Reads start with a buffer this size, which doubles as it fills
+#define LIO_READ_SIZE 4096
+
+// A job opens its file, reads or writes it, and closes it, with one
+// operation in flight at a time
+enum { LIO_OPEN, LIO_IO, LIO_CLOSE, LIO_DONE };
+
+void lio_read_job(lio_job* job, const char* path) {
+  memset(job, 0, sizeof(lio_job));
+  job->path = path;
+  job->fd = -1;
+}
+
+void lio_write_job(lio_job* job, const char* path, char* data, size_t len) {
+  lio_read_job(job, path);
+  job->write = 1;
+  job->data = data;
+  job->len = len;
+}
+
+// Make room in a read's buffer for another read, keeping a byte for the NUL
+static void lio_grow(lio_job* job) {
+  if (job->cap - job->len > 1) return;
+  job->cap = job->cap ? job->cap * 2 : LIO_READ_SIZE;
+  job->data = realloc(job->data, job->cap);
+}
+
+static void lio_finish(lio_job* job) {
+  job->state = LIO_DONE;
+  if (job->write) return;
+
+  if (job->error) {
+    free(job->data);
+    job->data = NULL;
+    job->len = 0;
+  } else {
+    lio_grow(job);
+    job->data[job->len] = '\0';
+  }
+}
+
+// Move a job on with the result of its last operation, as the kernel gives
+// it: a count or file descriptor, or a negated errno
+static void lio_complete(lio_job* job, int res) {
+  if (res == -EINTR || res == -EAGAIN) return;
+
+  switch (job->state) {
+    case LIO_OPEN:
+      if (res < 0) {
+        job->error = -res;
+        lio_finish(job);
+        return;
+      }
+      job->fd = res;
+      job->state = LIO_IO;
+      break;
+    case LIO_IO:
+      if (res < 0) {
+        job->error = -res;
+        job->state = LIO_CLOSE;
+      } else if (job->write) {
+        job->done += res;
+      } else if (res == 0) {
+        job->state = LIO_CLOSE;
+      } else {
+        job->len += res;
+      }
+      break;
+    case LIO_CLOSE:
+      // A failed close can lose written data, so it counts
+      if (res < 0 && job->error == 0) job->error = -res;
+      lio_finish(job);
+      return;
+  }
+
+  if (job->state == LIO_IO && job->write && job->done == job->len) {
+    job->state = LIO_CLOSE;
+  }
+}
+
+/*
+ * Thread pool
+ */
+
+// Run a job's next operation with an ordinary system call
+static int lio_sync_op(lio_job* job) {
+  int res;
+  switch (job->state) {
+    case LIO_OPEN:
+      res = job->write
+        ? open(job->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)
+        : open(job->path, O_RDONLY | O_CLOEXEC);
+      break;
+    case LIO_IO:
+      if (job->write) {
+        res = write(job->fd, job->data + job->done, job->len - job->done);
+      } else {
+        lio_grow(job);
+        res = read(job->fd, job->data + job->len, job->cap - job->len - 1);
+      }
+      break;
+    default:
+      res = close(job->fd);
+      break;
+  }
+  return res < 0 ? -errno : res;
+}
+
+typedef struct {
+  lio_job* jobs;
+  int count;
+  int next;
+} lio_pool;
+
+static void* lio_pool_run(void* arg) {
+  lio_pool* pool = arg;
+  int i;
+  while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) <
+      pool->count) {
+    lio_job* job = &pool->jobs[i];
+    while (job->state != LIO_DONE) lio_complete(job, lio_sync_op(job));
+  }
+  return NULL;
+}
+
+static void lio_run_pool(lio_job* jobs, int count) {
+  lio_pool pool = { jobs, count, 0 };
+
+  // The calling thread takes jobs too, so one job needs no threads
+  pthread_t threads[LIO_THREADS];
+  int started = 0;
+  while (started < LIO_THREADS - 1 && started < count - 1 &&
+      pthread_create(&threads[started], NULL, lio_pool_run, &pool) == 0) {
+    started++;
+  }
+  lio_pool_run(&pool);
+
+  for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+}
+
+/*
+ * io_uring
+ *
+ * Driven through the raw system calls, so there is nothing extra to link.
+ * Every job has at most one operation in flight, and no more jobs are
+ * started than the ring has entries, so neither queue can overflow.
+ */
+
+typedef struct {
+  int fd;
+  unsigned entries;
+
+  // The submission queue, of which `queued` entries are filled in but not
+  // yet published to the kernel
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  struct io_uring_sqe* sqes;
+  unsigned queued;
+
+  // The completion queue
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_cqe* cqes;
+
+  // The mappings, which the completion queue may share with the submission
+  // queue
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+} lio_ring;
+
+static void lio_ring_free(lio_ring* ring) {
+  if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  if (ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+}
+
+static int lio_ring_init(lio_ring* ring, unsigned entries) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (ring->fd < 0) return 0;
+
+  ring->sq_ring = ring->cq_ring = ring->sqes = MAP_FAILED;
+
+  // Opening, reading and closing by path came in 5.6, along with this
+  if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+    lio_ring_free(ring);
+    return 0;
+  }
+
+  ring->entries = p.sq_entries;
+  ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size =
+    p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  int single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && ring->cq_ring_size > ring->sq_ring_size) {
+    ring->sq_ring_size = ring->cq_ring_size;
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring != MAP_FAILED && single) {
+    ring->cq_ring = ring->sq_ring;
+  } else if (ring->sq_ring != MAP_FAILED) {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  }
+  ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  if (ring->cq_ring != MAP_FAILED) {
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  }
+  if (ring->sqes == MAP_FAILED) {
+    lio_ring_free(ring);
+    return 0;
+  }
+
+  char* sq = ring->sq_ring;
+  ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+  ring->queued = 0;
+
+  char* cq = ring->cq_ring;
+  ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+  return 1;
+}
+
+// Fill in the submission queue entry for a job's next operation
+static void lio_ring_queue(lio_ring* ring, lio_job* job) {
+  unsigned i = (*ring->sq_tail + ring->queued++) & *ring->sq_mask;
+  struct io_uring_sqe* sqe = &ring->sqes[i];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = (uintptr_t)job;
+  ring->sq_array[i] = i;
+
+  switch (job->state) {
+    case LIO_OPEN:
+      sqe->opcode = IORING_OP_OPENAT;
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (uintptr_t)job->path;
+      sqe->len = 0666;
+      sqe->open_flags = job->write
+        ? O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC
+        : O_RDONLY | O_CLOEXEC;
+      break;
+    case LIO_IO:
+      sqe->fd = job->fd;
+      if (job->write) {
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->addr = (uintptr_t)(job->data + job->done);
+        sqe->len = job->len - job->done;
+        sqe->off = job->done;
+      } else {
+        lio_grow(job);
+        sqe->opcode = IORING_OP_READ;
+        sqe->addr = (uintptr_t)(job->data + job->len);
+        sqe->len = job->cap - job->len - 1;
+        sqe->off = job->len;
+      }
+      break;
+    default:
+      sqe->opcode = IORING_OP_CLOSE;
+      sqe->fd = job->fd;
+      break;
+  }
+}
+
+// Publish the queued entries, submit every entry the kernel hasn't taken
+// yet, and wait for at least one completion
+static int lio_ring_submit(lio_ring* ring) {
+  unsigned tail = *ring->sq_tail + ring->queued;
+  __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+  ring->queued = 0;
+
+  unsigned pending = tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  while (syscall(__NR_io_uring_enter, ring->fd, pending, 1,
+        IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+    if (errno != EINTR && errno != EAGAIN && errno != EBUSY) return 0;
+  }
+  return 1;
+}
+
+// Run the jobs on RING. Returns 0 if the ring failed, after failing the
+// jobs left over, and the ring is no longer fit to use.
+static int lio_run_ring(lio_ring* ring, lio_job* jobs, int count) {
+  int next = 0;
+  int active = 0;
+  int done = 0;
+  while (done < count) {
+    while (next < count && active < (int)ring->entries) {
+      lio_ring_queue(ring, &jobs[next++]);
+      active++;
+    }
+    if (!lio_ring_submit(ring)) break;
+
+    // Take each completion, and queue the next operation of its job
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+      lio_job* job = (lio_job*)(uintptr_t)cqe->user_data;
+      lio_complete(job, cqe->res);
+      if (job->state == LIO_DONE) {
+        active--;
+        done++;
+      } else {
+        lio_ring_queue(ring, job);
+      }
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  if (done == count) return 1;
+
+  // Only a misused ring fails to submit. Closing it cancels what is in
+  // flight, and the jobs left over fail.
+  int error = errno;
+  lio_ring_free(ring);
+  for (int i = 0; i < count; i++) {
+    if (jobs[i].state == LIO_DONE) continue;
+    if (jobs[i].fd >= 0) close(jobs[i].fd);
+    jobs[i].error = error;
+    lio_finish(&jobs[i]);
+  }
+  return 0;
+}
+
+// The ring every lio_run shares, set up by the first and kept for the life
+// of the process, since setting one up costs a system call and three
+// mappings. One caller uses it at a time.
+static lio_ring lio_shared;
+static int lio_shared_ok;
+static pthread_once_t lio_shared_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t lio_shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void lio_shared_init(void) {
+  lio_shared_ok = lio_ring_init(&lio_shared, LIO_RING_SIZE);
+}
+
+// Run the jobs on the shared ring. Returns 0 without running any if there
+// is no ring, or another thread is using it.
+static int lio_run_shared(lio_job* jobs, int count) {
+  pthread_once(&lio_shared_once, lio_shared_init);
+  if (pthread_mutex_trylock(&lio_shared_lock) != 0) return 0;
+
+  int ran = lio_shared_ok;
+  if (ran && !lio_run_ring(&lio_shared, jobs, count)) lio_shared_ok = 0;
+  pthread_mutex_unlock(&lio_shared_lock);
+  return ran;
+}
+
+void lio_run(lio_job* jobs, int count) {
+  if (count == 0) return;
+#ifndef LIO_NO_URING
+  if (lio_run_shared(jobs, count)) return;
+#endif
+  lio_run_pool(jobs, count);
+}
+
+/*
+ * Builtins
+ */
+
+// An error naming the file that failed
+static lval* lio_err(const char* fmt, const char* path) {
+  char* msg = malloc(strlen(fmt) + strlen(path) + 1);
+  sprintf(msg, fmt, path);
+  lval* err = lval_err(msg);
+  free(msg);
+  return err;
+}
+
+// Read a file's data as a Q-Expr of its fields, or of its lines
+static lval* lio_contents(lio_job* job, int lines) {
+  if (job->error) return lio_err("Cannot read '%s'", job->path);
+  if (!lines) return lval_read_fields(job->data, job->data + job->len);
+
+  // Count the lines first, so the cells are allocated once. A last line
+  // without a newline still counts.
+  char* end = job->data + job->len;
+  int count = 0;
+  for (char* c = job->data; c < end; count++) {
+    char* nl = memchr(c, '\n', end - c);
+    c = nl ? nl + 1 : end;
+  }
+
+  lval* res = lval_qexpr();
+  if (count == 0) return res;
+  res->cell = malloc(sizeof(lval*) * count);
+  for (char* c = job->data; res->count < count; ) {
+    char* nl = memchr(c, '\n', end - c);
+    if (nl == NULL) nl = end;
+    res->cell[res->count++] = lval_read_fields(c, nl);
+    c = nl + 1;
+  }
+  return res;
+}
+
+// True if VAL names files: a symbol, or a Q-Expr of them
+static int lio_is_paths(lval* val) {
+  if (val->type == LVAL_SYM) return 1;
+  if (val->type != LVAL_QEXPR) return 0;
+  for (int i = 0; i < val->count; i++) {
+    if (val->cell[i]->type != LVAL_SYM) return 0;
+  }
+  return 1;
+}
+
+// Read every file named at once, giving the contents of one file, or a
+// Q-Expr of the contents of each
+static lval* lio_read(lval* val, int lines) {
+  lval* paths = val->cell[0];
+  int many = paths->type == LVAL_QEXPR;
+  int count = many ? paths->count : 1;
+
+  lio_job* jobs = malloc(sizeof(lio_job) * (count + 1));
+  for (int i = 0; i < count; i++) {
+    lio_read_job(&jobs[i], many ? paths->cell[i]->sym : paths->sym);
+  }
+  lio_run(jobs, count);
+
+  lval* res = lval_qexpr();
+  res->cell = malloc(sizeof(lval*) * (count + 1));
+  for (int i = 0; i < count; i++) {
+    res->cell[res->count++] = lio_contents(&jobs[i], lines);
+    free(jobs[i].data);
+  }
+  free(jobs);
+  lval_del(val);
+
+  return many ? res : lval_take(res, 0);
+}
+
+lval* builtin_read_file(lenv* env, lval* val) {
+  LASSERT(val, val->count == 1,
+    "Function 'read-file' passed too many arguments");
+  LASSERT(val, lio_is_paths(val->cell[0]),
+    "Function 'read-file' passed incorrect type");
+
+  return lio_read(val, 0);
+}
+
+lval* builtin_read_lines(lenv* env, lval* val) {
+  LASSERT(val, val->count == 1,
+    "Function 'read-lines' passed too many arguments");
+  LASSERT(val, lio_is_paths(val->cell[0]),
+    "Function 'read-lines' passed incorrect type");
+
+  return lio_read(val, 1);
+}
+
+lval* builtin_write_file(lenv* env, lval* val) {
+  LASSERT(val, val->count == 2,
+    "Function 'write-file' passed incorrect number of arguments");
+  LASSERT(val, val->cell[0]->type == LVAL_SYM &&
+      val->cell[1]->type == LVAL_QEXPR,
+    "Function 'write-file' passed incorrect types");
+
+  // Print each value on a line of its own, growing the buffer when one
+  // doesn't fit and printing it again
+  lval* values = val->cell[1];
+  size_t size = LIO_READ_SIZE;
+  size_t len = 0;
+  char* data = malloc(size);
+  for (int i = 0; i < values->count; i++) {
+    size_t n = lval_to_string(values->cell[i], data + len, size - len);
+    if (len + n + 2 > size) {
+      while (len + n + 2 > size) size *= 2;
+      data = realloc(data, size);
+      lval_to_string(values->cell[i], data + len, size - len);
+    }
+    len += n;
+    data[len++] = '\n';
+  }
+
+  lio_job job;
+  lio_write_job(&job, val->cell[0]->sym, data, len);
+  lio_run(&job, 1);
+  free(data);
+
+  lval* res = job.error
+    ? lio_err("Cannot write '%s'", job.path)
+    : lval_num((long)len);
+  lval_del(val);
+  return res;
+}
@@ -0,0 +1,69 @@
+#ifndef BLISP_IO_H
+#define BLISP_IO_H
+
+#include <stddef.h>
+
+#include "lval.h"
+
+// When defined, files are always read and written by a pool of threads,
+// even where the kernel has io_uring
+//#define LIO_NO_URING
+
+// A file to read or write with lio_run
+typedef struct {
+  const char* path;
+  // Set to write DATA out to the file, replacing it, rather than read it
+  int write;
+
+  // The data to write, or the data read, NUL-terminated, which the caller
+  // frees. Left NULL if a read fails.
+  char* data;
+  size_t len;
+
+  // 0, or the errno the file failed with
+  int error;
+
+  // Where the job has got to, used by lio_run
+  int fd;
+  int state;
+  size_t done;
+  size_t cap;
+} lio_job;
+
+// Set up a job to read the file at PATH, or to write LEN bytes of DATA to it
+void lio_read_job(lio_job* job, const char* path);
+void lio_write_job(lio_job* job, const char* path, char* data, size_t len);
+
+/*
+ * Run every job at once, submitting their opens, reads, writes and closes
+ * through io_uring in batches, so a few system calls cover many files.
+ * The process sets up one ring the first time and reuses it. Where
+ * io_uring is missing or too old, or another thread is using the ring, a
+ * pool of threads runs the jobs with ordinary system calls instead.
+ * Returns when every job is done.
+ */
+void lio_run(lio_job* jobs, int count);
+
+/*
+ * Native functions reading and writing files, for blisp_register. They can
+ * reach any file the process can, so they are only added to contexts that
+ * ask for them, with blisp_register_files.
+ *
+ * Paths are symbols, so they can hold letters, digits, '.', '/', '_', '-'
+ * and the operator characters, but not spaces, quotes or other
+ * punctuation. One made only of digits reads as a number, so 2024.log is
+ * a path but 2024 is written as ./2024.
+ */
+
+// Reads a file, or a Q-Expr of files at once, as Q-Exprs of their fields
+lval* builtin_read_file(lenv* env, lval* val);
+
+// Reads a file, or a Q-Expr of files at once, as Q-Exprs of their lines,
+// each a Q-Expr of its fields
+lval* builtin_read_lines(lenv* env, lval* val);
+
+// Writes each value in a Q-Expr to a file, one per line, and returns the
+// number of bytes written
+lval* builtin_write_file(lenv* env, lval* val);
+
+#endif
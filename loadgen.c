@@ -0,0 +1,201 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Sends requests to a blisp server from a number of connections, each
+// waiting for one response before sending the next, and reports the
+// throughput and latency seen
+typedef struct {
+  const char* path;
+  const char* expr;
+  int framed;
+  long requests;
+
+  // Latency of each request, in nanoseconds
+  long* latencies;
+  long errors;
+  pthread_t thread;
+} lclient;
+
+static long lclock() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+static int lconnect(const char* path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    perror(path);
+    exit(1);
+  }
+  return fd;
+}
+
+static int lsend(int fd, const char* buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+    if (n <= 0) return 0;
+    buf += n;
+    len -= n;
+  }
+  return 1;
+}
+
+// Read one response to the front of buf, dropping the one before it. Of
+// the bytes buf holds, the first `used` are that last response. Returns
+// the length of the response, or -1 on end of input.
+static long lrecv(int fd, int framed, char* buf, size_t size, size_t* have,
+    size_t* used) {
+  memmove(buf, buf + *used, *have - *used);
+  *have -= *used;
+  *used = 0;
+
+  while (1) {
+    char* nl = memchr(buf, '\n', *have);
+    if (nl) {
+      size_t len = nl - buf + 1;
+      if (framed) len += strtoul(buf + 1, NULL, 10);
+      if (len <= *have) {
+        *used = len;
+        return (long)len;
+      }
+    }
+
+    if (*have == size) return -1;
+    ssize_t n = recv(fd, buf + *have, size - *have, 0);
+    if (n <= 0) return -1;
+    *have += n;
+  }
+}
+
+static void* lclient_run(void* arg) {
+  lclient* c = arg;
+  int fd = lconnect(c->path);
+
+  size_t expr_len = strlen(c->expr);
+  char* request = malloc(expr_len + 32);
+  size_t request_len;
+  if (c->framed) {
+    request_len = sprintf(request, "@%zu\n", expr_len);
+    memcpy(request + request_len, c->expr, expr_len);
+    request_len += expr_len;
+  } else {
+    request_len = sprintf(request, "%s\n", c->expr);
+  }
+
+  size_t size = 1 << 20;
+  char* buf = malloc(size);
+  size_t have = 0;
+  size_t used = 0;
+
+  for (long i = 0; i < c->requests; i++) {
+    long start = lclock();
+    if (!lsend(fd, request, request_len)) break;
+    long len = lrecv(fd, c->framed, buf, size, &have, &used);
+    if (len < 0) break;
+    c->latencies[i] = lclock() - start;
+
+    // Count the responses that are errors, skipping a frame's header
+    char* body = c->framed ? memchr(buf, '\n', len) + 1 : buf;
+    if (strncmp(body, "[ERROR]", strlen("[ERROR]")) == 0) c->errors++;
+  }
+
+  free(request);
+  free(buf);
+  close(fd);
+  return NULL;
+}
+
+static int lcompare(const void* a, const void* b) {
+  long x = *(const long*)a;
+  long y = *(const long*)b;
+  return (x > y) - (x < y);
+}
+
+static void lusage() {
+  fputs("usage: loadgen socket [-c connections] [-n requests] "
+    "[-e expr] [-f]\n", stderr);
+  exit(2);
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) lusage();
+
+  const char* path = argv[1];
+  const char* expr = "+ 1 (* 2 3) (- 10 4)";
+  long conns = 8;
+  long requests = 100000;
+  int framed = 0;
+
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      conns = strtol(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      requests = strtol(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+      expr = argv[++i];
+    } else if (strcmp(argv[i], "-f") == 0) {
+      framed = 1;
+    } else {
+      lusage();
+    }
+  }
+  if (conns < 1 || requests < conns) lusage();
+
+  // Share the requests out between the connections
+  long* latencies = calloc(requests, sizeof(long));
+  lclient* clients = malloc(sizeof(lclient) * conns);
+  long start = lclock();
+  long offset = 0;
+  for (long i = 0; i < conns; i++) {
+    lclient* c = &clients[i];
+    c->path = path;
+    c->expr = expr;
+    c->framed = framed;
+    c->requests = requests / conns + (i < requests % conns);
+    c->latencies = latencies + offset;
+    c->errors = 0;
+    offset += c->requests;
+    pthread_create(&c->thread, NULL, lclient_run, c);
+  }
+
+  long errors = 0;
+  for (long i = 0; i < conns; i++) {
+    pthread_join(clients[i].thread, NULL);
+    errors += clients[i].errors;
+  }
+  double seconds = (lclock() - start) / 1e9;
+
+  // Requests that never got a response are left at zero, and sort first
+  qsort(latencies, requests, sizeof(long), lcompare);
+  long done = 0;
+  while (done < requests && latencies[requests - 1 - done] > 0) done++;
+  long* lat = latencies + (requests - done);
+
+  printf("requests    %ld (%ld errors, %ld unanswered)\n",
+    done, errors, requests - done);
+  printf("connections %ld\n", conns);
+  printf("time        %.3f s\n", seconds);
+  printf("throughput  %.0f requests/s\n", done / seconds);
+  if (done > 0) {
+    printf("latency     p50 %.1f us, p99 %.1f us, max %.1f us\n",
+      lat[done / 2] / 1e3, lat[done * 99 / 100] / 1e3, lat[done - 1] / 1e3);
+  }
+
+  free(latencies);
+  free(clients);
+  return done == requests ? 0 : 1;
+}
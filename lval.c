@@ -50,37 +50,223 @@ lval* lval_fun(lbuiltin func) {
   return val;
 }
 
-void lval_print(lval* val) {
+/*
+ * A printer renders lvals either into a caller's buffer, truncating at its
+ * size, or into a buffer that is written to a stream whenever it fills up.
+ * `len` counts the bytes in the buffer and `total` every byte printed,
+ * including those that did not fit.
+ */
+typedef struct {
+  char* buf;
+  size_t size;
+  size_t len;
+  size_t total;
+  FILE* stream;
+} lprinter;
+
+// The size of the buffer lval_print and friends print into on the stack
+#define LVAL_PRINT_SIZE 4096
+
+static void lprinter_flush(lprinter* p) {
+  if (p->stream && p->len > 0) {
+    fwrite(p->buf, 1, p->len, p->stream);
+    p->len = 0;
+  }
+}
+
+static void lprinter_write(lprinter* p, const char* s, size_t n) {
+  p->total += n;
+
+  if (p->len + n > p->size) {
+    if (!p->stream) {
+      // Keep what fits of a string, and drop the rest
+      n = p->size - p->len;
+    } else {
+      // Write anything larger than the whole buffer straight through
+      lprinter_flush(p);
+      if (n > p->size) {
+        fwrite(s, 1, n, p->stream);
+        return;
+      }
+    }
+  }
+
+  if (n > 0) {
+    memcpy(p->buf + p->len, s, n);
+    p->len += n;
+  }
+}
+
+static void lprinter_putc(lprinter* p, char c) {
+  if (p->len < p->size) {
+    p->buf[p->len++] = c;
+    p->total++;
+  } else {
+    lprinter_write(p, &c, 1);
+  }
+}
+
+static void lprinter_puts(lprinter* p, const char* s) {
+  lprinter_write(p, s, strlen(s));
+}
+
+// Every two digit number, so numbers are formatted two digits at a time
+static const char lprinter_digits[] =
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+static void lprinter_num(lprinter* p, long num) {
+  char tmp[24];
+  char* end = tmp + sizeof(tmp);
+  char* c = end;
+
+  // Work with the magnitude unsigned, so LONG_MIN can be negated
+  unsigned long n = num < 0 ? 0UL - (unsigned long)num : (unsigned long)num;
+
+  while (n >= 100) {
+    const char* d = lprinter_digits + (n % 100) * 2;
+    n /= 100;
+    *--c = d[1];
+    *--c = d[0];
+  }
+  if (n >= 10) {
+    const char* d = lprinter_digits + n * 2;
+    *--c = d[1];
+    *--c = d[0];
+  } else {
+    *--c = (char)('0' + n);
+  }
+  if (num < 0) *--c = '-';
+
+  lprinter_write(p, c, (size_t)(end - c));
+}
+
+// Print anything that isn't a list
+static void lprinter_atom(lprinter* p, lval* val) {
   switch (val->type) {
     case LVAL_NUM:
-      printf("%li", val->num);
+      lprinter_num(p, val->num);
       break;
 
     case LVAL_ERR:
-      printf("[ERROR] %s", val->err);
+      lprinter_puts(p, "[ERROR] ");
+      lprinter_puts(p, val->err);
       break;
 
     case LVAL_SYM:
-      printf("%s", val->sym);
+      lprinter_puts(p, val->sym);
       break;
 
-    case LVAL_SEXPR:
-      lval_expr_print(val, '(', ')');
+    case LVAL_FUN:
+      lprinter_puts(p, "<function>");
       break;
+  }
+}
 
-    case LVAL_QEXPR:
-      lval_expr_print(val, '{', '}');
-      break;
+static char lval_open(lval* val) {
+  return val->type == LVAL_QEXPR ? '{' : '(';
+}
 
-    case LVAL_FUN:
-      printf("<function>");
-      break;
+static char lval_close(lval* val) {
+  return val->type == LVAL_QEXPR ? '}' : ')';
+}
+
+/*
+ * Print an lval without recursion. Each list being printed has a frame on
+ * the stack, holding the index of the cell being printed in it. Frames
+ * live on the C stack until the lists nest too deep, then move to the heap.
+ */
+static void lprinter_lval(lprinter* p, lval* val) {
+  typedef struct { lval* list; int i; } frame;
+
+  frame local[32];
+  frame* stack = local;
+  int size = 32;
+  int count = 0;
+
+  while (1) {
+    // Go down into lists until reaching an atom or an empty list
+    while (val->type == LVAL_SEXPR || val->type == LVAL_QEXPR) {
+      lprinter_putc(p, lval_open(val));
+      if (val->count == 0) {
+        lprinter_putc(p, lval_close(val));
+        break;
+      }
+
+      if (count == size) {
+        size *= 2;
+        if (stack == local) {
+          stack = malloc(sizeof(frame) * size);
+          memcpy(stack, local, sizeof(local));
+        } else {
+          stack = realloc(stack, sizeof(frame) * size);
+        }
+      }
+      stack[count].list = val;
+      stack[count].i = 0;
+      count++;
+      val = val->cell[0];
+    }
+
+    if (val->type != LVAL_SEXPR && val->type != LVAL_QEXPR) {
+      lprinter_atom(p, val);
+    }
+
+    // Close every list that has been printed in full, then move on to the
+    // next cell of the innermost one that hasn't
+    while (count > 0 && stack[count - 1].i == stack[count - 1].list->count - 1) {
+      lprinter_putc(p, lval_close(stack[--count].list));
+    }
+    if (count == 0) break;
+
+    frame* top = &stack[count - 1];
+    lprinter_putc(p, ' ');
+    val = top->list->cell[++top->i];
+  }
+
+  if (stack != local) free(stack);
+}
+
+void lval_print(lval* val, FILE* out) {
+  char buf[LVAL_PRINT_SIZE];
+  lprinter p = { buf, sizeof(buf), 0, 0, out };
+  lprinter_lval(&p, val);
+  lprinter_flush(&p);
+}
+
+void lval_println(lval* val, FILE* out) {
+  char buf[LVAL_PRINT_SIZE];
+  lprinter p = { buf, sizeof(buf), 0, 0, out };
+  lprinter_lval(&p, val);
+  lprinter_putc(&p, '\n');
+  lprinter_flush(&p);
+}
+
+void lval_expr_print(lval* val, char open, char close, FILE* out) {
+  char buf[LVAL_PRINT_SIZE];
+  lprinter p = { buf, sizeof(buf), 0, 0, out };
+  lprinter_putc(&p, open);
+
+  for (int i = 0; i < val->count; i++) {
+    // Print lval in cell
+    lprinter_lval(&p, val->cell[i]);
+
+    // Don't print trailing space for last element
+    if (i != (val->count-1)) {
+      lprinter_putc(&p, ' ');
+    }
   }
+
+  lprinter_putc(&p, close);
+  lprinter_flush(&p);
 }
 
-void lval_println(lval* val) {
-  lval_print(val);
-  printf("\n");
+size_t lval_to_string(lval* val, char* buf, size_t size) {
+  lprinter p = { buf, size > 0 ? size - 1 : 0, 0, 0, NULL };
+  lprinter_lval(&p, val);
+  if (size > 0) buf[p.len] = '\0';
+  return p.total;
 }
 
 void lval_del(lval* val) {
@@ -108,36 +294,6 @@ void lval_del(lval* val) {
   free(val);
 }
 
-lval* lval_read_num(mpc_ast_t* ast) {
-  errno = 0;
-  long val = strtol(ast->contents, NULL, 10);
-  return errno != ERANGE ? lval_num(val) : lval_err("Invalid number");
-}
-
-lval* lval_read(mpc_ast_t* ast) {
-  if (strstr(ast->tag, "number")) return lval_read_num(ast);
-  if (strstr(ast->tag, "symbol")) return lval_sym(ast->contents);
-
-  // If root ('>') or sexpr then create an empty list
-  lval* val = NULL;
-  if (strcmp(ast->tag, ">") == 0) val = lval_sexpr();
-  if (strstr(ast->tag, "sexpr")) val = lval_sexpr();
-  if (strstr(ast->tag, "qexpr")) val = lval_qexpr();
-
-  // Populate the above list with valid expressions
-  for (int i = 0; i < ast->children_num; i++) {
-    if (strcmp(ast->children[i]->contents, "(") == 0) continue;
-    if (strcmp(ast->children[i]->contents, ")") == 0) continue;
-    if (strcmp(ast->children[i]->contents, "{") == 0) continue;
-    if (strcmp(ast->children[i]->contents, "}") == 0) continue;
-    if (strcmp(ast->children[i]->tag, "regex") == 0) continue;
-
-    val = lval_add(val, lval_read(ast->children[i]));
-  }
-
-  return val;
-}
-
 lval* lval_add(lval* x, lval* y) {
   x->count++;
   x->cell = realloc(x->cell, sizeof(lval*) * x->count);
@@ -145,26 +301,28 @@ lval* lval_add(lval* x, lval* y) {
   return x;
 }
 
-void lval_expr_print(lval* val, char open, char close) {
-  putchar(open);
-
-  for (int i = 0; i < val->count; i++) {
-    // Print lval in cell
-    lval_print(val->cell[i]);
-
-    // Don't print trailing space for last element
-    if (i != (val->count-1)) {
-      putchar(' ');
+static lval* builtin_named(lenv* env, lval* val, char* func);
+
+lval* lval_eval_sexpr(lenv* env, lval* val) {
+  // Look the operator up once, before the arguments. A function found is
+  // called through the pointer kept here, and a symbol bound to nothing
+  // goes straight to the built-ins.
+  lbuiltin fun = NULL;
+  int i = 0;
+  if (val->count > 1 && val->cell[0]->type == LVAL_SYM && env) {
+    lval* bound = lenv_lookup(env, val->cell[0]->sym);
+    if (bound && bound->type == LVAL_FUN) {
+      fun = bound->fun;
+    } else if (bound) {
+      lval_del(val->cell[0]);
+      val->cell[0] = lval_copy(bound);
     }
+    i = 1;
   }
 
-  putchar(close);
-}
-
-lval* lval_eval_sexpr(lval* val) {
   // Evaluate children
-  for (int i = 0; i < val->count; i++) {
-    val->cell[i] = lval_eval(val->cell[i]);
+  for (; i < val->count; i++) {
+    val->cell[i] = lval_eval(env, val->cell[i]);
   }
 
   // Check for errors
@@ -176,7 +334,7 @@ lval* lval_eval_sexpr(lval* val) {
 
   // Handle empty expressions
   if (val->count == 0) {
-    return lval_take(val, 0);
+    return val;
   }
 
   // Handle single expressions
@@ -192,17 +350,27 @@ lval* lval_eval_sexpr(lval* val) {
     return lval_err("S-expression must start with a symbol");
   }
 
-  // Call builtin with operator
-  lval* result = builtin(val, first->sym);
+  // Call the function with the operator's name
+  lval* result = fun ? fun(env, val) : builtin_named(env, val, first->sym);
   lval_del(first);
 
   return result;
 }
 
-lval* lval_eval(lval* val) {
+lval* lval_eval(lenv* env, lval* val) {
   // S-Expressions are evaluated separately
   if (val->type == LVAL_SEXPR) {
-    return lval_eval_sexpr(val);
+    return lval_eval_sexpr(env, val);
+  }
+
+  // Symbols bound to a value evaluate to a copy of it. Functions are
+  // called by name, so their symbols are left as they are.
+  if (val->type == LVAL_SYM && env) {
+    lval* bound = lenv_lookup(env, val->sym);
+    if (bound && bound->type != LVAL_FUN) {
+      lval_del(val);
+      return lval_copy(bound);
+    }
   }
 
   // Other lval types remain the same
@@ -349,7 +517,7 @@ lval* builtin_list(lval* val) {
   return val;
 }
 
-lval* builtin_eval(lval* val) {
+lval* builtin_eval(lenv* env, lval* val) {
   LASSERT(val, val->count == 1,
     "Function 'eval' passed too many arguments");
   LASSERT(val, val->cell[0]->type == LVAL_QEXPR,
@@ -357,7 +525,7 @@ lval* builtin_eval(lval* val) {
 
   lval* res = lval_take(val, 0);
   res->type = LVAL_SEXPR;
-  return lval_eval(res);
+  return lval_eval(env, res);
 }
 
 lval* builtin_join(lval* val) {
@@ -376,11 +544,12 @@ lval* builtin_join(lval* val) {
   return res;
 }
 
-lval* builtin(lval* val, char* func) {
+// Call the built-in function named FUNC
+static lval* builtin_named(lenv* env, lval* val, char* func) {
   if (strcmp("head", func) == 0)  return builtin_head(val);
   if (strcmp("tail", func) == 0)  return builtin_tail(val);
   if (strcmp("list", func) == 0)  return builtin_list(val);
-  if (strcmp("eval", func) == 0)  return builtin_eval(val);
+  if (strcmp("eval", func) == 0)  return builtin_eval(env, val);
   if (strcmp("join", func) == 0)  return builtin_join(val);
   if (strstr("+-*/%^", func))     return builtin_op(val, func);
 
@@ -388,11 +557,22 @@ lval* builtin(lval* val, char* func) {
   return lval_err("Unknown function");
 }
 
+lval* builtin(lenv* env, lval* val, char* func) {
+  // Functions put in the environment come before the built-in ones
+  lval* bound = env ? lenv_lookup(env, func) : NULL;
+  if (bound && bound->type == LVAL_FUN) {
+    return bound->fun(env, val);
+  }
+  return builtin_named(env, val, func);
+}
+
 lenv* lenv_new() {
   lenv* env = malloc(sizeof(lenv));
   env->count = 0;
   env->syms = NULL;
   env->vals = NULL;
+  env->lazy = NULL;
+  env->lazy_data = NULL;
   return env;
 }
 
@@ -416,6 +596,24 @@ lval* lenv_get(lenv* env, lval* val) {
   return lval_err("Unbound symbol");
 }
 
+lval* lenv_lookup(lenv* env, const char* sym) {
+  for (int i = 0; i < env->count; i++) {
+    if (strcmp(env->syms[i], sym) == 0) return env->vals[i];
+  }
+  if (env->lazy == NULL) return NULL;
+
+  // Bind the value found the first time, so it is only looked up once
+  lval* val = env->lazy(env->lazy_data, sym);
+  if (val == NULL) return NULL;
+  env->count++;
+  env->vals = realloc(env->vals, sizeof(lval*) * env->count);
+  env->syms = realloc(env->syms, sizeof(char*) * env->count);
+  env->vals[env->count - 1] = val;
+  env->syms[env->count - 1] = malloc(strlen(sym) + 1);
+  strcpy(env->syms[env->count - 1], sym);
+  return val;
+}
+
 void lenv_put(lenv* env, lval* key, lval* val) {
   // Iterate to see if the key exists
   for (int i = 0; i < env->count; i++) {
@@ -41,6 +41,11 @@ struct lenv {
   char** syms;
   // the values
   lval** vals;
+
+  // Called with `lazy_data` for a symbol that isn't bound, to bind it on
+  // first lookup. Returns a new value for it, or NULL if it has none.
+  lval* (*lazy)(void* data, const char* sym);
+  void* lazy_data;
 };
 
 // Represents the type for lval.type
@@ -71,32 +76,37 @@ lval* lval_qexpr();
 // Create a new lval for a builtin
 lval* lval_fun(lbuiltin func);
 
-// Print an lval
-void lval_print(lval* val);
+// Print an lval to OUT
+void lval_print(lval* val, FILE* out);
 
-// Print an lval followed by a newline character
-void lval_println(lval* val);
+// Print an lval to OUT followed by a newline character
+void lval_println(lval* val, FILE* out);
 
 // Free the memory used by the lval
 void lval_del(lval* lval);
 
-// Read a number from the AST
-lval* lval_read_num(mpc_ast_t* ast);
-
-// Read the AST recursively and create a containing lval
-lval* lval_read(mpc_ast_t* ast);
-
 // Add the lval y to lval x's cells list
 lval* lval_add(lval* x, lval* y);
 
-// Print an lval expression
-void lval_expr_print(lval* val, char open, char close);
+/*
+ * Print an lval expression to OUT. The print functions buffer on the stack
+ * and have written everything to OUT when they return, so there is nothing
+ * to flush and nothing shared between threads.
+ */
+void lval_expr_print(lval* val, char open, char close, FILE* out);
 
-// Evaluate S-expressions
-lval* lval_eval_sexpr(lval* val);
+/*
+ * Print an lval into buf, writing at most size bytes including the
+ * terminating null. Returns the length of the whole string, so a result of
+ * size or more means it was cut short.
+ */
+size_t lval_to_string(lval* val, char* buf, size_t size);
+
+// Evaluate S-expressions, calling functions from the environment if given
+lval* lval_eval_sexpr(lenv* env, lval* val);
 
-// Evaluate lvals
-lval* lval_eval(lval* val);
+// Evaluate lvals. The environment may be NULL.
+lval* lval_eval(lenv* env, lval* val);
 
 /*
  * Extracts a single element from an S-expression at index i.
@@ -129,13 +139,16 @@ lval* builtin_tail(lval* val);
 lval* builtin_list(lval* val);
 
 // Takes a Q-expr and evaluates it as if it were an S-expr
-lval* builtin_eval(lval* val);
+lval* builtin_eval(lenv* env, lval* val);
 
 // Takes one or more Q-exprs and returns a Q-expr of them joined together
 lval* builtin_join(lval* val);
 
-// Calls the builtin function that corresponds to the symbol at FUNC
-lval* builtin(lval* val, char* func);
+/*
+ * Calls the function that corresponds to the symbol at FUNC, looking in the
+ * environment first and then at the built-in functions
+ */
+lval* builtin(lenv* env, lval* val, char* func);
 
 // Create a new lenv
 lenv* lenv_new();
@@ -146,6 +159,10 @@ void lenv_del(lenv* env);
 // Get a copy of lval that matches the symbol `val` in the environment `env`
 lval* lenv_get(lenv* env, lval* val);
 
+// Get the value bound to SYM, which stays owned by the environment, or NULL.
+// Symbols not bound yet are looked up with the lazy function, if any.
+lval* lenv_lookup(lenv* env, const char* sym);
+
 // Put `key` and `val` pair in the `env`. Replaces existing values.
 void lenv_put(lenv* env, lval* key, lval* val);
 
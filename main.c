@@ -1,81 +1,180 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <editline/readline.h>
 
-#include "mpc.h"
 #include "blisp.h"
 #include "lval.h"
+#include "server.h"
 
-int main(int argc, char** argv) {
-  // Create parsers
-  mpc_parser_t* Number = mpc_new("number");
-  mpc_parser_t* Symbol = mpc_new("symbol");
-  mpc_parser_t* Sexpr = mpc_new("sexpr"); // S-Expression
-  mpc_parser_t* Qexpr = mpc_new("qexpr"); // Q-Expression
-  mpc_parser_t* Expr = mpc_new("expr");
-  mpc_parser_t* Blisp = mpc_new("blisp");
-
-  // Define the parsers
-  /*
-   * NOTE: on the 'symbol' regex below.
-   * We need to ignore some characters inside the regex.
-   * To do that, we need to use the backslash.
-   * However, since this is a c-string, the backslash itself
-   * has to be ignored.
-   * Therefore, there are two backslashes everywhere that needs one.
-   * The real regex looks like follows:
-   *    /[a-zA-Z0-9_+\-*%^\/\\=<>!&]+/
-   */
-  mpca_lang(
-    MPCA_LANG_DEFAULT,
-    "                                                     \
-      number:   /-?[0-9]+/ ;                              \
-      symbol:   /[a-zA-Z0-9_+\\-*%^\\/\\\\=<>!&]+/ ;      \
-      sexpr:    '(' <expr>* ')' ;                         \
-      qexpr:    '{' <expr>* '}' ;                         \
-      expr:     <number> | <symbol> | <sexpr> | <qexpr> ; \
-      blisp:    /^/ <expr>* /$/ ;                         \
-    ",
-    Number,
-    Symbol,
-    Sexpr,
-    Qexpr,
-    Expr,
-    Blisp
-  );
-
+static void blisp_repl(blisp_ctx* ctx) {
   // Version and exit information
   puts("blisp 0.0.1");
   puts("Press ctrl+c to exit\n");
 
-  // REPL
-  while (1) {
-    char* input = readline("blisp> ");
+  // Stop at the end of the input (ctrl+d)
+  char* input;
+  while ((input = readline("blisp> ")) != NULL) {
     add_history(input);
 
-    // Attempt to parse the user input
-    // Print the AST if successful
-    // Else print the error
-    mpc_result_t mpc_result;
-    if (mpc_parse("<stdin>", input, Blisp, &mpc_result)) {
-#ifdef BLISP_PRINT_AST
-      mpc_ast_print(mpc_result.output);
-#endif
-      lval* result = lval_eval(lval_read(mpc_result.output));
-      lval_println(result);
+    // The context prints the result, and parse errors are printed here
+    lval* result = blisp_eval_string(ctx, "<stdin>", input);
+    if (result) {
       lval_del(result);
-      mpc_ast_delete(mpc_result.output);
     } else {
-      mpc_err_print(mpc_result.error);
-      mpc_err_delete(mpc_result.error);
+      fputs(blisp_error(ctx), stdout);
     }
 
     free(input);
   }
+  putchar('\n');
+}
+
+static void blisp_usage(FILE* f) {
+  fputs("usage: main [-e expr | [-p] script.blisp | --image img |\n", f);
+  fputs("            --save-image img]...\n", f);
+  fputs("       main --each expr < input\n", f);
+  fputs("       main --compile script.blisp output.blc\n", f);
+  fputs("       main --serve socket [--threads n]\n", f);
+}
+
+// Evaluate the expression once for each line of stdin
+static int blisp_each_main(blisp_ctx* ctx, int argc, char** argv) {
+  if (argc != 3) {
+    blisp_usage(stderr);
+    return 2;
+  }
+
+  int errors = blisp_eval_each(ctx, argv[2], stdin);
+  if (errors < 0) fputs(blisp_error(ctx), stderr);
+  return errors != 0;
+}
+
+// Run the server, with an evaluator thread per CPU unless told otherwise
+static int blisp_serve_main(int argc, char** argv) {
+  const char* path = NULL;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+      path = argv[++i];
+    } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+      threads = strtol(argv[++i], NULL, 10);
+    } else {
+      path = NULL;
+      break;
+    }
+  }
+
+  if (path == NULL || threads < 1) {
+    blisp_usage(stderr);
+    return 2;
+  }
+  return blisp_serve(path, (int)threads);
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1 && strcmp(argv[1], "--serve") == 0) {
+    return blisp_serve_main(argc, argv);
+  }
+
+  // Create the interpreter, printing results to stdout. Scripts and the
+  // REPL are run by the user, so unlike the server they can use files.
+  blisp_ctx* ctx = blisp_ctx_new();
+  blisp_ctx_output(ctx, stdout);
+  blisp_register_files(ctx);
+
+  // With no arguments, run the REPL
+  if (argc < 2) {
+    blisp_repl(ctx);
+    blisp_ctx_del(ctx);
+    return 0;
+  }
+
+  // Write a script's forms out compiled, to be run later like any script
+  if (strcmp(argv[1], "--compile") == 0) {
+    int status = 0;
+    if (argc != 4) {
+      blisp_usage(stderr);
+      status = 2;
+    } else if (!blisp_compile_file(ctx, argv[2], argv[3])) {
+      fputs(blisp_error(ctx), stderr);
+      status = 1;
+    }
+    blisp_ctx_del(ctx);
+    return status;
+  }
+
+  if (strcmp(argv[1], "--each") == 0) {
+    int status = blisp_each_main(ctx, argc, argv);
+    blisp_ctx_del(ctx);
+    return status;
+  }
+
+  // Otherwise run each expression and script in order, and stop at the
+  // first one that fails
+  int status = 0;
+  int pipelined = 0;
+  for (int i = 1; i < argc && status == 0; i++) {
+    if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+      blisp_usage(stdout);
+      continue;
+    }
+
+    // Run the scripts that follow across reader, evaluator and writer
+    // threads
+    if (strcmp(argv[i], "-p") == 0) {
+      pipelined = 1;
+      continue;
+    }
+
+    // Replace the bindings with an image's, or save them to one, at this
+    // point in the run
+    int load = strcmp(argv[i], "--image") == 0;
+    if (load || strcmp(argv[i], "--save-image") == 0) {
+      if (++i == argc) {
+        blisp_usage(stderr);
+        status = 2;
+        break;
+      }
+      int ok = load
+        ? blisp_load_image(ctx, argv[i])
+        : blisp_save_image(ctx, argv[i]);
+      if (!ok) {
+        fputs(blisp_error(ctx), stderr);
+        status = 1;
+      }
+      continue;
+    }
+
+    lval* result;
+    if (strcmp(argv[i], "-e") == 0) {
+      if (++i == argc) {
+        blisp_usage(stderr);
+        status = 2;
+        break;
+      }
+      result = blisp_eval_string(ctx, "<expr>", argv[i]);
+    } else if (pipelined) {
+      result = blisp_eval_file_pipelined(ctx, argv[i]);
+    } else {
+      result = blisp_eval_file(ctx, argv[i]);
+    }
+
+    // Parse errors and unreadable files go to stderr
+    if (result == NULL) {
+      fputs(blisp_error(ctx), stderr);
+      status = 1;
+    } else {
+      if (result->type == LVAL_ERR) status = 1;
+      lval_del(result);
+    }
+  }
 
-  // Undefine and delete the parsers
-  mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Blisp);
+  // Delete the parsers and the environment
+  blisp_ctx_del(ctx);
 
-  return 0;
+  return status;
 }
@@ -35,21 +35,22 @@ static mpc_state_t mpc_state_new(void) {
 ** The cursor can jump around at will making
 ** backtracking easy.
 **
-** The second is a File which is also somewhat
-** easy. The contents are never loaded into
-** memory but backtracking can still be achieved
-** by seeking in the file at different positions.
+** File and Pipe share one scheme. Input is read
+** in large blocks which are kept in order, so the
+** cursor can move anywhere within them just as
+** with a string. Files are read with `fread`, one
+** whole block at a time, while pipes are read a
+** character at a time from the stream's own buffer
+** so input is never waited on ahead of need.
 **
-** The final mode is Pipe. This is the difficult
-** one. As we assume pipes cannot be seeked - and
-** only support a single character lookahead at
-** any point, when the input is marked for a
-** potential backtracking we start buffering any
-** input.
-**
-** This means that if we are requested to seek
-** back we can simply start reading from the
-** buffer instead of the input.
+** A block is released once it lies entirely
+** before both the cursor and the oldest mark,
+** as nothing can then backtrack into it. When
+** the input is done a File is seeked back to the
+** end of what was parsed, and what a Pipe read
+** past that is pushed back onto the stream, so
+** the next parse of either starts where this one
+** stopped.
 **
 ** Of course using `mpc_predictive` will disable
 ** backtracking and make LL(1) grammars easy
@@ -64,17 +65,81 @@ enum {
 };
 
 enum {
-  MPC_INPUT_MARKS_MIN = 32
+  MPC_INPUT_MARKS_MIN = 32,
+  MPC_INPUT_BLOCK_SIZE = 65536,
+  MPC_INPUT_BLOCKS_MIN = 4,
+  MPC_INPUT_LINES_MIN = 64
 };
 
+/*
+** Small temporaries come from an arena of 64 byte
+** blocks. The first page lives inside the input and
+** each further page is twice the size of the last.
+** Freed blocks go on a free list for reuse, and all
+** pages are released together with the input.
+*/
+
 enum {
-  MPC_INPUT_MEM_NUM = 512
+  MPC_INPUT_MEM_NUM = 512,
+  MPC_INPUT_MEM_PAGES_MAX = 16
 };
 
 typedef struct {
   char mem[64];
 } mpc_mem_t;
 
+/*
+** Packrat memo entries. The table is direct mapped
+** so its size is fixed per parse, and a colliding
+** store evicts whatever was in the slot before.
+*/
+
+enum {
+  MPC_INPUT_MEMO_NUM = 1024
+};
+
+typedef struct {
+  struct mpc_parser_t *p;
+  long pos;
+  int term;
+  int flags;
+  int success;
+  mpc_state_t state;
+  char last;
+  void *value;
+} mpc_memo_t;
+
+/*
+** A frame of the parse stack. `j` and `k` track
+** progress through the children, `ke` and `kr` hold
+** the errors of an `or` alternative entered by its
+** jump table, and `base` is where the results of
+** the children start on the value stack. When `w`
+** is set the frame also runs the applications from
+** `w` down to `p`, which then need no frames.
+*/
+
+enum {
+  MPC_PARSE_FRAMES_MIN = 64,
+  MPC_PARSE_VALS_MIN = 64,
+  MPC_PARSE_CHAIN_MAX = 16,
+  MPC_PARSE_DEPTH_MAX = 4194304
+};
+
+typedef struct {
+  struct mpc_parser_t *p;
+  struct mpc_parser_t *w;
+  int e;
+  int j, k;
+  mpc_err_t *ke;
+  mpc_err_t *kr;
+  int base;
+  int memo;
+  long pos;
+  int term;
+  int flags;
+} mpc_frame_t;
+
 typedef struct {
 
   int type;
@@ -82,8 +147,17 @@ typedef struct {
   mpc_state_t state;
 
   char *string;
-  char *buffer;
+  size_t length;
   FILE *file;
+  long file_start;
+
+  char **blocks;
+  int blocks_num;
+  int blocks_slots;
+  long blocks_base;
+  long blocks_end;
+  char *block_spare;
+  int eof;
 
   int suppress;
   int backtrack;
@@ -94,10 +168,29 @@ typedef struct {
   char *lasts;
   char last;
 
-  size_t mem_index;
-  char mem_full[MPC_INPUT_MEM_NUM];
+  void *mem_free;
+  size_t mem_used;
+  int mem_pages_num;
+  mpc_mem_t *mem_pages[MPC_INPUT_MEM_PAGES_MAX];
   mpc_mem_t mem[MPC_INPUT_MEM_NUM];
 
+  int mode;
+  long *lines;
+  long lines_num;
+  long lines_slots;
+  long lines_end;
+  long lines_last;
+  mpc_memo_t *memo;
+  mpc_parse_stats_t stats;
+  struct mpc_ast_arena_t *ast_arena;
+
+  mpc_frame_t *frames;
+  int frames_num;
+  int frames_slots;
+  mpc_result_t *vals;
+  int vals_num;
+  int vals_slots;
+
 } mpc_input_t;
 
 static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
@@ -110,10 +203,12 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
 
   i->state = mpc_state_new();
 
-  i->string = malloc(strlen(string) + 1);
+  i->length = strlen(string);
+  i->string = malloc(i->length + 1);
   strcpy(i->string, string);
-  i->buffer = NULL;
   i->file = NULL;
+  i->file_start = 0;
+  i->blocks = NULL;
 
   i->suppress = 0;
   i->backtrack = 1;
@@ -123,8 +218,34 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->blocks_num = 0;
+  i->blocks_slots = 0;
+  i->blocks_base = 0;
+  i->blocks_end = 0;
+  i->block_spare = NULL;
+  i->eof = 0;
+
+  i->mem_free = NULL;
+  i->mem_used = 0;
+  i->mem_pages_num = 1;
+  i->mem_pages[0] = i->mem;
+
+  i->mode = MPC_PARSE_DEFAULT;
+  i->lines = NULL;
+  i->lines_num = 0;
+  i->lines_slots = 0;
+  i->lines_end = 0;
+  i->lines_last = 0;
+  i->memo = NULL;
+  i->ast_arena = NULL;
+
+  i->frames = NULL;
+  i->frames_num = 0;
+  i->frames_slots = 0;
+  i->vals = NULL;
+  i->vals_num = 0;
+  i->vals_slots = 0;
+  memset(&i->stats, 0, sizeof(mpc_parse_stats_t));
 
   return i;
 }
@@ -142,8 +263,10 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->string = malloc(length + 1);
   strncpy(i->string, string, length);
   i->string[length] = '\0';
-  i->buffer = NULL;
+  i->length = length;
   i->file = NULL;
+  i->file_start = 0;
+  i->blocks = NULL;
 
   i->suppress = 0;
   i->backtrack = 1;
@@ -153,8 +276,34 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->blocks_num = 0;
+  i->blocks_slots = 0;
+  i->blocks_base = 0;
+  i->blocks_end = 0;
+  i->block_spare = NULL;
+  i->eof = 0;
+
+  i->mem_free = NULL;
+  i->mem_used = 0;
+  i->mem_pages_num = 1;
+  i->mem_pages[0] = i->mem;
+
+  i->mode = MPC_PARSE_DEFAULT;
+  i->lines = NULL;
+  i->lines_num = 0;
+  i->lines_slots = 0;
+  i->lines_end = 0;
+  i->lines_last = 0;
+  i->memo = NULL;
+  i->ast_arena = NULL;
+
+  i->frames = NULL;
+  i->frames_num = 0;
+  i->frames_slots = 0;
+  i->vals = NULL;
+  i->vals_num = 0;
+  i->vals_slots = 0;
+  memset(&i->stats, 0, sizeof(mpc_parse_stats_t));
 
   return i;
 
@@ -171,8 +320,10 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->state = mpc_state_new();
 
   i->string = NULL;
-  i->buffer = NULL;
+  i->length = 0;
   i->file = pipe;
+  i->file_start = 0;
+  i->blocks = NULL;
 
   i->suppress = 0;
   i->backtrack = 1;
@@ -182,8 +333,34 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->blocks_num = 0;
+  i->blocks_slots = 0;
+  i->blocks_base = 0;
+  i->blocks_end = 0;
+  i->block_spare = NULL;
+  i->eof = 0;
+
+  i->mem_free = NULL;
+  i->mem_used = 0;
+  i->mem_pages_num = 1;
+  i->mem_pages[0] = i->mem;
+
+  i->mode = MPC_PARSE_DEFAULT;
+  i->lines = NULL;
+  i->lines_num = 0;
+  i->lines_slots = 0;
+  i->lines_end = 0;
+  i->lines_last = 0;
+  i->memo = NULL;
+  i->ast_arena = NULL;
+
+  i->frames = NULL;
+  i->frames_num = 0;
+  i->frames_slots = 0;
+  i->vals = NULL;
+  i->vals_num = 0;
+  i->vals_slots = 0;
+  memset(&i->stats, 0, sizeof(mpc_parse_stats_t));
 
   return i;
 
@@ -199,8 +376,11 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->state = mpc_state_new();
 
   i->string = NULL;
-  i->buffer = NULL;
+  i->length = 0;
   i->file = file;
+  i->file_start = ftell(file);
+  if (i->file_start < 0) { i->file_start = 0; }
+  i->blocks = NULL;
 
   i->suppress = 0;
   i->backtrack = 1;
@@ -210,48 +390,129 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
 
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->blocks_num = 0;
+  i->blocks_slots = 0;
+  i->blocks_base = 0;
+  i->blocks_end = 0;
+  i->block_spare = NULL;
+  i->eof = 0;
+
+  i->mem_free = NULL;
+  i->mem_used = 0;
+  i->mem_pages_num = 1;
+  i->mem_pages[0] = i->mem;
+
+  i->mode = MPC_PARSE_DEFAULT;
+  i->lines = NULL;
+  i->lines_num = 0;
+  i->lines_slots = 0;
+  i->lines_end = 0;
+  i->lines_last = 0;
+  i->memo = NULL;
+  i->ast_arena = NULL;
+
+  i->frames = NULL;
+  i->frames_num = 0;
+  i->frames_slots = 0;
+  i->vals = NULL;
+  i->vals_num = 0;
+  i->vals_slots = 0;
+  memset(&i->stats, 0, sizeof(mpc_parse_stats_t));
 
   return i;
 }
 
+static void mpc_memo_clear(mpc_memo_t *m) {
+  if (m->p == NULL) { return; }
+  if (m->success) { mpc_ast_delete(m->value); }
+  else if (m->value) { mpc_err_delete(m->value); }
+  m->p = NULL;
+  m->value = NULL;
+}
+
 static void mpc_input_delete(mpc_input_t *i) {
 
+  int j;
+  long pos;
+  size_t x;
+
   free(i->filename);
 
+  if (i->memo) {
+    for (j = 0; j < MPC_INPUT_MEMO_NUM; j++) { mpc_memo_clear(&i->memo[j]); }
+    free(i->memo);
+  }
+
   if (i->type == MPC_INPUT_STRING) { free(i->string); }
-  if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
+  if (i->type == MPC_INPUT_FILE) {
+    fseek(i->file, i->file_start + i->state.pos, SEEK_SET);
+  }
+  if (i->type == MPC_INPUT_PIPE) {
+    for (pos = i->blocks_end - 1; pos >= i->state.pos; pos--) {
+      x = (size_t)(pos - i->blocks_base);
+      ungetc(i->blocks[x / MPC_INPUT_BLOCK_SIZE][x % MPC_INPUT_BLOCK_SIZE], i->file);
+    }
+  }
+
+  for (j = 0; j < i->blocks_num; j++) { free(i->blocks[j]); }
+  free(i->blocks);
+  free(i->block_spare);
 
+  for (j = 1; j < i->mem_pages_num; j++) { free(i->mem_pages[j]); }
+
+  free(i->frames);
+  free(i->vals);
   free(i->marks);
   free(i->lasts);
+  free(i->lines);
   free(i);
 }
 
+static size_t mpc_mem_page_num(int k) {
+  return (size_t)MPC_INPUT_MEM_NUM << k;
+}
+
 static int mpc_mem_ptr(mpc_input_t *i, void *p) {
-  return
-    (char*)p >= (char*)(i->mem) &&
-    (char*)p <  (char*)(i->mem) + (MPC_INPUT_MEM_NUM * sizeof(mpc_mem_t));
+  int k;
+  for (k = i->mem_pages_num-1; k >= 0; k--) {
+    if ((char*)p >= (char*)(i->mem_pages[k]) &&
+        (char*)p <  (char*)(i->mem_pages[k] + mpc_mem_page_num(k))) { return 1; }
+  }
+  return 0;
 }
 
 static void *mpc_malloc(mpc_input_t *i, size_t n) {
-  size_t j;
   char *p;
+  int k = i->mem_pages_num-1;
+
+  if (n > sizeof(mpc_mem_t)) {
+    i->stats.arena_mallocs++;
+    return malloc(n);
+  }
 
-  if (n > sizeof(mpc_mem_t)) { return malloc(n); }
+  if (i->mem_free) {
+    p = i->mem_free;
+    i->mem_free = *(void**)p;
+    i->stats.arena_hits++;
+    return p;
+  }
 
-  j = i->mem_index;
-  do {
-    if (!i->mem_full[i->mem_index]) {
-      p = (void*)(i->mem + i->mem_index);
-      i->mem_full[i->mem_index] = 1;
-      i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-      return p;
+  if (i->mem_used == mpc_mem_page_num(k)) {
+    if (k+1 == MPC_INPUT_MEM_PAGES_MAX) {
+      i->stats.arena_mallocs++;
+      return malloc(n);
     }
-    i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-  } while (j != i->mem_index);
+    k++;
+    i->mem_pages[k] = malloc(sizeof(mpc_mem_t) * mpc_mem_page_num(k));
+    i->mem_pages_num++;
+    i->mem_used = 0;
+    i->stats.arena_pages++;
+  }
 
-  return malloc(n);
+  p = (void*)(i->mem_pages[k] + i->mem_used);
+  i->mem_used++;
+  i->stats.arena_hits++;
+  return p;
 }
 
 static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
@@ -261,10 +522,9 @@ static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
 }
 
 static void mpc_free(mpc_input_t *i, void *p) {
-  size_t j;
   if (!mpc_mem_ptr(i, p)) { free(p); return; }
-  j = ((size_t)(((char*)p) - ((char*)i->mem))) / sizeof(mpc_mem_t);
-  i->mem_full[j] = 0;
+  *(void**)p = i->mem_free;
+  i->mem_free = p;
 }
 
 static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
@@ -275,6 +535,7 @@ static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
 
   if (n > sizeof(mpc_mem_t)) {
     q = malloc(n);
+    i->stats.arena_mallocs++;
     memcpy(q, p, sizeof(mpc_mem_t));
     mpc_free(i, p);
     return q;
@@ -313,36 +574,15 @@ static void mpc_input_mark(mpc_input_t *i) {
   i->marks[i->marks_num-1] = i->state;
   i->lasts[i->marks_num-1] = i->last;
 
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
-  }
-
 }
 
 static void mpc_input_unmark(mpc_input_t *i) {
-  int j;
 
   if (i->backtrack < 1) { return; }
 
+  /* Kept at full size, as nesting tends to return to the same depth */
   i->marks_num--;
 
-  if (i->marks_slots > i->marks_num + i->marks_num / 2
-  &&  i->marks_slots > MPC_INPUT_MARKS_MIN) {
-    i->marks_slots =
-      i->marks_num > MPC_INPUT_MARKS_MIN ?
-      i->marks_num : MPC_INPUT_MARKS_MIN;
-    i->marks = realloc(i->marks, sizeof(mpc_state_t) * i->marks_slots);
-    i->lasts = realloc(i->lasts, sizeof(char) * i->marks_slots);
-  }
-
-  if (i->type == MPC_INPUT_PIPE && i->marks_num == 0) {
-    for (j = strlen(i->buffer) - 1; j >= 0; j--)
-      ungetc(i->buffer[j], i->file);
-
-    free(i->buffer);
-    i->buffer = NULL;
-  }
-
 }
 
 static void mpc_input_rewind(mpc_input_t *i) {
@@ -352,80 +592,98 @@ static void mpc_input_rewind(mpc_input_t *i) {
   i->state = i->marks[i->marks_num-1];
   i->last  = i->lasts[i->marks_num-1];
 
-  if (i->type == MPC_INPUT_FILE) {
-    fseek(i->file, i->state.pos, SEEK_SET);
-  }
-
   mpc_input_unmark(i);
 }
 
-static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
-}
+/*
+** Drops the blocks that end before both the
+** cursor and the oldest mark. The last block
+** dropped is kept back to be filled again.
+*/
+
+static void mpc_input_block_release(mpc_input_t *i) {
+
+  long low = i->marks_num > 0 ? i->marks[0].pos : i->state.pos;
+  int j, k = 0;
 
-static char mpc_input_buffer_get(mpc_input_t *i) {
-  return i->buffer[i->state.pos - i->marks[0].pos];
+  while (k < i->blocks_num - 1
+  &&     i->blocks_base + (long)MPC_INPUT_BLOCK_SIZE * (k+1) <= low) {
+    free(i->block_spare);
+    i->block_spare = i->blocks[k];
+    k++;
+  }
+
+  if (k == 0) { return; }
+
+  for (j = k; j < i->blocks_num; j++) { i->blocks[j-k] = i->blocks[j]; }
+  i->blocks_num -= k;
+  i->blocks_base += (long)MPC_INPUT_BLOCK_SIZE * k;
 }
 
-static char mpc_input_getc(mpc_input_t *i) {
+static int mpc_input_block_fill(mpc_input_t *i) {
 
-  char c = '\0';
+  char *b;
+  size_t used, n = 0;
+  int c;
 
-  switch (i->type) {
+  if (i->eof) { return 0; }
 
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
-    case MPC_INPUT_FILE: c = fgetc(i->file); return c;
-    case MPC_INPUT_PIPE:
+  used = (size_t)(i->blocks_end - i->blocks_base) % MPC_INPUT_BLOCK_SIZE;
 
-      if (!i->buffer) { c = getc(i->file); return c; }
+  if (i->blocks_num == 0 || used == 0) {
 
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        c = mpc_input_buffer_get(i);
-        return c;
-      } else {
-        c = getc(i->file);
-        return c;
-      }
+    mpc_input_block_release(i);
 
-    default: return c;
-  }
-}
+    if (i->blocks_num == i->blocks_slots) {
+      i->blocks_slots = i->blocks_slots ? i->blocks_slots * 2 : MPC_INPUT_BLOCKS_MIN;
+      i->blocks = realloc(i->blocks, sizeof(char*) * i->blocks_slots);
+    }
 
-static char mpc_input_peekc(mpc_input_t *i) {
+    if (i->block_spare) {
+      b = i->block_spare;
+      i->block_spare = NULL;
+    } else {
+      b = malloc(MPC_INPUT_BLOCK_SIZE);
+    }
 
-  char c = '\0';
+    i->blocks[i->blocks_num++] = b;
+    used = 0;
+  }
 
-  switch (i->type) {
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
-    case MPC_INPUT_FILE:
+  b = i->blocks[i->blocks_num-1] + used;
 
-      c = fgetc(i->file);
-      if (feof(i->file)) { return '\0'; }
+  if (i->type == MPC_INPUT_FILE) {
+    n = fread(b, 1, MPC_INPUT_BLOCK_SIZE - used, i->file);
+  } else if ((c = getc(i->file)) != EOF) {
+    b[n++] = (char)c;
+  }
 
-      fseek(i->file, -1, SEEK_CUR);
-      return c;
+  if (n == 0) { i->eof = 1; return 0; }
 
-    case MPC_INPUT_PIPE:
+  i->blocks_end += (long)n;
+  return 1;
+}
 
-      if (!i->buffer) {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
+static char mpc_input_block_get(mpc_input_t *i) {
 
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        return mpc_input_buffer_get(i);
-      } else {
-        c = getc(i->file);
-        if (feof(i->file)) { return '\0'; }
-        ungetc(c, i->file);
-        return c;
-      }
+  size_t x;
 
-    default: return c;
+  while (i->state.pos >= i->blocks_end) {
+    if (!mpc_input_block_fill(i)) { return '\0'; }
   }
 
+  x = (size_t)(i->state.pos - i->blocks_base);
+  return i->blocks[x / MPC_INPUT_BLOCK_SIZE][x % MPC_INPUT_BLOCK_SIZE];
+}
+
+static char mpc_input_getc(mpc_input_t *i) {
+  if (i->type == MPC_INPUT_STRING) { return i->string[i->state.pos]; }
+  return mpc_input_block_get(i);
+}
+
+static char mpc_input_peekc(mpc_input_t *i) {
+  if (i->type == MPC_INPUT_STRING) { return i->string[i->state.pos]; }
+  return mpc_input_block_get(i);
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
@@ -433,41 +691,21 @@ static int mpc_input_terminated(mpc_input_t *i) {
 }
 
 static int mpc_input_failure(mpc_input_t *i, char c) {
-
-  switch (i->type) {
-    case MPC_INPUT_STRING: { break; }
-    case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); { break; }
-    case MPC_INPUT_PIPE: {
-
-      if (!i->buffer) { ungetc(c, i->file); break; }
-
-      if (i->buffer && mpc_input_buffer_in_range(i)) {
-        break;
-      } else {
-        ungetc(c, i->file);
-      }
-    }
-    default: { break; }
-  }
+  (void)i; (void)c;
   return 0;
 }
 
 static int mpc_input_success(mpc_input_t *i, char c, char **o) {
 
-  if (i->type == MPC_INPUT_PIPE
-  &&  i->buffer && !mpc_input_buffer_in_range(i)) {
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
-  }
-
   i->last = c;
   i->state.pos++;
-  i->state.col++;
 
-  if (c == '\n') {
-    i->state.col = 0;
-    i->state.row++;
+  if (!(i->mode & MPC_PARSE_POSITIONS)) {
+    i->state.col++;
+    if (c == '\n') {
+      i->state.col = 0;
+      i->state.row++;
+    }
   }
 
   if (o) {
@@ -493,25 +731,92 @@ static int mpc_input_char(mpc_input_t *i, char c, char **o) {
   return x == c ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
 }
 
-static int mpc_input_range(mpc_input_t *i, char c, char d, char **o) {
-  char x;
-  if (mpc_input_terminated(i)) { return 0; }
-  x = mpc_input_getc(i);
-  return x >= c && x <= d ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+/*
+** Character sets are 256-bit bitmaps indexed by
+** byte value. The '\0' bit is never set, as it
+** marks the end of input.
+*/
+
+static void mpc_charset_add(unsigned char *m, unsigned char c) {
+  if (c == '\0') { return; }
+  m[c >> 3] |= (unsigned char)(1 << (c & 7));
 }
 
-static int mpc_input_oneof(mpc_input_t *i, const char *c, char **o) {
-  char x;
-  if (mpc_input_terminated(i)) { return 0; }
-  x = mpc_input_getc(i);
-  return strchr(c, x) != 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+static int mpc_charset_has(const unsigned char *m, unsigned char c) {
+  return m[c >> 3] & (1 << (c & 7));
 }
 
-static int mpc_input_noneof(mpc_input_t *i, const char *c, char **o) {
+static int mpc_input_set(mpc_input_t *i, const unsigned char *m, char **o) {
   char x;
   if (mpc_input_terminated(i)) { return 0; }
   x = mpc_input_getc(i);
-  return strchr(c, x) == 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+  return mpc_charset_has(m, (unsigned char)x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+}
+
+/*
+** Consumes the longest run of bytes in `m`, which
+** fails if it is shorter than `min` (zero or one).
+** As a failed run is empty there is nothing to
+** rewind. The run is skipped over uncopied when
+** `o` is NULL.
+*/
+
+static int mpc_input_span(mpc_input_t *i, const unsigned char *m, int min, char **o) {
+
+  const char *c, *x;
+  char y;
+  size_t n = 0, s = sizeof(mpc_mem_t);
+  char *b;
+
+  if (i->type == MPC_INPUT_STRING) {
+
+    c = x = i->string + i->state.pos;
+    if (i->mode & MPC_PARSE_POSITIONS) {
+      while (mpc_charset_has(m, (unsigned char)*x)) { x++; }
+    } else {
+      for (; mpc_charset_has(m, (unsigned char)*x); x++) {
+        i->state.col++;
+        if (*x == '\n') {
+          i->state.col = 0;
+          i->state.row++;
+        }
+      }
+    }
+
+    n = (size_t)(x - c);
+    if (n < (size_t)min) { return 0; }
+    if (n > 0) { i->last = x[-1]; }
+    i->state.pos += (long)n;
+
+    if (o) {
+      *o = mpc_malloc(i, n + 1);
+      memcpy(*o, c, n);
+      (*o)[n] = '\0';
+    }
+    return 1;
+  }
+
+  b = o ? mpc_malloc(i, s) : NULL;
+
+  while (mpc_charset_has(m, (unsigned char)(y = mpc_input_peekc(i)))) {
+    mpc_input_success(i, y, NULL);
+    if (b) {
+      if (n + 1 >= s) { s = s * 2; b = mpc_realloc(i, b, s); }
+      b[n] = y;
+    }
+    n++;
+  }
+
+  if (n < (size_t)min) {
+    if (b) { mpc_free(i, b); }
+    return 0;
+  }
+
+  if (b) {
+    b[n] = '\0';
+    *o = b;
+  }
+  return 1;
 }
 
 static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
@@ -521,10 +826,30 @@ static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
   return cond(x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
 }
 
-static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
+static int mpc_input_string(mpc_input_t *i, const char *c, size_t n, char **o) {
 
   const char *x = c;
 
+  if (i->type == MPC_INPUT_STRING) {
+
+    if ((size_t)i->state.pos + n > i->length
+    ||  memcmp(i->string + i->state.pos, c, n) != 0) { return 0; }
+
+    for (; *x && !(i->mode & MPC_PARSE_POSITIONS); x++) {
+      i->state.col++;
+      if (*x == '\n') {
+        i->state.col = 0;
+        i->state.row++;
+      }
+    }
+    if (n > 0) { i->last = c[n-1]; }
+    i->state.pos += (long)n;
+
+    *o = mpc_malloc(i, n + 1);
+    memcpy(*o, c, n + 1);
+    return 1;
+  }
+
   mpc_input_mark(i);
   while (*x) {
     if (!mpc_input_char(i, *x, NULL)) {
@@ -562,9 +887,102 @@ static int mpc_input_eoi(mpc_input_t* i, char **o) {
   }
 }
 
+/*
+** Runs a compiled regex table. Each state has
+** one row of 256 entries, indexed by the next
+** input byte, giving either the state to move
+** to after consuming that byte, or one of the
+** `MPC_DFA_DONE` / `MPC_DFA_FAIL` outcomes.
+*/
+
+enum {
+  MPC_DFA_FAIL = -1,
+  MPC_DFA_DONE = -2
+};
+
+static int mpc_input_dfa(mpc_input_t *i, const short *t, char **o) {
+
+  int s = 0;
+  char x;
+  size_t n = 0, m = sizeof(mpc_mem_t);
+  char *b = mpc_malloc(i, m);
+
+  mpc_input_mark(i);
+  while (1) {
+    s = t[s * 256 + (unsigned char)mpc_input_peekc(i)];
+    if (s == MPC_DFA_DONE) { break; }
+    if (s == MPC_DFA_FAIL) {
+      mpc_input_rewind(i);
+      mpc_free(i, b);
+      return 0;
+    }
+    x = mpc_input_getc(i);
+    mpc_input_success(i, x, NULL);
+    if (n + 1 >= m) { m = m * 2; b = mpc_realloc(i, b, m); }
+    b[n++] = x;
+  }
+  mpc_input_unmark(i);
+
+  b[n] = '\0';
+  *o = b;
+  return 1;
+}
+
+/*
+** With `MPC_PARSE_POSITIONS` only `pos` is kept up
+** to date while parsing. This fills in the row and
+** column of a state from the offsets at which lines
+** start, which are indexed only as far as needed.
+** States are mostly asked for in order, so the line
+** found last time is tried before searching. It is
+** run as each state is captured, not when it is
+** read, so a grammar that captures a state for each
+** node pays about what the counting it replaces did.
+*/
+
+static void mpc_input_locate(mpc_input_t *i, mpc_state_t *s) {
+
+  long lo, hi, mid;
+
+  if (!(i->mode & MPC_PARSE_POSITIONS) || s->pos < 0) { return; }
+
+  if (i->lines == NULL) {
+    i->lines_slots = MPC_INPUT_LINES_MIN;
+    i->lines = malloc(sizeof(long) * i->lines_slots);
+    i->lines[0] = 0;
+    i->lines_num = 1;
+  }
+
+  while (i->lines_end < s->pos) {
+    if (i->string[i->lines_end++] != '\n') { continue; }
+    if (i->lines_num == i->lines_slots) {
+      i->lines_slots *= 2;
+      i->lines = realloc(i->lines, sizeof(long) * i->lines_slots);
+    }
+    i->lines[i->lines_num++] = i->lines_end;
+  }
+
+  lo = i->lines_last;
+  if (i->lines[lo] > s->pos) { lo = 0; }
+  if (lo + 1 < i->lines_num && i->lines[lo+1] <= s->pos) { lo++; }
+
+  if (lo + 1 < i->lines_num && i->lines[lo+1] <= s->pos) {
+    hi = i->lines_num - 1;
+    while (lo < hi) {
+      mid = (lo + hi + 1) / 2;
+      if (i->lines[mid] <= s->pos) { lo = mid; } else { hi = mid - 1; }
+    }
+  }
+
+  i->lines_last = lo;
+  s->row = lo;
+  s->col = s->pos - i->lines[lo];
+}
+
 static mpc_state_t *mpc_input_state_copy(mpc_input_t *i) {
   mpc_state_t *r = mpc_malloc(i, sizeof(mpc_state_t));
   memcpy(r, &i->state, sizeof(mpc_state_t));
+  mpc_input_locate(i, r);
   return r;
 }
 
@@ -601,14 +1019,13 @@ static void mpc_err_string_cat(char *buffer, int *pos, int *max, char const *fmt
   va_end(va);
 }
 
-static char char_unescape_buffer[4];
+/* Quoted characters are written to `b`, which the caller owns, so that this stays reentrant */
+static const char *mpc_err_char_unescape(char c, char *b) {
 
-static const char *mpc_err_char_unescape(char c) {
-
-  char_unescape_buffer[0] = '\'';
-  char_unescape_buffer[1] = ' ';
-  char_unescape_buffer[2] = '\'';
-  char_unescape_buffer[3] = '\0';
+  b[0] = '\'';
+  b[1] = ' ';
+  b[2] = '\'';
+  b[3] = '\0';
 
   switch (c) {
     case '\a': return "bell";
@@ -621,8 +1038,8 @@ static const char *mpc_err_char_unescape(char c) {
     case '\t': return "tab";
     case ' ' : return "space";
     default:
-      char_unescape_buffer[1] = c;
-      return char_unescape_buffer;
+      b[1] = c;
+      return b;
   }
 
 }
@@ -632,6 +1049,7 @@ char *mpc_err_string(mpc_err_t *x) {
   int i;
   int pos = 0;
   int max = 1023;
+  char received[4];
   char *buffer = calloc(1, 1024);
 
   if (x->failure) {
@@ -657,7 +1075,7 @@ char *mpc_err_string(mpc_err_t *x) {
   }
 
   mpc_err_string_cat(buffer, &pos, &max, " at ");
-  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->received));
+  mpc_err_string_cat(buffer, &pos, &max, "%s", mpc_err_char_unescape(x->received, received));
   mpc_err_string_cat(buffer, &pos, &max, "\n");
 
   return realloc(buffer, strlen(buffer) + 1);
@@ -729,6 +1147,25 @@ static mpc_err_t *mpc_err_export(mpc_input_t *i, mpc_err_t *x) {
   return mpc_export(i, x);
 }
 
+static mpc_err_t *mpc_err_copy(mpc_err_t *x) {
+  int j;
+  mpc_err_t *y = malloc(sizeof(mpc_err_t));
+  *y = *x;
+  y->filename = malloc(strlen(x->filename) + 1);
+  strcpy(y->filename, x->filename);
+  y->failure = NULL;
+  if (x->failure) {
+    y->failure = malloc(strlen(x->failure) + 1);
+    strcpy(y->failure, x->failure);
+  }
+  y->expected = malloc(sizeof(char*) * x->expected_num);
+  for (j = 0; j < x->expected_num; j++) {
+    y->expected[j] = malloc(strlen(x->expected[j]) + 1);
+    strcpy(y->expected[j], x->expected[j]);
+  }
+  return y;
+}
+
 static int mpc_err_contains_expected(mpc_input_t *i, mpc_err_t *x, char *expected) {
   int j;
   (void)i;
@@ -862,6 +1299,7 @@ static mpc_err_t *mpc_err_count(mpc_input_t *i, mpc_err_t *x, int n) {
   mpc_err_t *y;
   int digits = n/10 + 1;
   char *prefix;
+  if (x == NULL) { return NULL; }
   prefix = mpc_malloc(i, digits + strlen(" of ") + 1);
   sprintf(prefix, "%i of ", n);
   y = mpc_err_repeat(i, x, prefix);
@@ -914,17 +1352,30 @@ enum {
   MPC_TYPE_CHECK_WITH = 26,
 
   MPC_TYPE_SOI        = 27,
-  MPC_TYPE_EOI        = 28
+  MPC_TYPE_EOI        = 28,
+
+  MPC_TYPE_DFA        = 29,
+  MPC_TYPE_SPAN       = 30
 };
 
+/* Types with no child parsers, as a bitmask */
+#define MPC_TYPE_LEAVES ( \
+  (1UL << MPC_TYPE_UNDEFINED) | (1UL << MPC_TYPE_PASS)     | (1UL << MPC_TYPE_FAIL)    | \
+  (1UL << MPC_TYPE_LIFT)      | (1UL << MPC_TYPE_LIFT_VAL) | (1UL << MPC_TYPE_ANCHOR)  | \
+  (1UL << MPC_TYPE_STATE)     | (1UL << MPC_TYPE_ANY)      | (1UL << MPC_TYPE_SINGLE)  | \
+  (1UL << MPC_TYPE_ONEOF)     | (1UL << MPC_TYPE_NONEOF)   | (1UL << MPC_TYPE_RANGE)   | \
+  (1UL << MPC_TYPE_SATISFY)   | (1UL << MPC_TYPE_STRING)   | (1UL << MPC_TYPE_SOI)     | \
+  (1UL << MPC_TYPE_EOI)       | (1UL << MPC_TYPE_DFA)      | (1UL << MPC_TYPE_SPAN))
+
 typedef struct { char *m; } mpc_pdata_fail_t;
 typedef struct { mpc_ctor_t lf; void *x; } mpc_pdata_lift_t;
 typedef struct { mpc_parser_t *x; char *m; } mpc_pdata_expect_t;
 typedef struct { int(*f)(char,char); } mpc_pdata_anchor_t;
 typedef struct { char x; } mpc_pdata_single_t;
-typedef struct { char x; char y; } mpc_pdata_range_t;
+typedef struct { char x; char y; unsigned char m[32]; } mpc_pdata_range_t;
 typedef struct { int(*f)(char); } mpc_pdata_satisfy_t;
-typedef struct { char *x; } mpc_pdata_string_t;
+typedef struct { char *x; size_t n; } mpc_pdata_string_t;
+typedef struct { char *x; unsigned char m[32]; } mpc_pdata_set_t;
 typedef struct { mpc_parser_t *x; mpc_apply_t f; } mpc_pdata_apply_t;
 typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_to_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_check_t f; char *e; } mpc_pdata_check_t;
@@ -932,8 +1383,21 @@ typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_check_with_t f; void *d; ch
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
+typedef struct { int n; mpc_parser_t **xs; unsigned char *jump; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { int n; short *t; } mpc_pdata_dfa_t;
+typedef struct { int min; int skip; unsigned char m[32]; } mpc_pdata_span_t;
+
+/*
+** An `or` may carry a 256-entry jump table built by
+** `mpc_optimise`, mapping each byte to the only
+** alternative that can start with it.
+*/
+
+enum {
+  MPC_OR_JUMP_MANY = 254,
+  MPC_OR_JUMP_NONE = 255
+};
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -944,6 +1408,7 @@ typedef union {
   mpc_pdata_range_t range;
   mpc_pdata_satisfy_t satisfy;
   mpc_pdata_string_t string;
+  mpc_pdata_set_t set;
   mpc_pdata_apply_t apply;
   mpc_pdata_apply_to_t apply_to;
   mpc_pdata_check_t check;
@@ -953,6 +1418,8 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_dfa_t dfa;
+  mpc_pdata_span_t span;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
@@ -960,6 +1427,10 @@ struct mpc_parser_t {
   mpc_pdata_t data;
   char type;
   char retained;
+  char ast;
+  char flat;
+  char fixed;
+  int nodes;
 };
 
 static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
@@ -982,6 +1453,12 @@ static mpc_val_t *mpcf_input_strfold(mpc_input_t *i, int n, mpc_val_t **xs) {
   return xs[0];
 }
 
+static mpc_val_t *mpcf_input_all_free(mpc_input_t *i, int n, mpc_val_t **xs) {
+  int j;
+  for (j = 0; j < n; j++) { mpc_free(i, xs[j]); }
+  return NULL;
+}
+
 static mpc_val_t *mpcf_input_state_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
   mpc_state_t *s = ((mpc_state_t**)xs)[0];
   mpc_ast_t *a = ((mpc_ast_t**)xs)[1];
@@ -1001,6 +1478,7 @@ static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t
   if (f == mpcf_snd_free)  { return mpcf_input_snd_free(i, n, xs); }
   if (f == mpcf_trd_free)  { return mpcf_input_trd_free(i, n, xs); }
   if (f == mpcf_strfold)   { return mpcf_input_strfold(i, n, xs); }
+  if (f == mpcf_all_free)  { return mpcf_input_all_free(i, n, xs); }
   if (f == mpcf_state_ast) { return mpcf_input_state_ast(i, n, xs); }
   for (j = 0; j < n; j++) { xs[j] = mpc_export(i, xs[j]); }
   return f(j, xs);
@@ -1011,8 +1489,13 @@ static mpc_val_t *mpcf_input_free(mpc_input_t *i, mpc_val_t *x) {
   return NULL;
 }
 
+typedef struct mpc_ast_arena_t mpc_ast_arena_t;
+static mpc_ast_arena_t *mpc_ast_arena_new(void);
+static void mpc_ast_arena_finish(mpc_ast_arena_t *m, mpc_val_t *x);
+static mpc_ast_t *mpc_ast_new_in(mpc_ast_arena_t *m, const char *tag, const char *contents);
+
 static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
-  mpc_ast_t *a = mpc_ast_new("", c);
+  mpc_ast_t *a = mpc_ast_new_in(i->ast_arena, "", c);
   mpc_free(i, c);
   return a;
 }
@@ -1032,288 +1515,605 @@ static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
   d(mpc_export(i, x));
 }
 
-enum {
-  MPC_PARSE_STACK_MIN = 4
-};
+/*
+** Packrat Parsing
+**
+** In `MPC_PARSE_PACKRAT` mode the outcome of every
+** named (retained) parser is cached by input
+** position. Failures are always cached. Successes
+** are cached only for rules defined by `mpca_lang`,
+** whose outputs are ASTs and so can be copied.
+**
+** Entries are also keyed on the suppress and
+** backtrack flags, as these change what a parser
+** returns at a given position.
+*/
 
-#define MPC_SUCCESS(x) r->output = x; return 1
-#define MPC_FAILURE(x) r->error = x; return 0
-#define MPC_PRIMITIVE(x) \
-  if (x) { MPC_SUCCESS(r->output); } \
-  else { MPC_FAILURE(NULL); }
+static mpc_ast_t *mpc_ast_copy(mpc_ast_t *a);
+static mpc_ast_t *mpc_ast_copy_in(mpc_ast_arena_t *m, mpc_ast_t *a);
 
-#define MPC_MAX_RECURSION_DEPTH 1000
+static int mpc_memo_flags(mpc_input_t *i) {
+  return (i->suppress > 0 ? 1 : 0) | (i->backtrack > 0 ? 2 : 0);
+}
 
-static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, int depth) {
+static mpc_memo_t *mpc_memo_slot(mpc_input_t *i, mpc_parser_t *p, long pos) {
+  unsigned long h = ((unsigned long)(size_t)p >> 4) * 31 + (unsigned long)pos;
+  h = (h * 2654435761UL) & 0xFFFFFFFFUL;
+  return &i->memo[(h >> 16) % MPC_INPUT_MEMO_NUM];
+}
 
-  int j = 0, k = 0;
-  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
-  mpc_result_t *results;
-  int results_slots = MPC_PARSE_STACK_MIN;
+/*
+** Looks up the frame's parser at the current
+** position. On a hit the cached outcome is put
+** in `r` and returned, otherwise the frame is
+** keyed for a later `mpc_memo_store` and -1 is
+** returned.
+*/
 
-  if (depth == MPC_MAX_RECURSION_DEPTH)
-  {
-    MPC_FAILURE(mpc_err_fail(i, "Maximum recursion depth exceeded!"));
-  }
+static int mpc_memo_find(mpc_input_t *i, mpc_frame_t *f, mpc_result_t *r) {
 
-  switch (p->type) {
+  mpc_memo_t *m;
 
-    /* Basic Parsers */
+  if (i->memo == NULL) { i->memo = calloc(MPC_INPUT_MEMO_NUM, sizeof(mpc_memo_t)); }
 
-    case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
-    case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
-    case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&r->output));
-    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
-    case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
-    case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&r->output));
-    case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&r->output));
+  f->pos = i->state.pos;
+  f->term = i->state.term;
+  f->flags = mpc_memo_flags(i);
 
-    /* Other parsers */
+  i->stats.memo_lookups++;
+  m = mpc_memo_slot(i, f->p, f->pos);
 
-    case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
-    case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
-    case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
-    case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
-    case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
-    case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
+  if (m->p == f->p && m->pos == f->pos && m->term == f->term && m->flags == f->flags) {
+    i->stats.memo_hits++;
+    i->state = m->state;
+    i->last = m->last;
+    if (m->success) {
+      /* Replays go in the parse's arena, so a tree never mixes the two */
+      r->output = mpc_ast_copy_in(i->ast_arena, m->value);
+    } else {
+      r->error = m->value ? mpc_err_copy(m->value) : NULL;
+    }
+    return m->success;
+  }
 
-    /* Application Parsers */
+  f->memo = 1;
+  return -1;
+}
 
-    case MPC_TYPE_APPLY:
-      if (mpc_parse_run(i, p->data.apply.x, r, e, depth+1)) {
-        MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output));
-      } else {
-        MPC_FAILURE(r->output);
-      }
+static void mpc_memo_store(mpc_input_t *i, mpc_frame_t *f, int x, mpc_result_t *r) {
 
-    case MPC_TYPE_APPLY_TO:
-      if (mpc_parse_run(i, p->data.apply_to.x, r, e, depth+1)) {
-        MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
-      } else {
-        MPC_FAILURE(r->error);
-      }
+  mpc_memo_t *m;
 
-    case MPC_TYPE_CHECK:
-      if (mpc_parse_run(i, p->data.check.x, r, e, depth+1)) {
-        if (p->data.check.f(&r->output)) {
-          MPC_SUCCESS(r->output);
-        } else {
-          mpc_parse_dtor(i, p->data.check.dx, r->output);
-          MPC_FAILURE(mpc_err_fail(i, p->data.check.e));
-        }
-      } else {
-        MPC_FAILURE(r->error);
-      }
+  if (x && !f->p->ast) { return; }
 
-    case MPC_TYPE_CHECK_WITH:
-      if (mpc_parse_run(i, p->data.check_with.x, r, e, depth+1)) {
-        if (p->data.check_with.f(&r->output, p->data.check_with.d)) {
-          MPC_SUCCESS(r->output);
-        } else {
-          mpc_parse_dtor(i, p->data.check.dx, r->output);
-          MPC_FAILURE(mpc_err_fail(i, p->data.check_with.e));
-        }
-      } else {
-        MPC_FAILURE(r->error);
-      }
+  /* The slot may have been reused while parsing */
+  m = mpc_memo_slot(i, f->p, f->pos);
+  if (m->p != NULL) { i->stats.memo_evictions++; }
+  mpc_memo_clear(m);
 
-    case MPC_TYPE_EXPECT:
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.expect.x, r, e, depth+1)) {
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_suppress_disable(i);
-        MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
-      }
+  m->p = f->p;
+  m->pos = f->pos;
+  m->term = f->term;
+  m->flags = f->flags;
+  m->success = x;
+  m->state = i->state;
+  m->last = i->last;
+  if (x) {
+    m->value = mpc_ast_copy(r->output);
+  } else {
+    m->value = r->error ? mpc_err_copy(r->error) : NULL;
+  }
+  i->stats.memo_stores++;
+}
 
-    case MPC_TYPE_PREDICT:
-      mpc_input_backtrack_disable(i);
-      if (mpc_parse_run(i, p->data.predict.x, r, e, depth+1)) {
-        mpc_input_backtrack_enable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_backtrack_enable(i);
-        MPC_FAILURE(r->error);
-      }
+/*
+** Parse Stack
+**
+** The engine is a loop over an explicit stack of
+** frames, one for each parser being run, so the
+** depth of nesting is bounded by memory and not
+** by the C stack. Entering a child pushes a frame
+** and continues the loop. A finished frame leaves
+** its outcome in `x` and `res` and is popped, and
+** the frame below then resumes where it left off.
+**
+** Child results waiting to be folded are kept on a
+** second stack of values. Both stacks may move as
+** they grow, so a frame names the owner of its
+** error accumulator by index.
+*/
 
-    /* Optional Parsers */
+static void mpc_parse_push(mpc_input_t *i, mpc_parser_t *p, int e) {
 
-    /* TODO: Update Not Error Message */
+  mpc_frame_t *f;
 
-    case MPC_TYPE_NOT:
-      mpc_input_mark(i);
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
-        mpc_input_rewind(i);
-        mpc_input_suppress_disable(i);
-        mpc_parse_dtor(i, p->data.not.dx, r->output);
-        MPC_FAILURE(mpc_err_new(i, "opposite"));
-      } else {
-        mpc_input_unmark(i);
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(p->data.not.lf());
-      }
+  if (i->frames_num == i->frames_slots) {
+    i->frames_slots = i->frames_slots ? i->frames_slots * 2 : MPC_PARSE_FRAMES_MIN;
+    i->frames = realloc(i->frames, sizeof(mpc_frame_t) * i->frames_slots);
+  }
 
-    case MPC_TYPE_MAYBE:
-      if (mpc_parse_run(i, p->data.not.x, r, e, depth+1)) {
-        MPC_SUCCESS(r->output);
-      } else {
-        *e = mpc_err_merge(i, *e, r->error);
-        MPC_SUCCESS(p->data.not.lf());
-      }
+  f = &i->frames[i->frames_num++];
+  f->p = p;
+  f->e = e;
+  f->j = 0;
+  f->base = i->vals_num;
+  f->memo = 0;
+  f->w = NULL;
+}
+
+static void mpc_parse_val(mpc_input_t *i, mpc_val_t *x) {
+  if (i->vals_num == i->vals_slots) {
+    i->vals_slots = i->vals_slots ? i->vals_slots * 2 : MPC_PARSE_VALS_MIN;
+    i->vals = realloc(i->vals, sizeof(mpc_result_t) * i->vals_slots);
+  }
+  i->vals[i->vals_num++].output = x;
+}
+
+/*
+** Runs a parser that needs no frame: one with no
+** children, or a short tree of applications,
+** expectations, sequences and repetitions over
+** them (see `mpc_optimise_flat`). Returns -1 for
+** any other parser.
+*/
+
+#define MPC_SUCCESS(v) r->output = v; return 1
+#define MPC_FAILURE(v) r->error = v; return 0
+#define MPC_PRIMITIVE(c) \
+  if (c) { return 1; } \
+  else { MPC_FAILURE(NULL); }
+
+static int mpc_parse_flat(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+
+  int x, j, base;
+
+  switch (p->type) {
+
+    /* Basic Parsers */
+
+    case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
+    case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
+    case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_set(i, p->data.range.m, (char**)&r->output));
+    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_set(i, p->data.set.m, (char**)&r->output));
+    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_set(i, p->data.set.m, (char**)&r->output));
+    case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
+    case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, p->data.string.n, (char**)&r->output));
+    case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
+    case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&r->output));
+    case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&r->output));
+    case MPC_TYPE_DFA:     MPC_PRIMITIVE(mpc_input_dfa(i, p->data.dfa.t, (char**)&r->output));
+
+    case MPC_TYPE_SPAN:
+      r->output = NULL;
+      MPC_PRIMITIVE(mpc_input_span(i, p->data.span.m, p->data.span.min,
+        p->data.span.skip ? NULL : (char**)&r->output));
+
+    /* Other parsers */
+
+    case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
+    case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
+    case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
+    case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
+    case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
+    case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
+
+    /* Chains */
+
+    case MPC_TYPE_APPLY:
+      if (!p->flat) { return -1; }
+      if (!mpc_parse_flat(i, p->data.apply.x, r, e)) { return 0; }
+      MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output));
+
+    case MPC_TYPE_APPLY_TO:
+      if (!p->flat) { return -1; }
+      if (!mpc_parse_flat(i, p->data.apply_to.x, r, e)) { return 0; }
+      MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
 
-    /* Repeat Parsers */
+    case MPC_TYPE_EXPECT:
+      if (!p->flat) { return -1; }
+      mpc_input_suppress_enable(i);
+      x = mpc_parse_flat(i, p->data.expect.x, r, e);
+      mpc_input_suppress_disable(i);
+      if (x) { return 1; }
+      MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
 
     case MPC_TYPE_MANY:
+      if (!p->flat) { return -1; }
+      base = i->vals_num;
+      for (j = 0; mpc_parse_flat(i, p->data.repeat.x, r, e); j++) { mpc_parse_val(i, r->output); }
+      *e = mpc_err_merge(i, *e, r->error);
+      i->vals_num = base;
+      MPC_SUCCESS(mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)(i->vals + base)));
 
-      results = results_stk;
-
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
+    case MPC_TYPE_AND:
+      if (!p->flat) { return -1; }
+      base = i->vals_num;
+      mpc_input_mark(i);
+      for (j = 0; j < p->data.and.n; j++) {
+        if (!mpc_parse_flat(i, p->data.and.xs[j], r, e)) {
+          mpc_input_rewind(i);
+          for (x = 0; x < j; x++) {
+            mpc_parse_dtor(i, p->data.and.dxs[x], i->vals[base + x].output);
+          }
+          i->vals_num = base;
+          return 0;
         }
+        mpc_parse_val(i, r->output);
       }
+      mpc_input_unmark(i);
+      i->vals_num = base;
+      MPC_SUCCESS(mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)(i->vals + base)));
+
+    default: return -1;
+  }
+}
 
-      *e = mpc_err_merge(i, *e, results[j].error);
+#undef MPC_SUCCESS
+#undef MPC_FAILURE
+#undef MPC_PRIMITIVE
 
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-        if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+/*
+** Runs the applications from `w` down to `p` over
+** the result of `p`, innermost first.
+*/
 
-    case MPC_TYPE_MANY1:
+static mpc_val_t *mpc_parse_applied(mpc_input_t *i, mpc_parser_t *w, mpc_parser_t *p, mpc_val_t *x) {
+  if (w == p) { return x; }
+  if (w->type == MPC_TYPE_APPLY) {
+    return mpc_parse_apply(i, w->data.apply.f, mpc_parse_applied(i, w->data.apply.x, p, x));
+  }
+  return mpc_parse_apply_to(i, w->data.apply_to.f, mpc_parse_applied(i, w->data.apply_to.x, p, x), w->data.apply_to.d);
+}
 
-      results = results_stk;
-
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
-        }
-      }
+/*
+** A child that needs no frame is run on the spot
+** and the current frame resumed, rather than
+** pushing a frame for it, unless it is to be
+** memoized.
+*/
 
-      if (j == 0) {
-        MPC_FAILURE(
-          mpc_err_many1(i, results[j].error);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
+#define MPC_MEMO(q) ((q)->retained && (i->mode & MPC_PARSE_PACKRAT))
+#define MPC_FLAT(q) ((((MPC_TYPE_LEAVES >> (q)->type) & 1) || (q)->flat) && !MPC_MEMO(q))
+#define MPC_CALL(q, o, l) \
+  if (MPC_FLAT(q)) { \
+    x = mpc_parse_flat(i, q, &res, (o) < 0 ? e : &i->frames[o].ke); \
+    enter = 0; \
+    goto l; \
+  } \
+  cp = q; \
+  ce = o; \
+  goto call
+#define MPC_SUCCESS(v) res.output = v; x = 1; break
+#define MPC_FAILURE(v) res.error = v; x = 0; break
+
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+
+  int x = 0, k, ce, enter;
+  int base = i->frames_num;
+  mpc_result_t res;
+  mpc_frame_t *f;
+  mpc_parser_t *q, *cp;
+  mpc_err_t **fe;
+
+  res.output = NULL;
+  mpc_parse_push(i, p, -1);
+  enter = 1;
+
+  while (1) {
+
+    f = &i->frames[i->frames_num-1];
+    q = f->p;
+    fe = f->e < 0 ? e : &i->frames[f->e].ke;
 
-        *e = mpc_err_merge(i, *e, results[j].error);
+    if (enter) {
 
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      /* Applications of a child that needs a frame share it */
+      for (k = 0; k < MPC_PARSE_CHAIN_MAX && !MPC_MEMO(q); k++) {
+        if (q->type == MPC_TYPE_APPLY) { cp = q->data.apply.x; }
+        else if (q->type == MPC_TYPE_APPLY_TO) { cp = q->data.apply_to.x; }
+        else { break; }
+        if (MPC_FLAT(cp)) { break; }
+        if (f->w == NULL) { f->w = q; }
+        q = f->p = cp;
       }
 
-    case MPC_TYPE_COUNT:
+      if (i->frames_num - base > MPC_PARSE_DEPTH_MAX) {
+        res.error = mpc_err_fail(i, "Maximum recursion depth exceeded!");
+        x = 0;
+        goto done;
+      }
 
-      results = p->data.repeat.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
-        : results_stk;
+      if ((i->mode & MPC_PARSE_PACKRAT) && q->retained) {
+        x = mpc_memo_find(i, f, &res);
+        if (x >= 0) { goto done; }
+      }
+    }
 
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e, depth+1)) {
-        j++;
-        if (j == p->data.repeat.n) { break; }
+    if (!enter) {
+      switch (q->type) {
+        case MPC_TYPE_APPLY:      goto resume_apply;
+        case MPC_TYPE_APPLY_TO:   goto resume_apply_to;
+        case MPC_TYPE_CHECK:      goto resume_check;
+        case MPC_TYPE_CHECK_WITH: goto resume_check_with;
+        case MPC_TYPE_EXPECT:     goto resume_expect;
+        case MPC_TYPE_PREDICT:    goto resume_predict;
+        case MPC_TYPE_NOT:        goto resume_not;
+        case MPC_TYPE_MAYBE:      goto resume_maybe;
+        case MPC_TYPE_MANY:       goto resume_many;
+        case MPC_TYPE_MANY1:      goto resume_many1;
+        case MPC_TYPE_COUNT:      goto resume_count;
+        case MPC_TYPE_OR:         goto resume_or;
+        case MPC_TYPE_AND:        goto resume_and;
+        default: break;
       }
+    }
 
-      if (j == p->data.repeat.n) {
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        for (k = 0; k < j; k++) {
-          mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
+    switch (q->type) {
+
+      /* Application Parsers */
+
+      case MPC_TYPE_APPLY:
+      resume_apply:
+        if (enter) { MPC_CALL(q->data.apply.x, f->e, resume_apply); }
+        if (x) { MPC_SUCCESS(mpc_parse_apply(i, q->data.apply.f, res.output)); }
+        MPC_FAILURE(res.error);
+
+      case MPC_TYPE_APPLY_TO:
+      resume_apply_to:
+        if (enter) { MPC_CALL(q->data.apply_to.x, f->e, resume_apply_to); }
+        if (x) { MPC_SUCCESS(mpc_parse_apply_to(i, q->data.apply_to.f, res.output, q->data.apply_to.d)); }
+        MPC_FAILURE(res.error);
+
+      case MPC_TYPE_CHECK:
+      resume_check:
+        if (enter) { MPC_CALL(q->data.check.x, f->e, resume_check); }
+        if (!x) { MPC_FAILURE(res.error); }
+        if (q->data.check.f(&res.output)) { MPC_SUCCESS(res.output); }
+        mpc_parse_dtor(i, q->data.check.dx, res.output);
+        MPC_FAILURE(mpc_err_fail(i, q->data.check.e));
+
+      case MPC_TYPE_CHECK_WITH:
+      resume_check_with:
+        if (enter) { MPC_CALL(q->data.check_with.x, f->e, resume_check_with); }
+        if (!x) { MPC_FAILURE(res.error); }
+        if (q->data.check_with.f(&res.output, q->data.check_with.d)) { MPC_SUCCESS(res.output); }
+        mpc_parse_dtor(i, q->data.check_with.dx, res.output);
+        MPC_FAILURE(mpc_err_fail(i, q->data.check_with.e));
+
+      case MPC_TYPE_EXPECT:
+      resume_expect:
+        if (enter) {
+          mpc_input_suppress_enable(i);
+          MPC_CALL(q->data.expect.x, f->e, resume_expect);
         }
-        MPC_FAILURE(
-          mpc_err_count(i, results[j].error, p->data.repeat.n);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      }
+        mpc_input_suppress_disable(i);
+        if (x) { MPC_SUCCESS(res.output); }
+        MPC_FAILURE(mpc_err_new(i, q->data.expect.m));
+
+      case MPC_TYPE_PREDICT:
+      resume_predict:
+        if (enter) {
+          mpc_input_backtrack_disable(i);
+          MPC_CALL(q->data.predict.x, f->e, resume_predict);
+        }
+        mpc_input_backtrack_enable(i);
+        if (x) { MPC_SUCCESS(res.output); }
+        MPC_FAILURE(res.error);
 
-    /* Combinatory Parsers */
+      /* Optional Parsers */
 
-    case MPC_TYPE_OR:
+      /* TODO: Update Not Error Message */
+
+      case MPC_TYPE_NOT:
+      resume_not:
+        if (enter) {
+          mpc_input_mark(i);
+          mpc_input_suppress_enable(i);
+          MPC_CALL(q->data.not.x, f->e, resume_not);
+        }
+        if (x) {
+          mpc_input_rewind(i);
+          mpc_input_suppress_disable(i);
+          mpc_parse_dtor(i, q->data.not.dx, res.output);
+          MPC_FAILURE(mpc_err_new(i, "opposite"));
+        }
+        mpc_input_unmark(i);
+        mpc_input_suppress_disable(i);
+        MPC_SUCCESS(q->data.not.lf());
+
+      case MPC_TYPE_MAYBE:
+      resume_maybe:
+        if (enter) { MPC_CALL(q->data.not.x, f->e, resume_maybe); }
+        if (x) { MPC_SUCCESS(res.output); }
+        *fe = mpc_err_merge(i, *fe, res.error);
+        MPC_SUCCESS(q->data.not.lf());
+
+      /* Repeat Parsers */
+
+      case MPC_TYPE_MANY:
+      resume_many:
+        if (!enter && x) { mpc_parse_val(i, res.output); f->j++; }
+        if (enter || x) { MPC_CALL(q->data.repeat.x, f->e, resume_many); }
+        *fe = mpc_err_merge(i, *fe, res.error);
+        i->vals_num = f->base;
+        MPC_SUCCESS(mpc_parse_fold(i, q->data.repeat.f, f->j, (mpc_val_t**)(i->vals + f->base)));
+
+      case MPC_TYPE_MANY1:
+      resume_many1:
+        if (!enter && x) { mpc_parse_val(i, res.output); f->j++; }
+        if (enter || x) { MPC_CALL(q->data.repeat.x, f->e, resume_many1); }
+        if (f->j == 0) { MPC_FAILURE(mpc_err_many1(i, res.error)); }
+        *fe = mpc_err_merge(i, *fe, res.error);
+        i->vals_num = f->base;
+        MPC_SUCCESS(mpc_parse_fold(i, q->data.repeat.f, f->j, (mpc_val_t**)(i->vals + f->base)));
+
+      case MPC_TYPE_COUNT:
+      resume_count:
+        if (!enter && x) { mpc_parse_val(i, res.output); f->j++; }
+        if (enter || (x && f->j < q->data.repeat.n)) { MPC_CALL(q->data.repeat.x, f->e, resume_count); }
+        i->vals_num = f->base;
+        if (x) {
+          MPC_SUCCESS(mpc_parse_fold(i, q->data.repeat.f, f->j, (mpc_val_t**)(i->vals + f->base)));
+        }
+        for (k = 0; k < f->j; k++) {
+          mpc_parse_dtor(i, q->data.repeat.dx, i->vals[f->base + k].output);
+        }
+        MPC_FAILURE(mpc_err_count(i, res.error, q->data.repeat.n));
 
-      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+      /* Combinatory Parsers */
 
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+      case MPC_TYPE_OR:
+      resume_or:
 
-      for (j = 0; j < p->data.or.n; j++) {
-        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e, depth+1)) {
-          MPC_SUCCESS(results[j].output;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+        if (enter) {
+
+          if (q->data.or.n == 0) { MPC_SUCCESS(NULL); }
+
+          f->k = -1;
+          f->ke = NULL;
+          f->kr = NULL;
+
+          /* Enter the only alternative that can start with the next byte */
+          if (q->data.or.jump && i->backtrack > 0) {
+            f->k = q->data.or.jump[(unsigned char)mpc_input_peekc(i)];
+            if (f->k == MPC_OR_JUMP_NONE) {
+              f->k = -1;
+            } else {
+              f->j = -1;
+              MPC_CALL(q->data.or.xs[f->k], (int)(f - i->frames), resume_or);
+            }
+          }
+
+        } else if (f->j == -1) {
+          if (x) {
+            *fe = mpc_err_merge(i, *fe, f->ke);
+            MPC_SUCCESS(res.output);
+          }
+          f->kr = res.error;
+          f->j = 0;
         } else {
-          *e = mpc_err_merge(i, *e, results[j].error);
+          if (x) { MPC_SUCCESS(res.output); }
+          *fe = mpc_err_merge(i, *fe, res.error);
+          f->j++;
         }
-      }
 
-      MPC_FAILURE(NULL;
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+        /* Otherwise try each in order, reusing any failed attempt above */
+        if (f->j == f->k) {
+          *fe = mpc_err_merge(i, *fe, f->ke);
+          *fe = mpc_err_merge(i, *fe, f->kr);
+          f->j++;
+        }
+        if (f->j < q->data.or.n) { MPC_CALL(q->data.or.xs[f->j], f->e, resume_or); }
 
-    case MPC_TYPE_AND:
+        MPC_FAILURE(NULL);
 
-      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+      case MPC_TYPE_AND:
+      resume_and:
 
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+        if (enter) {
+          if (q->data.and.n == 0) { MPC_SUCCESS(NULL); }
+          mpc_input_mark(i);
+          MPC_CALL(q->data.and.xs[0], f->e, resume_and);
+        }
 
-      mpc_input_mark(i);
-      for (j = 0; j < p->data.and.n; j++) {
-        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e, depth+1)) {
+        if (!x) {
           mpc_input_rewind(i);
-          for (k = 0; k < j; k++) {
-            mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
+          for (k = 0; k < f->j; k++) {
+            mpc_parse_dtor(i, q->data.and.dxs[k], i->vals[f->base + k].output);
           }
-          MPC_FAILURE(results[j].error;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+          i->vals_num = f->base;
+          MPC_FAILURE(res.error);
         }
-      }
-      mpc_input_unmark(i);
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
 
-    /* End */
+        mpc_parse_val(i, res.output);
+        f->j++;
+        if (f->j < q->data.and.n) { MPC_CALL(q->data.and.xs[f->j], f->e, resume_and); }
 
-    default:
+        mpc_input_unmark(i);
+        i->vals_num = f->base;
+        MPC_SUCCESS(mpc_parse_fold(i, q->data.and.f, f->j, (mpc_val_t**)(i->vals + f->base)));
 
-      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
-  }
+      /* End */
 
-  return 0;
+      default:
+
+        x = mpc_parse_flat(i, q, &res, fe);
+        if (x < 0) { MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!")); }
+        break;
+    }
+
+  done:
+
+    if (f->memo) { mpc_memo_store(i, f, x, &res); }
+    if (f->w && x) { res.output = mpc_parse_applied(i, f->w, q, res.output); }
+
+    i->frames_num--;
+    if (i->frames_num == base) { break; }
+    enter = 0;
+    continue;
+
+  call:
+
+    mpc_parse_push(i, cp, ce);
+    enter = 1;
+  }
 
+  *r = res;
+  return x;
 }
 
+#undef MPC_MEMO
+#undef MPC_FLAT
+#undef MPC_CALL
 #undef MPC_SUCCESS
 #undef MPC_FAILURE
-#undef MPC_PRIMITIVE
 
-int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
+/*
+** Parses with errors suppressed throughout, so no
+** error is ever built. On failure the input is
+** rewound to where it started, ready for a replay.
+*/
+
+static int mpc_parse_input_lazy(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   int x;
-  mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
-  e->state = mpc_state_invalid();
-  x = mpc_parse_run(i, p, r, &e, 0);
+  mpc_err_t *e = NULL;
+  mpc_input_mark(i);
+  mpc_input_suppress_enable(i);
+  x = mpc_parse_run(i, p, r, &e);
+  mpc_input_suppress_disable(i);
+  if (x) {
+    mpc_input_unmark(i);
+  } else {
+    mpc_input_rewind(i);
+    i->stats.error_replays++;
+  }
+  return x;
+}
+
+int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
+  int x = 0;
+  mpc_err_t *e;
+  /* Only parsers that build ASTs return one the arena can be handed to */
+  if ((i->mode & MPC_PARSE_AST_ARENA) && p->ast) { i->ast_arena = mpc_ast_arena_new(); }
+  if (i->mode & MPC_PARSE_LAZY_ERRORS) { x = mpc_parse_input_lazy(i, p, r); }
   if (x) {
-    mpc_err_delete_internal(i, e);
     r->output = mpc_export(i, r->output);
   } else {
-    r->error = mpc_err_export(i, mpc_err_merge(i, e, r->error));
+    e = mpc_err_fail(i, "Unknown Error");
+    e->state = mpc_state_invalid();
+    x = mpc_parse_run(i, p, r, &e);
+    if (x) {
+      mpc_err_delete_internal(i, e);
+      r->output = mpc_export(i, r->output);
+    } else {
+      e = mpc_err_merge(i, e, r->error);
+      mpc_input_locate(i, &e->state);
+      r->error = mpc_err_export(i, e);
+    }
+  }
+  if (i->ast_arena) {
+    mpc_ast_arena_finish(i->ast_arena, x ? r->output : NULL);
+    i->ast_arena = NULL;
   }
   return x;
 }
@@ -1326,6 +2126,25 @@ int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_res
   return x;
 }
 
+int mpc_parse_mode(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r, int mode, mpc_parse_stats_t *stats) {
+  int x;
+  mpc_input_t *i = mpc_input_new_string(filename, string);
+  i->mode = mode;
+  x = mpc_parse_input(i, p, r);
+  if (stats) {
+    stats->memo_lookups   += i->stats.memo_lookups;
+    stats->memo_hits      += i->stats.memo_hits;
+    stats->memo_stores    += i->stats.memo_stores;
+    stats->memo_evictions += i->stats.memo_evictions;
+    stats->arena_hits     += i->stats.arena_hits;
+    stats->arena_mallocs  += i->stats.arena_mallocs;
+    stats->arena_pages    += i->stats.arena_pages;
+    stats->error_replays  += i->stats.error_replays;
+  }
+  mpc_input_delete(i);
+  return x;
+}
+
 int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r) {
   int x;
   mpc_input_t *i = mpc_input_new_nstring(filename, string, length);
@@ -1379,6 +2198,7 @@ static void mpc_undefine_or(mpc_parser_t *p) {
     mpc_undefine_unretained(p->data.or.xs[i], 0);
   }
   free(p->data.or.xs);
+  free(p->data.or.jump);
 
 }
 
@@ -1395,6 +2215,7 @@ static void mpc_undefine_and(mpc_parser_t *p) {
 
 static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
 
+  if (p->fixed) { return; }
   if (p->retained && !force) { return; }
 
   switch (p->type) {
@@ -1403,6 +2224,9 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
 
     case MPC_TYPE_ONEOF:
     case MPC_TYPE_NONEOF:
+      free(p->data.set.x);
+      break;
+
     case MPC_TYPE_STRING:
       free(p->data.string.x);
       break;
@@ -1440,6 +2264,8 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
       free(p->data.check_with.e);
       break;
 
+    case MPC_TYPE_DFA: free(p->data.dfa.t); break;
+
     default: break;
   }
 
@@ -1451,6 +2277,7 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
 }
 
 void mpc_delete(mpc_parser_t *p) {
+  if (p->fixed) { return; }
   if (p->retained) {
 
     if (p->type != MPC_TYPE_UNDEFINED) {
@@ -1495,6 +2322,8 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
   p->retained = a->retained;
   p->type = a->type;
   p->data = a->data;
+  p->flat = a->flat;
+  p->nodes = a->nodes;
 
   if (a->name) {
     p->name = malloc(strlen(a->name)+1);
@@ -1510,6 +2339,10 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
 
     case MPC_TYPE_ONEOF:
     case MPC_TYPE_NONEOF:
+      p->data.set.x = malloc(strlen(a->data.set.x)+1);
+      strcpy(p->data.set.x, a->data.set.x);
+      break;
+
     case MPC_TYPE_STRING:
       p->data.string.x = malloc(strlen(a->data.string.x)+1);
       strcpy(p->data.string.x, a->data.string.x);
@@ -1541,6 +2374,10 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       for (i = 0; i < a->data.or.n; i++) {
         p->data.or.xs[i] = mpc_copy(a->data.or.xs[i]);
       }
+      if (a->data.or.jump) {
+        p->data.or.jump = malloc(256);
+        memcpy(p->data.or.jump, a->data.or.jump, 256);
+      }
     break;
     case MPC_TYPE_AND:
       p->data.and.xs = malloc(a->data.and.n * sizeof(mpc_parser_t*));
@@ -1564,6 +2401,11 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       strcpy(p->data.check_with.e, a->data.check_with.e);
       break;
 
+    case MPC_TYPE_DFA:
+      p->data.dfa.t = malloc(a->data.dfa.n * 256 * sizeof(short));
+      memcpy(p->data.dfa.t, a->data.dfa.t, a->data.dfa.n * 256 * sizeof(short));
+      break;
+
     default: break;
   }
 
@@ -1572,8 +2414,11 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
 }
 
 mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
+  if (p->fixed) { return p; }
   mpc_undefine_unretained(p, 1);
   p->type = MPC_TYPE_UNDEFINED;
+  p->flat = 0;
+  p->nodes = 0;
   return p;
 }
 
@@ -1582,6 +2427,8 @@ mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
   if (p->retained) {
     p->type = a->type;
     p->data = a->data;
+    p->flat = a->flat;
+    p->nodes = a->nodes;
   } else {
     mpc_parser_t *a2 = mpc_failf("Attempt to assign to Unretained Parser!");
     p->type = a2->type;
@@ -1752,26 +2599,39 @@ mpc_parser_t *mpc_char(char c) {
 }
 
 mpc_parser_t *mpc_range(char s, char e) {
+  int j;
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_RANGE;
   p->data.range.x = s;
   p->data.range.y = e;
+  memset(p->data.range.m, 0, sizeof(p->data.range.m));
+  for (j = 1; j < 256; j++) {
+    if ((char)j >= s && (char)j <= e) { mpc_charset_add(p->data.range.m, (unsigned char)j); }
+  }
   return mpc_expectf(p, "character between '%c' and '%c'", s, e);
 }
 
 mpc_parser_t *mpc_oneof(const char *s) {
+  const char *x;
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_ONEOF;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
+  p->data.set.x = malloc(strlen(s) + 1);
+  strcpy(p->data.set.x, s);
+  memset(p->data.set.m, 0, sizeof(p->data.set.m));
+  for (x = s; *x; x++) { mpc_charset_add(p->data.set.m, (unsigned char)*x); }
   return mpc_expectf(p, "one of '%s'", s);
 }
 
 mpc_parser_t *mpc_noneof(const char *s) {
+  int j;
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_NONEOF;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
+  p->data.set.x = malloc(strlen(s) + 1);
+  strcpy(p->data.set.x, s);
+  memset(p->data.set.m, 0, sizeof(p->data.set.m));
+  for (j = 1; j < 256; j++) {
+    if (strchr(s, (char)j) == NULL) { mpc_charset_add(p->data.set.m, (unsigned char)j); }
+  }
   return mpc_expectf(p, "none of '%s'", s);
 
 }
@@ -1786,7 +2646,8 @@ mpc_parser_t *mpc_satisfy(int(*f)(char)) {
 mpc_parser_t *mpc_string(const char *s) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_STRING;
-  p->data.string.x = malloc(strlen(s) + 1);
+  p->data.string.n = strlen(s);
+  p->data.string.x = malloc(p->data.string.n + 1);
   strcpy(p->data.string.x, s);
   return mpc_expectf(p, "\"%s\"", s);
 }
@@ -1935,6 +2796,7 @@ mpc_parser_t *mpc_or(int n, ...) {
   p->type = MPC_TYPE_OR;
   p->data.or.n = n;
   p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.or.jump = NULL;
 
   va_start(va, n);
   for (i = 0; i < n; i++) {
@@ -2350,73 +3212,248 @@ static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
   return out;
 }
 
-mpc_parser_t *mpc_re(const char *re) {
-  return mpc_re_mode(re, MPC_RE_DEFAULT);
-}
+/*
+** DFA Compilation
+**
+** Most regular expressions used for tokens are
+** a sequence of character classes each with a
+** repetition, such as `-?[0-9]+`. Because mpc
+** repetition is greedy and never gives back
+** input, matching such a sequence is entirely
+** determined by the next byte, and so can be
+** compiled into a table with one state per
+** (factor, count) pair.
+**
+** Anything else (alternation between longer
+** sequences, groups, anchors, lookahead) is left
+** to the combinator engine.
+*/
 
-mpc_parser_t *mpc_re_mode(const char *re, int mode) {
+enum {
+  MPC_DFA_FACTORS_MAX = 64,
+  MPC_DFA_STATES_MAX  = 256
+};
 
-  char *err_msg;
-  mpc_parser_t *err_out;
-  mpc_result_t r;
-  mpc_parser_t *Regex, *Term, *Factor, *Base, *Range, *RegexEnclose;
+typedef struct {
+  unsigned char set[32];
+  int min;
+  int max;
+} mpc_dfa_factor_t;
 
-  Regex  = mpc_new("regex");
-  Term   = mpc_new("term");
-  Factor = mpc_new("factor");
-  Base   = mpc_new("base");
-  Range  = mpc_new("range");
+static int mpc_dfa_class(mpc_parser_t *p, unsigned char *set) {
 
-  mpc_define(Regex, mpc_and(2, mpcf_re_or,
-    Term,
-    mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_char('|'), Regex, free)),
-    (mpc_dtor_t)mpc_delete
-  ));
+  int j;
 
-  mpc_define(Term, mpc_many(mpcf_re_and, Factor));
+  while (p->type == MPC_TYPE_EXPECT && !p->retained) { p = p->data.expect.x; }
+  if (p->retained) { return 0; }
 
-  mpc_define(Factor, mpc_and(2, mpcf_re_repeat,
-    Base,
-    mpc_or(5,
-      mpc_char('*'), mpc_char('+'), mpc_char('?'),
-      mpc_brackets(mpc_int(), free),
-      mpc_pass()),
-    (mpc_dtor_t)mpc_delete
-  ));
+  switch (p->type) {
 
-  mpc_define(Base, mpc_or(4,
-    mpc_parens(Regex, (mpc_dtor_t)mpc_delete),
-    mpc_squares(Range, (mpc_dtor_t)mpc_delete),
-    mpc_apply_to(mpc_escape(), mpcf_re_escape, &mode),
-    mpc_apply_to(mpc_noneof(")|"), mpcf_re_escape, &mode)
-  ));
+    case MPC_TYPE_ANY:
+      for (j = 1; j < 256; j++) { mpc_charset_add(set, (unsigned char)j); }
+      return 1;
 
-  mpc_define(Range, mpc_apply(
-    mpc_many(mpcf_strfold, mpc_or(2, mpc_escape(), mpc_noneof("]"))),
-    mpcf_re_range
-  ));
+    case MPC_TYPE_SINGLE:
+      mpc_charset_add(set, (unsigned char)p->data.single.x);
+      return 1;
 
-  RegexEnclose = mpc_whole(mpc_predictive(Regex), (mpc_dtor_t)mpc_delete);
+    case MPC_TYPE_RANGE:
+      for (j = 0; j < 32; j++) { set[j] |= p->data.range.m[j]; }
+      return 1;
 
-  mpc_optimise(RegexEnclose);
-  mpc_optimise(Regex);
-  mpc_optimise(Term);
-  mpc_optimise(Factor);
-  mpc_optimise(Base);
-  mpc_optimise(Range);
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      for (j = 0; j < 32; j++) { set[j] |= p->data.set.m[j]; }
+      return 1;
 
-  if(!mpc_parse("<mpc_re_compiler>", re, RegexEnclose, &r)) {
-    err_msg = mpc_err_string(r.error);
-    err_out = mpc_failf("Invalid Regex: %s", err_msg);
-    mpc_err_delete(r.error);
-    free(err_msg);
-    r.output = err_out;
-  }
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) {
+        if (!mpc_dfa_class(p->data.or.xs[j], set)) { return 0; }
+      }
+      return 1;
+
+    default: return 0;
+  }
+}
+
+static int mpc_dfa_factors(mpc_parser_t *p, mpc_dfa_factor_t *fs, int *n) {
+
+  int j;
+  mpc_dfa_factor_t *f;
+
+  while (p->type == MPC_TYPE_EXPECT && !p->retained) { p = p->data.expect.x; }
+  if (p->retained) { return 0; }
+
+  if (p->type == MPC_TYPE_AND && p->data.and.f == mpcf_strfold) {
+    for (j = 0; j < p->data.and.n; j++) {
+      if (!mpc_dfa_factors(p->data.and.xs[j], fs, n)) { return 0; }
+    }
+    return 1;
+  }
+
+  if (*n == MPC_DFA_FACTORS_MAX) { return 0; }
+  f = &fs[*n];
+  memset(f->set, 0, sizeof(f->set));
+
+  switch (p->type) {
+    case MPC_TYPE_SPAN:
+      if (p->data.span.skip) { return 0; }
+      memcpy(f->set, p->data.span.m, sizeof(f->set));
+      f->min = p->data.span.min; f->max = -1;
+      (*n)++;
+      return 1;
+    case MPC_TYPE_MANY:
+      if (p->data.repeat.f != mpcf_strfold) { return 0; }
+      f->min = 0; f->max = -1; p = p->data.repeat.x;
+      break;
+    case MPC_TYPE_MANY1:
+      if (p->data.repeat.f != mpcf_strfold) { return 0; }
+      f->min = 1; f->max = -1; p = p->data.repeat.x;
+      break;
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.f != mpcf_strfold) { return 0; }
+      f->min = p->data.repeat.n; f->max = p->data.repeat.n; p = p->data.repeat.x;
+      break;
+    case MPC_TYPE_MAYBE:
+      if (p->data.not.lf != mpcf_ctor_str) { return 0; }
+      f->min = 0; f->max = 1; p = p->data.not.x;
+      break;
+    default:
+      f->min = 1; f->max = 1;
+      break;
+  }
+
+  if (!mpc_dfa_class(p, f->set)) { return 0; }
+  (*n)++;
+  return 1;
+}
+
+static mpc_parser_t *mpc_re_dfa(mpc_parser_t *a, const char *re) {
+
+  int j, k, c, b, n = 0, states = 0, s, t;
+  int first[MPC_DFA_FACTORS_MAX+1];
+  mpc_dfa_factor_t fs[MPC_DFA_FACTORS_MAX];
+  mpc_parser_t *p;
+  char *m;
+
+  if (!mpc_dfa_factors(a, fs, &n) || n == 0) { return a; }
+
+  /* Counts above `min` are only tracked for bounded factors */
+  for (j = 0; j < n; j++) {
+    first[j] = states;
+    states += (fs[j].max < 0 ? fs[j].min : fs[j].max) + 1;
+    if (states > MPC_DFA_STATES_MAX) { return a; }
+  }
+  first[n] = states;
+
+  p = mpc_undefined();
+  p->type = MPC_TYPE_DFA;
+  p->data.dfa.n = states;
+  p->data.dfa.t = malloc(states * 256 * sizeof(short));
+
+  for (j = 0; j < n; j++) {
+    for (c = 0; c < first[j+1] - first[j]; c++) {
+      s = first[j] + c;
+      for (b = 0; b < 256; b++) {
+
+        /* Follow the factors that this byte skips past */
+        k = j; t = c;
+        while (1) {
+          if (k == n) { t = MPC_DFA_DONE; break; }
+          if ((fs[k].max < 0 || t < fs[k].max) && mpc_charset_has(fs[k].set, (unsigned char)b)) {
+            t = (fs[k].max < 0 && t + 1 > fs[k].min) ? fs[k].min : t + 1;
+            t = first[k] + t;
+            break;
+          }
+          if (t < fs[k].min) { t = MPC_DFA_FAIL; break; }
+          k++; t = 0;
+        }
+
+        p->data.dfa.t[s * 256 + b] = (short)t;
+      }
+    }
+  }
+
+  mpc_delete(a);
+
+  m = malloc(strlen(re) + 3);
+  sprintf(m, "/%s/", re);
+  p = mpc_expect(p, m);
+  free(m);
+  return p;
+}
+
+mpc_parser_t *mpc_re(const char *re) {
+  return mpc_re_mode(re, MPC_RE_DEFAULT);
+}
+
+mpc_parser_t *mpc_re_mode(const char *re, int mode) {
+
+  char *err_msg;
+  mpc_parser_t *err_out;
+  mpc_result_t r;
+  mpc_parser_t *Regex, *Term, *Factor, *Base, *Range, *RegexEnclose;
+
+  Regex  = mpc_new("regex");
+  Term   = mpc_new("term");
+  Factor = mpc_new("factor");
+  Base   = mpc_new("base");
+  Range  = mpc_new("range");
+
+  mpc_define(Regex, mpc_and(2, mpcf_re_or,
+    Term,
+    mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_char('|'), Regex, free)),
+    (mpc_dtor_t)mpc_delete
+  ));
+
+  mpc_define(Term, mpc_many(mpcf_re_and, Factor));
+
+  mpc_define(Factor, mpc_and(2, mpcf_re_repeat,
+    Base,
+    mpc_or(5,
+      mpc_char('*'), mpc_char('+'), mpc_char('?'),
+      mpc_brackets(mpc_int(), free),
+      mpc_pass()),
+    (mpc_dtor_t)mpc_delete
+  ));
+
+  mpc_define(Base, mpc_or(4,
+    mpc_parens(Regex, (mpc_dtor_t)mpc_delete),
+    mpc_squares(Range, (mpc_dtor_t)mpc_delete),
+    mpc_apply_to(mpc_escape(), mpcf_re_escape, &mode),
+    mpc_apply_to(mpc_noneof(")|"), mpcf_re_escape, &mode)
+  ));
+
+  mpc_define(Range, mpc_apply(
+    mpc_many(mpcf_strfold, mpc_or(2, mpc_escape(), mpc_noneof("]"))),
+    mpcf_re_range
+  ));
+
+  RegexEnclose = mpc_whole(mpc_predictive(Regex), (mpc_dtor_t)mpc_delete);
+
+  mpc_optimise(RegexEnclose);
+  mpc_optimise(Regex);
+  mpc_optimise(Term);
+  mpc_optimise(Factor);
+  mpc_optimise(Base);
+  mpc_optimise(Range);
+
+  if(!mpc_parse("<mpc_re_compiler>", re, RegexEnclose, &r)) {
+    err_msg = mpc_err_string(r.error);
+    err_out = mpc_failf("Invalid Regex: %s", err_msg);
+    mpc_err_delete(r.error);
+    free(err_msg);
+    r.output = err_out;
+  }
 
   mpc_cleanup(6, RegexEnclose, Regex, Term, Factor, Base, Range);
 
   mpc_optimise(r.output);
 
+  if (!(mode & MPC_RE_COMBINATOR)) {
+    r.output = mpc_re_dfa(r.output, re);
+  }
+
   return r.output;
 
 }
@@ -2689,9 +3726,9 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
 
   /* TODO: Print Everything Escaped */
 
-  int i;
+  int i, n;
   char *s, *e;
-  char buff[2];
+  char buff[2], set[256];
 
   if (p->retained && !force) {;
     if (p->name) { printf("<%s>", p->name); }
@@ -2712,6 +3749,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
 
   if (p->type == MPC_TYPE_ANY) { printf("<.>"); }
   if (p->type == MPC_TYPE_SATISFY) { printf("<f>"); }
+  if (p->type == MPC_TYPE_DFA) { printf("<dfa>"); }
 
   if (p->type == MPC_TYPE_SINGLE) {
     buff[0] = p->data.single.x; buff[1] = '\0';
@@ -2741,7 +3779,7 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
 
   if (p->type == MPC_TYPE_ONEOF) {
     s = mpcf_escape_new(
-      p->data.string.x,
+      p->data.set.x,
       mpc_escape_input_c,
       mpc_escape_output_c);
     printf("[%s]", s);
@@ -2750,13 +3788,26 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
 
   if (p->type == MPC_TYPE_NONEOF) {
     s = mpcf_escape_new(
-      p->data.string.x,
+      p->data.set.x,
       mpc_escape_input_c,
       mpc_escape_output_c);
     printf("[^%s]", s);
     free(s);
   }
 
+  if (p->type == MPC_TYPE_SPAN) {
+    for (i = 1, n = 0; i < 256; i++) {
+      if (mpc_charset_has(p->data.span.m, (unsigned char)i)) { set[n++] = (char)i; }
+    }
+    set[n] = '\0';
+    s = mpcf_escape_new(
+      set,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    printf("[%s]%s", s, p->data.span.min ? "+" : "*");
+    free(s);
+  }
+
   if (p->type == MPC_TYPE_STRING) {
     s = mpcf_escape_new(
       p->data.string.x,
@@ -2883,12 +3934,122 @@ int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
 ** AST
 */
 
+/*
+** AST Arena
+**
+** In `MPC_PARSE_AST_ARENA` mode the nodes, strings
+** and child arrays of one parse are bump allocated
+** from pages owned by an arena. Deleting any other
+** node of the tree does nothing; deleting the root
+** releases every page at once. Packrat replays are
+** copied into the arena too. Nodes made outside it,
+** such as by user functions, are marked as foreign
+** and are still freed individually.
+*/
+
+enum {
+  MPC_AST_ARENA_PAGE_MIN = 4096
+};
+
+typedef struct mpc_ast_page_t {
+  struct mpc_ast_page_t *next;
+} mpc_ast_page_t;
+
+struct mpc_ast_arena_t {
+  mpc_ast_page_t *pages;
+  char *next;
+  size_t left;
+  size_t page_size;
+  mpc_ast_t *root;
+  int foreign;
+};
+
+static mpc_ast_arena_t *mpc_ast_arena_new(void) {
+  mpc_ast_arena_t *m = malloc(sizeof(mpc_ast_arena_t));
+  m->pages = NULL;
+  m->next = NULL;
+  m->left = 0;
+  m->page_size = MPC_AST_ARENA_PAGE_MIN;
+  m->root = NULL;
+  m->foreign = 0;
+  return m;
+}
+
+static void mpc_ast_arena_delete(mpc_ast_arena_t *m) {
+  mpc_ast_page_t *p;
+  while (m->pages) {
+    p = m->pages->next;
+    free(m->pages);
+    m->pages = p;
+  }
+  free(m);
+}
+
+static void mpc_ast_arena_finish(mpc_ast_arena_t *m, mpc_val_t *x) {
+  mpc_ast_t *a = x;
+  if (a && a->arena == m) {
+    m->root = a;
+  } else {
+    mpc_ast_arena_delete(m);
+  }
+}
+
+static void *mpc_ast_arena_alloc(mpc_ast_arena_t *m, size_t n) {
+
+  char *p;
+  size_t size;
+  mpc_ast_page_t *page;
+
+  n = (n + 15) & ~(size_t)15;
+
+  if (n > m->left) {
+    size = m->page_size > n ? m->page_size : n;
+    page = malloc(sizeof(mpc_ast_page_t) + 16 + size);
+    page->next = m->pages;
+    m->pages = page;
+    m->next = (char*)page + ((sizeof(mpc_ast_page_t) + 15) & ~(size_t)15);
+    m->left = size;
+    m->page_size *= 2;
+  }
+
+  p = m->next;
+  m->next += n;
+  m->left -= n;
+  return p;
+}
+
+static void *mpc_ast_malloc(mpc_ast_arena_t *m, size_t n) {
+  return m ? mpc_ast_arena_alloc(m, n) : malloc(n);
+}
+
+static void *mpc_ast_realloc(mpc_ast_arena_t *m, void *p, size_t o, size_t n) {
+  char *q;
+  if (m == NULL) { return realloc(p, n); }
+  q = mpc_ast_arena_alloc(m, n);
+  if (p) { memcpy(q, p, o < n ? o : n); }
+  return q;
+}
+
+static void mpc_ast_free(mpc_ast_arena_t *m, void *p) {
+  if (m == NULL) { free(p); }
+}
+
 void mpc_ast_delete(mpc_ast_t *a) {
 
   int i;
 
   if (a == NULL) { return; }
 
+  if (a->arena) {
+    if (a->arena->foreign) {
+      for (i = 0; i < a->children_num; i++) {
+        mpc_ast_delete(a->children[i]);
+      }
+    }
+    if (a->arena->root == a) { mpc_ast_arena_delete(a->arena); }
+    return;
+  }
+
   for (i = 0; i < a->children_num; i++) {
     mpc_ast_delete(a->children[i]);
   }
@@ -2900,31 +4061,166 @@ void mpc_ast_delete(mpc_ast_t *a) {
 
 }
 
+/*
+** Tag IDs
+**
+** Rule names are interned into a global table once,
+** when a grammar is built. An AST node may then hold
+** its tag as an array of IDs, outermost first, with
+** `tag` left NULL until a string is asked for.
+**
+** Parsing only reads this table, so like the rest of
+** a grammar it must be complete before other threads
+** start parsing.
+*/
+
+static const char *mpc_tag_builtin[] = { ">", "regex", "char", "string" };
+
+static char **mpc_tag_names = NULL;
+static int mpc_tag_names_num = 0;
+static int mpc_tag_names_static = 0;
+
+int mpc_tag_intern(const char *name) {
+
+  int i;
+
+  if (mpc_tag_names_num == 0) {
+    mpc_tag_names_num = sizeof(mpc_tag_builtin) / sizeof(char*);
+    mpc_tag_names = malloc(sizeof(char*) * mpc_tag_names_num);
+    for (i = 0; i < mpc_tag_names_num; i++) {
+      mpc_tag_names[i] = malloc(strlen(mpc_tag_builtin[i]) + 1);
+      strcpy(mpc_tag_names[i], mpc_tag_builtin[i]);
+    }
+  }
+
+  for (i = 0; i < mpc_tag_names_num; i++) {
+    if (strcmp(mpc_tag_names[i], name) == 0) { return i; }
+  }
+
+  /* A table adopted from a static grammar is copied before it grows */
+  if (mpc_tag_names_static) {
+    char **names = malloc(sizeof(char*) * mpc_tag_names_num);
+    memcpy(names, mpc_tag_names, sizeof(char*) * mpc_tag_names_num);
+    mpc_tag_names = names;
+    mpc_tag_names_static = 0;
+  }
+
+  mpc_tag_names_num++;
+  mpc_tag_names = realloc(mpc_tag_names, sizeof(char*) * mpc_tag_names_num);
+  mpc_tag_names[i] = malloc(strlen(name) + 1);
+  strcpy(mpc_tag_names[i], name);
+  return i;
+}
+
+const char *mpc_tag_name(int id) {
+  if (id >= 0 && id < (int)(sizeof(mpc_tag_builtin) / sizeof(char*))) { return mpc_tag_builtin[id]; }
+  if (id < 0 || id >= mpc_tag_names_num) { return ""; }
+  return mpc_tag_names[id];
+}
+
+static void mpc_ast_tag_render(mpc_ast_t *a) {
+
+  int i;
+  size_t n = 1;
+
+  if (a->tag) { return; }
+
+  for (i = 0; i < a->tags_num; i++) { n += strlen(mpc_tag_name(a->tags[i])) + 1; }
+
+  a->tag = mpc_ast_malloc(a->arena, n);
+  a->tag[0] = '\0';
+  for (i = 0; i < a->tags_num; i++) {
+    if (i) { strcat(a->tag, "|"); }
+    strcat(a->tag, mpc_tag_name(a->tags[i]));
+  }
+}
+
+static void mpc_ast_tag_strings(mpc_ast_t *a) {
+  mpc_ast_tag_render(a);
+  a->tags_num = 0;
+}
+
+static mpc_ast_t *mpc_ast_new_root(mpc_ast_t *like) {
+
+  mpc_ast_t *r;
+
+  if (like == NULL) { return mpc_ast_new(">", ""); }
+  if (like->tags_num == 0) { return mpc_ast_new_in(like->arena, ">", ""); }
+
+  r = mpc_ast_new_in(like->arena, NULL, "");
+  r->tags[0] = MPC_TAG_ROOT;
+  r->tags_num = 1;
+  return r;
+}
+
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
+  if (a->arena) { return; }
   free(a->children);
   free(a->tag);
   free(a->contents);
   free(a);
 }
 
-mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+static mpc_ast_t *mpc_ast_new_in(mpc_ast_arena_t *m, const char *tag, const char *contents) {
 
-  mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
+  mpc_ast_t *a = mpc_ast_malloc(m, sizeof(mpc_ast_t));
 
-  a->tag = malloc(strlen(tag) + 1);
-  strcpy(a->tag, tag);
+  a->tag = NULL;
+  if (tag) {
+    a->tag = mpc_ast_malloc(m, strlen(tag) + 1);
+    strcpy(a->tag, tag);
+  }
 
-  a->contents = malloc(strlen(contents) + 1);
+  a->contents = mpc_ast_malloc(m, strlen(contents) + 1);
   strcpy(a->contents, contents);
 
   a->state = mpc_state_new();
 
   a->children_num = 0;
   a->children = NULL;
+  a->tags_num = 0;
+  a->arena = m;
   return a;
 
 }
 
+mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+  return mpc_ast_new_in(NULL, tag, contents);
+}
+
+static mpc_ast_t *mpc_ast_copy_in(mpc_ast_arena_t *m, mpc_ast_t *a) {
+
+  int i;
+  size_t slots;
+  mpc_ast_t *b;
+
+  if (a == NULL) { return a; }
+
+  b = mpc_ast_new_in(m, a->tag, a->contents);
+  memcpy(b->tags, a->tags, sizeof(int) * a->tags_num);
+  b->tags_num = a->tags_num;
+  b->state = a->state;
+  b->children_num = a->children_num;
+
+  /* Arena arrays are sized as mpc_ast_add_child grows them */
+  slots = a->children_num;
+  if (m && slots > 0) {
+    slots = 4;
+    while ((int)slots < a->children_num) { slots *= 2; }
+  }
+  b->children = mpc_ast_malloc(m, sizeof(mpc_ast_t*) * slots);
+
+  for (i = 0; i < a->children_num; i++) {
+    b->children[i] = mpc_ast_copy_in(m, a->children[i]);
+  }
+
+  return b;
+}
+
+static mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+  return mpc_ast_copy_in(NULL, a);
+}
+
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
 
   mpc_ast_t *a = mpc_ast_new(tag, "");
@@ -2951,7 +4247,7 @@ mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
   if (a->children_num == 0) { return a; }
   if (a->children_num == 1) { return a; }
 
-  r = mpc_ast_new(">", "");
+  r = mpc_ast_new_root(a);
   mpc_ast_add_child(r, a);
   return r;
 }
@@ -2960,6 +4256,8 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
 
   int i;
 
+  mpc_ast_tag_render(a);
+  mpc_ast_tag_render(b);
   if (strcmp(a->tag, b->tag) != 0) { return 0; }
   if (strcmp(a->contents, b->contents) != 0) { return 0; }
   if (a->children_num != b->children_num) { return 0; }
@@ -2972,15 +4270,28 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
 }
 
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
+
+  int n = r->children_num;
+
+  if (r->arena == NULL) {
+    r->children = realloc(r->children, sizeof(mpc_ast_t*) * (n + 1));
+  } else if (n == 0 || (n >= 4 && (n & (n - 1)) == 0)) {
+    /* Arena arrays grow to the next power of two from 4 */
+    r->children = mpc_ast_realloc(r->arena, r->children,
+      sizeof(mpc_ast_t*) * n, sizeof(mpc_ast_t*) * (n < 4 ? 4 : n * 2));
+  }
+
+  if (r->arena && a && a->arena != r->arena) { r->arena->foreign = 1; }
+
+  r->children[n] = a;
   r->children_num++;
-  r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
-  r->children[r->children_num-1] = a;
   return r;
 }
 
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
+  mpc_ast_tag_strings(a);
+  a->tag = mpc_ast_realloc(a->arena, a->tag, strlen(a->tag) + 1, strlen(t) + 1 + strlen(a->tag) + 1);
   memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, strlen(t));
   memmove(a->tag + strlen(t), "|", 1);
@@ -2989,18 +4300,81 @@ mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
 
 mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, (strlen(t)-1) + strlen(a->tag) + 1);
+  mpc_ast_tag_strings(a);
+  a->tag = mpc_ast_realloc(a->arena, a->tag, strlen(a->tag) + 1, (strlen(t)-1) + strlen(a->tag) + 1);
   memmove(a->tag + (strlen(t)-1), a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, (strlen(t)-1));
   return a;
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
-  a->tag = realloc(a->tag, strlen(t) + 1);
+  a->tag = mpc_ast_realloc(a->arena, a->tag, a->tag ? strlen(a->tag) + 1 : 0, strlen(t) + 1);
   strcpy(a->tag, t);
+  a->tags_num = 0;
+  return a;
+}
+
+mpc_ast_t *mpc_ast_tag_id(mpc_ast_t *a, int id) {
+  if (a == NULL) { return a; }
+  mpc_ast_free(a->arena, a->tag);
+  a->tag = NULL;
+  a->tags[0] = id;
+  a->tags_num = 1;
+  return a;
+}
+
+mpc_ast_t *mpc_ast_add_tag_id(mpc_ast_t *a, int id) {
+  if (a == NULL) { return a; }
+  if (a->tags_num == 0 || a->tags_num == MPC_AST_TAGS_MAX) {
+    return mpc_ast_add_tag(a, mpc_tag_name(id));
+  }
+  memmove(a->tags + 1, a->tags, sizeof(int) * a->tags_num);
+  a->tags[0] = id;
+  a->tags_num++;
+  mpc_ast_free(a->arena, a->tag);
+  a->tag = NULL;
+  return a;
+}
+
+static mpc_ast_t *mpc_ast_add_root_tags(mpc_ast_t *a, mpc_ast_t *r) {
+
+  int n = r->tags_num - 1;
+
+  if (a->tags_num == 0 || r->tags_num == 0
+  ||  a->tags_num + n > MPC_AST_TAGS_MAX) {
+    mpc_ast_tag_render(r);
+    return mpc_ast_add_root_tag(a, r->tag);
+  }
+
+  memmove(a->tags + n, a->tags, sizeof(int) * a->tags_num);
+  memcpy(a->tags, r->tags, sizeof(int) * n);
+  a->tags_num += n;
+  mpc_ast_free(a->arena, a->tag);
+  a->tag = NULL;
   return a;
 }
 
+int mpc_ast_has_tag(mpc_ast_t *a, int id) {
+
+  int i;
+  size_t n;
+  const char *t, *s;
+
+  if (a->tags_num) {
+    for (i = 0; i < a->tags_num; i++) {
+      if (a->tags[i] == id) { return 1; }
+    }
+    return 0;
+  }
+
+  t = mpc_tag_name(id);
+  n = strlen(t);
+  for (s = a->tag; s; s = strchr(s, '|'), s = s ? s+1 : s) {
+    if (strncmp(s, t, n) == 0 && (s[n] == '|' || s[n] == '\0')) { return 1; }
+  }
+  return 0;
+}
+
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
   if (a == NULL) { return a; }
   a->state = s;
@@ -3018,6 +4392,8 @@ static void mpc_ast_print_depth(mpc_ast_t *a, int d, FILE *fp) {
 
   for (i = 0; i < d; i++) { fprintf(fp, "  "); }
 
+  mpc_ast_tag_render(a);
+
   if (strlen(a->contents)) {
     fprintf(fp, "%s:%lu:%lu '%s'\n", a->tag,
       (long unsigned int)(a->state.row+1),
@@ -3049,6 +4425,7 @@ int mpc_ast_get_index_lb(mpc_ast_t *ast, const char *tag, int lb) {
   int i;
 
   for(i=lb; i<ast->children_num; i++) {
+    mpc_ast_tag_render(ast->children[i]);
     if(strcmp(ast->children[i]->tag, tag) == 0) {
       return i;
     }
@@ -3065,6 +4442,7 @@ mpc_ast_t *mpc_ast_get_child_lb(mpc_ast_t *ast, const char *tag, int lb) {
   int i;
 
   for(i=lb; i<ast->children_num; i++) {
+    mpc_ast_tag_render(ast->children[i]);
     if(strcmp(ast->children[i]->tag, tag) == 0) {
       return ast->children[i];
     }
@@ -3209,9 +4587,99 @@ void mpc_ast_traverse_free(mpc_ast_trav_t **trav) {
   }
 }
 
-mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
+static void mpc_ast_iter_push(mpc_ast_iter_t *it, mpc_ast_t *a) {
 
-  int i, j;
+  mpc_ast_iter_frame_t *stack;
+
+  if (it->depth == it->size) {
+    if (it->owned) {
+      stack = realloc(it->stack, sizeof(mpc_ast_iter_frame_t) * it->size * 2);
+    } else {
+      stack = malloc(sizeof(mpc_ast_iter_frame_t) * it->size * 2);
+      memcpy(stack, it->stack, sizeof(mpc_ast_iter_frame_t) * it->depth);
+    }
+    it->stack = stack;
+    it->size *= 2;
+    it->owned = 1;
+  }
+
+  it->stack[it->depth].node = a;
+  it->stack[it->depth].child = -1;
+  it->depth++;
+}
+
+void mpc_ast_iter_init(mpc_ast_iter_t *it, mpc_ast_t *ast, mpc_ast_trav_order_t order,
+                       mpc_ast_iter_frame_t *buf, int size) {
+  it->order = order;
+  it->stack = buf && size > 0 ? buf : it->local;
+  it->size = buf && size > 0 ? size : MPC_AST_ITER_LOCAL;
+  it->depth = 0;
+  it->owned = 0;
+  if (ast) { mpc_ast_iter_push(it, ast); }
+}
+
+mpc_ast_t *mpc_ast_iter_next(mpc_ast_iter_t *it) {
+
+  mpc_ast_iter_frame_t *f;
+
+  while (it->depth > 0) {
+
+    f = &it->stack[it->depth-1];
+
+    /* First visit to this frame */
+    if (f->child < 0) {
+      f->child = 0;
+      if (it->order == mpc_ast_trav_order_pre) { return f->node; }
+    }
+
+    /* Descend into the next child, if any */
+    if (f->child < f->node->children_num) {
+      mpc_ast_iter_push(it, f->node->children[f->child++]);
+      continue;
+    }
+
+    it->depth--;
+    if (it->order == mpc_ast_trav_order_post) { return f->node; }
+  }
+
+  return NULL;
+}
+
+void mpc_ast_iter_free(mpc_ast_iter_t *it) {
+  if (it->owned) { free(it->stack); }
+  it->stack = it->local;
+  it->size = MPC_AST_ITER_LOCAL;
+  it->depth = 0;
+  it->owned = 0;
+}
+
+int mpc_ast_visit(mpc_ast_t *ast, mpc_ast_trav_order_t order, mpc_ast_visit_t f, void *data) {
+
+  mpc_ast_iter_t it;
+  mpc_ast_t *batch[MPC_AST_VISIT_BATCH];
+  mpc_ast_t *a;
+  int n = 0, x = 0;
+
+  mpc_ast_iter_init(&it, ast, order, NULL, 0);
+
+  while ((a = mpc_ast_iter_next(&it))) {
+    batch[n++] = a;
+    if (n == MPC_AST_VISIT_BATCH) {
+      x = f(batch, n, data);
+      n = 0;
+      if (x) { break; }
+    }
+  }
+
+  if (!x && n > 0) { x = f(batch, n, data); }
+
+  mpc_ast_iter_free(&it);
+  return x;
+}
+
+mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
+
+  int i, j;
   mpc_ast_t** as = (mpc_ast_t**)xs;
   mpc_ast_t *r;
 
@@ -3220,7 +4688,8 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
   if (n == 2 && xs[1] == NULL) { return xs[0]; }
   if (n == 2 && xs[0] == NULL) { return xs[1]; }
 
-  r = mpc_ast_new(">", "");
+  for (i = 0; i < n && as[i] == NULL; i++);
+  r = mpc_ast_new_root(i < n ? as[i] : NULL);
 
   for (i = 0; i < n; i++) {
 
@@ -3229,7 +4698,7 @@ mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
     if        (as[i] && as[i]->children_num == 0) {
       mpc_ast_add_child(r, as[i]);
     } else if (as[i] && as[i]->children_num == 1) {
-      mpc_ast_add_child(r, mpc_ast_add_root_tag(as[i]->children[0], as[i]->tag));
+      mpc_ast_add_child(r, mpc_ast_add_root_tags(as[i]->children[0], as[i]));
       mpc_ast_delete_no_children(as[i]);
     } else if (as[i] && as[i]->children_num >= 2) {
       for (j = 0; j < as[i]->children_num; j++) {
@@ -3274,6 +4743,22 @@ mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t) {
   return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_add_tag, (void*)t);
 }
 
+static mpc_val_t *mpcf_tag_id(mpc_val_t *x, void *d) {
+  return mpc_ast_tag_id(x, (int)(size_t)d);
+}
+
+static mpc_val_t *mpcf_add_tag_id(mpc_val_t *x, void *d) {
+  return mpc_ast_add_tag_id(x, (int)(size_t)d);
+}
+
+mpc_parser_t *mpca_tag_id(mpc_parser_t *a, int id) {
+  return mpc_apply_to(a, mpcf_tag_id, (void*)(size_t)id);
+}
+
+mpc_parser_t *mpca_add_tag_id(mpc_parser_t *a, int id) {
+  return mpc_apply_to(a, mpcf_add_tag_id, (void*)(size_t)id);
+}
+
 mpc_parser_t *mpca_root(mpc_parser_t *a) {
   return mpc_apply(a, (mpc_apply_t)mpc_ast_add_root);
 }
@@ -3294,6 +4779,7 @@ mpc_parser_t *mpca_or(int n, ...) {
   p->type = MPC_TYPE_OR;
   p->data.or.n = n;
   p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.or.jump = NULL;
 
   va_start(va, n);
   for (i = 0; i < n; i++) {
@@ -3420,6 +4906,7 @@ static mpc_val_t *mpcaf_grammar_string(mpc_val_t *x, void *s) {
   char *y = mpcf_unescape(x);
   mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_string(y) : mpc_tok(mpc_string(y));
   free(y);
+  if (st->flags & MPCA_LANG_TAG_IDS) { return mpca_state(mpca_tag_id(mpc_apply(p, mpcf_str_ast), MPC_TAG_STRING)); }
   return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "string"));
 }
 
@@ -3428,6 +4915,7 @@ static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
   char *y = mpcf_unescape(x);
   mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_char(y[0]) : mpc_tok(mpc_char(y[0]));
   free(y);
+  if (st->flags & MPCA_LANG_TAG_IDS) { return mpca_state(mpca_tag_id(mpc_apply(p, mpcf_str_ast), MPC_TAG_CHAR)); }
   return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "char"));
 }
 
@@ -3441,11 +4929,13 @@ static mpc_val_t *mpcaf_fold_regex(int n, mpc_val_t **xs) {
   (void)n;
   if (strchr(m, 'm')) { mode |= MPC_RE_MULTILINE; }
   if (strchr(m, 's')) { mode |= MPC_RE_DOTALL; }
+  if (st->flags & MPCA_LANG_RE_COMBINATOR) { mode |= MPC_RE_COMBINATOR; }
   y = mpcf_unescape_regex(y);
   p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_re_mode(y, mode) : mpc_tok(mpc_re_mode(y, mode));
   free(y);
   free(m);
 
+  if (st->flags & MPCA_LANG_TAG_IDS) { return mpca_state(mpca_tag_id(mpc_apply(p, mpcf_str_ast), MPC_TAG_REGEX)); }
   return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "regex"));
 }
 
@@ -3511,7 +5001,9 @@ static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
   mpc_parser_t *p = mpca_grammar_find_parser(x, st);
   free(x);
 
-  if (p->name) {
+  if (p->name && (st->flags & MPCA_LANG_TAG_IDS)) {
+    return mpca_state(mpca_root(mpca_add_tag_id(p, mpc_tag_intern(p->name))));
+  } else if (p->name) {
     return mpca_state(mpca_root(mpca_add_tag(p, p->name)));
   } else {
     return mpca_state(mpca_root(p));
@@ -3663,6 +5155,17 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
     mpc_optimise(stmt->grammar);
     mpc_define(left, stmt->grammar);
+    left->ast = 1;
+    stmt->grammar = left;
+    stmts++;
+  }
+
+  /* Optimise again now that forward references are defined */
+
+  stmts = x;
+  while(*stmts) {
+    stmt = *stmts;
+    if (stmt->grammar->retained) { mpc_optimise(stmt->grammar); }
     free(stmt->ident);
     free(stmt->name);
     free(stmt);
@@ -3890,38 +5393,358 @@ void mpc_stats(mpc_parser_t* p) {
   printf("Stats\n");
   printf("=====\n");
   printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
+  if (p->nodes) { printf("Node Count Before Optimising: %i\n", p->nodes); }
+}
+
+void mpc_parse_stats_print(mpc_parse_stats_t *s) {
+  printf("Parse Stats\n");
+  printf("===========\n");
+  printf("Memo Lookups: %li\n", s->memo_lookups);
+  printf("Memo Hits: %li (%.1f%%)\n", s->memo_hits,
+    s->memo_lookups ? 100.0 * s->memo_hits / s->memo_lookups : 0.0);
+  printf("Memo Stores: %li\n", s->memo_stores);
+  printf("Memo Evictions: %li\n", s->memo_evictions);
+  printf("Arena Hits: %li\n", s->arena_hits);
+  printf("Arena Mallocs: %li\n", s->arena_mallocs);
+  printf("Arena Pages: %li\n", s->arena_pages);
+  printf("Error Replays: %li\n", s->error_replays);
+}
+
+/*
+** Adds to `m` every byte that `p` can consume first.
+** Returns 1 if `p` might succeed without consuming
+** any input, or if nothing is known about it.
+*/
+
+enum {
+  MPC_FIRST_DEPTH_MAX = 32
+};
+
+static int mpc_first(mpc_parser_t *p, unsigned char *m, int depth) {
+
+  int j, x;
+
+  if (depth > MPC_FIRST_DEPTH_MAX) { return 1; }
+
+  switch (p->type) {
+
+    case MPC_TYPE_FAIL: return 0;
+
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SATISFY:
+      for (j = 1; j < 256; j++) { mpc_charset_add(m, (unsigned char)j); }
+      return 0;
+
+    case MPC_TYPE_SINGLE:
+      mpc_charset_add(m, (unsigned char)p->data.single.x);
+      return 0;
+
+    case MPC_TYPE_RANGE:
+      for (j = 0; j < 32; j++) { m[j] |= p->data.range.m[j]; }
+      return 0;
+
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      for (j = 0; j < 32; j++) { m[j] |= p->data.set.m[j]; }
+      return 0;
+
+    case MPC_TYPE_STRING:
+      if (p->data.string.n == 0) { return 1; }
+      mpc_charset_add(m, (unsigned char)p->data.string.x[0]);
+      return 0;
+
+    case MPC_TYPE_SPAN:
+      for (j = 0; j < 32; j++) { m[j] |= p->data.span.m[j]; }
+      return p->data.span.min == 0;
+
+    case MPC_TYPE_DFA:
+      x = 0;
+      for (j = 0; j < 256; j++) {
+        if (p->data.dfa.t[j] == MPC_DFA_DONE) { x = 1; }
+        if (p->data.dfa.t[j] >= 0) { mpc_charset_add(m, (unsigned char)j); }
+      }
+      return x;
+
+    case MPC_TYPE_EXPECT:     return mpc_first(p->data.expect.x, m, depth+1);
+    case MPC_TYPE_APPLY:      return mpc_first(p->data.apply.x, m, depth+1);
+    case MPC_TYPE_APPLY_TO:   return mpc_first(p->data.apply_to.x, m, depth+1);
+    case MPC_TYPE_CHECK:      return mpc_first(p->data.check.x, m, depth+1);
+    case MPC_TYPE_CHECK_WITH: return mpc_first(p->data.check_with.x, m, depth+1);
+    case MPC_TYPE_PREDICT:    return mpc_first(p->data.predict.x, m, depth+1);
+
+    case MPC_TYPE_MAYBE:
+      mpc_first(p->data.not.x, m, depth+1);
+      return 1;
+
+    case MPC_TYPE_MANY:
+      mpc_first(p->data.repeat.x, m, depth+1);
+      return 1;
+
+    case MPC_TYPE_MANY1:
+      return mpc_first(p->data.repeat.x, m, depth+1);
+
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.n == 0) { return 1; }
+      return mpc_first(p->data.repeat.x, m, depth+1);
+
+    case MPC_TYPE_OR:
+      x = 0;
+      for (j = 0; j < p->data.or.n; j++) {
+        x = mpc_first(p->data.or.xs[j], m, depth+1) || x;
+      }
+      return x;
+
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n; j++) {
+        if (!mpc_first(p->data.and.xs[j], m, depth+1)) { return 0; }
+      }
+      return 1;
+
+    /* Undefined parsers may still be defined later */
+    default: return 1;
+  }
+
+}
+
+static void mpc_optimise_jump(mpc_parser_t *p) {
+
+  int j, b, n = 0;
+  unsigned char m[32];
+  unsigned char *jump;
+
+  free(p->data.or.jump);
+  p->data.or.jump = NULL;
+
+  if (p->data.or.n < 2 || p->data.or.n >= MPC_OR_JUMP_MANY) { return; }
+
+  jump = malloc(256);
+  memset(jump, MPC_OR_JUMP_NONE, 256);
+
+  for (j = 0; j < p->data.or.n; j++) {
+    memset(m, 0, sizeof(m));
+    if (mpc_first(p->data.or.xs[j], m, 0)) { free(jump); return; }
+    for (b = 1; b < 256; b++) {
+      if (!mpc_charset_has(m, (unsigned char)b)) { continue; }
+      jump[b] = jump[b] == MPC_OR_JUMP_NONE ? (unsigned char)j : MPC_OR_JUMP_MANY;
+    }
+  }
+
+  for (b = 0; b < 256; b++) {
+    if (jump[b] == MPC_OR_JUMP_MANY) { jump[b] = MPC_OR_JUMP_NONE; }
+    if (jump[b] != MPC_OR_JUMP_NONE) { n++; }
+  }
+
+  if (n == 0) { free(jump); return; }
+  p->data.or.jump = jump;
+}
+
+/*
+** Marks parsers the engine can run without a
+** frame of their own. `flat` holds the height of
+** such a chain, so that it stays short, and is
+** zero for everything else. Retained children are
+** left out since they may be redefined or need
+** memoizing.
+*/
+
+static int mpc_flat_height(mpc_parser_t *x) {
+  if (x->retained) { return 0; }
+  return ((MPC_TYPE_LEAVES >> x->type) & 1) ? 1 : x->flat;
+}
+
+static void mpc_optimise_flat(mpc_parser_t *p) {
+
+  int i, n, h;
+
+  p->flat = 0;
+
+  switch (p->type) {
+    case MPC_TYPE_APPLY:    n = mpc_flat_height(p->data.apply.x);    break;
+    case MPC_TYPE_APPLY_TO: n = mpc_flat_height(p->data.apply_to.x); break;
+    case MPC_TYPE_EXPECT:   n = mpc_flat_height(p->data.expect.x);   break;
+    case MPC_TYPE_MANY:     n = mpc_flat_height(p->data.repeat.x);   break;
+    case MPC_TYPE_AND:
+      n = 1;
+      for (i = 0; i < p->data.and.n; i++) {
+        h = mpc_flat_height(p->data.and.xs[i]);
+        if (h == 0) { return; }
+        if (h > n) { n = h; }
+      }
+      break;
+    default: return;
+  }
+
+  if (n > 0 && n < MPC_PARSE_CHAIN_MAX) { p->flat = (char)(n + 1); }
+}
+
+/*
+** Character parsers match one byte out of a set,
+** and several of them can be gathered into a
+** single bitmap.
+*/
+
+static int mpc_optimise_char(mpc_parser_t *p) {
+  if (p->retained) { return 0; }
+  if (p->type == MPC_TYPE_SINGLE) { return p->data.single.x != '\0'; }
+  return p->type == MPC_TYPE_RANGE
+      || p->type == MPC_TYPE_ONEOF
+      || p->type == MPC_TYPE_NONEOF;
+}
+
+static void mpc_optimise_charset(mpc_parser_t *p, unsigned char *m) {
+  int j;
+  switch (p->type) {
+    case MPC_TYPE_SINGLE: mpc_charset_add(m, (unsigned char)p->data.single.x); break;
+    case MPC_TYPE_RANGE:  for (j = 0; j < 32; j++) { m[j] |= p->data.range.m[j]; } break;
+    default:              for (j = 0; j < 32; j++) { m[j] |= p->data.set.m[j]; } break;
+  }
+}
+
+static int mpc_optimise_cannot_fail(mpc_parser_t *p) {
+  if (p->retained) { return 0; }
+  if (p->type == MPC_TYPE_SPAN) { return p->data.span.min == 0; }
+  return p->type == MPC_TYPE_PASS
+      || p->type == MPC_TYPE_LIFT
+      || p->type == MPC_TYPE_LIFT_VAL;
+}
+
+/* Replaces `p` by its only child `t`, keeping the name and flags of `p` */
+static void mpc_optimise_replace(mpc_parser_t *p, mpc_parser_t *t) {
+  p->type = t->type;
+  p->data = t->data;
+  free(t->name);
+  free(t);
+}
+
+/*
+** Below an `apply` of `mpcf_free` nothing reads
+** the folded string, so `strfold` sequences and
+** repeats just free their parts and spans skip.
+** Returns 0 if `p` does not build a string.
+*/
+
+static int mpc_optimise_unfold(mpc_parser_t *p) {
+
+  int i;
+
+  if (p->retained || p->fixed) { return 0; }
+
+  switch (p->type) {
+    case MPC_TYPE_SPAN:
+      p->data.span.skip = 1;
+      return 1;
+    case MPC_TYPE_AND:
+      if (p->data.and.f != mpcf_strfold) { return 0; }
+      p->data.and.f = mpcf_all_free;
+      for (i = 0; i < p->data.and.n; i++) { mpc_optimise_unfold(p->data.and.xs[i]); }
+      return 1;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.f != mpcf_strfold) { return 0; }
+      p->data.repeat.f = mpcf_all_free;
+      mpc_optimise_unfold(p->data.repeat.x);
+      return 1;
+    default:
+      return 0;
+  }
 }
 
-static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
+/*
+** Fuses the first run of two or more literal
+** characters and strings in a `strfold` sequence
+** into one string. Returns 0 if there is none.
+*/
+
+static int mpc_optimise_strings(mpc_parser_t *p) {
+
+  int i, j, k;
+  size_t l;
+  char *x;
+  mpc_parser_t *t;
+
+  for (j = 0; j < p->data.and.n; j = k + 1) {
+
+    for (k = j; k < p->data.and.n; k++) {
+      t = p->data.and.xs[k];
+      if (t->retained) { break; }
+      if (t->type == MPC_TYPE_SINGLE && t->data.single.x != '\0') { continue; }
+      if (t->type == MPC_TYPE_STRING) { continue; }
+      break;
+    }
+
+    if (k - j < 2) { continue; }
+
+    l = 0;
+    for (i = j; i < k; i++) {
+      t = p->data.and.xs[i];
+      l += t->type == MPC_TYPE_SINGLE ? 1 : t->data.string.n;
+    }
+
+    x = malloc(l + 1);
+    l = 0;
+    for (i = j; i < k; i++) {
+      t = p->data.and.xs[i];
+      if (t->type == MPC_TYPE_SINGLE) { x[l++] = t->data.single.x; }
+      else { memcpy(x + l, t->data.string.x, t->data.string.n); l += t->data.string.n; }
+      if (i > j) { mpc_delete(t); }
+    }
+    x[l] = '\0';
+
+    t = p->data.and.xs[j];
+    if (t->type == MPC_TYPE_STRING) { free(t->data.string.x); }
+    t->type = MPC_TYPE_STRING;
+    t->data.string.x = x;
+    t->data.string.n = l;
+
+    memmove(p->data.and.xs + j + 1, p->data.and.xs + k, (p->data.and.n - k) * sizeof(mpc_parser_t*));
+    p->data.and.n -= k - j - 1;
+    for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = free; }
+    return 1;
+  }
+
+  return 0;
+}
+
+/*
+** `quiet` is set below an `expect` or `not`, where
+** errors are suppressed while parsing. Rewrites
+** that would change only the errors reported are
+** made there and nowhere else.
+*/
+
+static void mpc_optimise_unretained(mpc_parser_t *p, int force, int quiet) {
 
   int i, n, m;
+  unsigned char cs[32];
   mpc_parser_t *t;
 
+  if (p->fixed) { return; }
   if (p->retained && !force) { return; }
 
   /* Optimise Subexpressions */
 
-  if (p->type == MPC_TYPE_EXPECT)     { mpc_optimise_unretained(p->data.expect.x, 0); }
-  if (p->type == MPC_TYPE_APPLY)      { mpc_optimise_unretained(p->data.apply.x, 0); }
-  if (p->type == MPC_TYPE_APPLY_TO)   { mpc_optimise_unretained(p->data.apply_to.x, 0); }
-  if (p->type == MPC_TYPE_CHECK)      { mpc_optimise_unretained(p->data.check.x, 0); }
-  if (p->type == MPC_TYPE_CHECK_WITH) { mpc_optimise_unretained(p->data.check_with.x, 0); }
-  if (p->type == MPC_TYPE_PREDICT)    { mpc_optimise_unretained(p->data.predict.x, 0); }
-  if (p->type == MPC_TYPE_NOT)        { mpc_optimise_unretained(p->data.not.x, 0); }
-  if (p->type == MPC_TYPE_MAYBE)      { mpc_optimise_unretained(p->data.not.x, 0); }
-  if (p->type == MPC_TYPE_MANY)       { mpc_optimise_unretained(p->data.repeat.x, 0); }
-  if (p->type == MPC_TYPE_MANY1)      { mpc_optimise_unretained(p->data.repeat.x, 0); }
-  if (p->type == MPC_TYPE_COUNT)      { mpc_optimise_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_EXPECT)     { mpc_optimise_unretained(p->data.expect.x, 0, 1); }
+  if (p->type == MPC_TYPE_APPLY)      { mpc_optimise_unretained(p->data.apply.x, 0, quiet); }
+  if (p->type == MPC_TYPE_APPLY_TO)   { mpc_optimise_unretained(p->data.apply_to.x, 0, quiet); }
+  if (p->type == MPC_TYPE_CHECK)      { mpc_optimise_unretained(p->data.check.x, 0, quiet); }
+  if (p->type == MPC_TYPE_CHECK_WITH) { mpc_optimise_unretained(p->data.check_with.x, 0, quiet); }
+  if (p->type == MPC_TYPE_PREDICT)    { mpc_optimise_unretained(p->data.predict.x, 0, quiet); }
+  if (p->type == MPC_TYPE_NOT)        { mpc_optimise_unretained(p->data.not.x, 0, 1); }
+  if (p->type == MPC_TYPE_MAYBE)      { mpc_optimise_unretained(p->data.not.x, 0, quiet); }
+  if (p->type == MPC_TYPE_MANY)       { mpc_optimise_unretained(p->data.repeat.x, 0, quiet); }
+  if (p->type == MPC_TYPE_MANY1)      { mpc_optimise_unretained(p->data.repeat.x, 0, quiet); }
+  if (p->type == MPC_TYPE_COUNT)      { mpc_optimise_unretained(p->data.repeat.x, 0, quiet); }
 
   if (p->type == MPC_TYPE_OR) {
     for(i = 0; i < p->data.or.n; i++) {
-      mpc_optimise_unretained(p->data.or.xs[i], 0);
+      mpc_optimise_unretained(p->data.or.xs[i], 0, quiet);
     }
   }
 
   if (p->type == MPC_TYPE_AND) {
     for(i = 0; i < p->data.and.n; i++) {
-      mpc_optimise_unretained(p->data.and.xs[i], 0);
+      mpc_optimise_unretained(p->data.and.xs[i], 0, quiet);
     }
   }
 
@@ -3938,7 +5761,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       p->data.or.n = n + m - 1;
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + n - 1, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
+      free(t->data.or.xs); free(t->data.or.jump); free(t->name); free(t);
       continue;
     }
 
@@ -3952,7 +5775,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
       memmove(p->data.or.xs + m, p->data.or.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
       memmove(p->data.or.xs, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
+      free(t->data.or.xs); free(t->data.or.jump); free(t->name); free(t);
       continue;
     }
 
@@ -4055,13 +5878,581 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
       continue;
     }
 
-    return;
+    /* Fuse re `and` strings */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.f == mpcf_strfold
+    &&  mpc_optimise_strings(p)) {
+      continue;
+    }
+
+    /* Remove re unary `and` */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.n == 1
+    &&  p->data.and.f == mpcf_strfold
+    && !p->data.and.xs[0]->retained) {
+      t = p->data.and.xs[0];
+      free(p->data.and.xs); free(p->data.and.dxs);
+      mpc_optimise_replace(p, t);
+      continue;
+    }
+
+    /* Merge `or` of characters */
+    if (p->type == MPC_TYPE_OR && p->data.or.n > 0) {
+      for (i = 0; i < p->data.or.n; i++) {
+        if (!mpc_optimise_char(p->data.or.xs[i])) { break; }
+      }
+      if (i == p->data.or.n) {
+        memset(cs, 0, sizeof(cs));
+        for (i = 0; i < p->data.or.n; i++) {
+          mpc_optimise_charset(p->data.or.xs[i], cs);
+          mpc_delete(p->data.or.xs[i]);
+        }
+        free(p->data.or.xs); free(p->data.or.jump);
+        p->type = MPC_TYPE_ONEOF;
+        p->data.set.x = malloc(256);
+        for (i = 1, n = 0; i < 256; i++) {
+          if (mpc_charset_has(cs, (unsigned char)i)) { p->data.set.x[n++] = (char)i; }
+        }
+        p->data.set.x[n] = '\0';
+        memcpy(p->data.set.m, cs, sizeof(cs));
+        continue;
+      }
+    }
+
+    /* Scan re `many` of characters */
+    if ((p->type == MPC_TYPE_MANY || p->type == MPC_TYPE_MANY1)
+    &&  p->data.repeat.f == mpcf_strfold
+    &&  mpc_optimise_char(p->data.repeat.x)) {
+      t = p->data.repeat.x;
+      memset(cs, 0, sizeof(cs));
+      mpc_optimise_charset(t, cs);
+      mpc_delete(t);
+      p->data.span.min = p->type == MPC_TYPE_MANY1;
+      p->data.span.skip = 0;
+      memcpy(p->data.span.m, cs, sizeof(cs));
+      p->type = MPC_TYPE_SPAN;
+      continue;
+    }
+
+    /* Remove freed `strfold` and spans */
+    if (p->type == MPC_TYPE_APPLY
+    &&  p->data.apply.f == mpcf_free
+    &&  mpc_optimise_unfold(p->data.apply.x)) {
+      mpc_optimise_replace(p, p->data.apply.x);
+      continue;
+    }
+
+    /* Remove quiet `expect` */
+    if (p->type == MPC_TYPE_EXPECT
+    &&  (quiet || mpc_optimise_cannot_fail(p->data.expect.x))
+    && !p->data.expect.x->retained) {
+      t = p->data.expect.x;
+      free(p->data.expect.m);
+      mpc_optimise_replace(p, t);
+      continue;
+    }
+
+    break;
 
   }
 
+  /* Build `or` jump table */
+
+  if (p->type == MPC_TYPE_OR) { mpc_optimise_jump(p); }
+
+  mpc_optimise_flat(p);
+
 }
 
 void mpc_optimise(mpc_parser_t *p) {
-  mpc_optimise_unretained(p, 1);
+  int n = p->nodes ? p->nodes : mpc_nodecount_unretained(p, 1);
+  mpc_optimise_unretained(p, 1, 0);
+  if (!p->fixed) { p->nodes = n; }
+}
+
+
+/*
+** Static Grammars
+**
+** `mpc_emit` writes a parser graph out as C source
+** for static data. Defining `MPC_GRAMMAR` as the
+** name of that file compiles it into this one, and
+** `mpc_static` then hands out its parsers without
+** building anything or allocating.
+**
+** Functions are written out by name, so only those
+** mpc itself provides can appear in the graph, and
+** user data pointers are not supported.
+*/
+
+typedef void (*mpc_emit_fn_t)(void);
+
+typedef struct {
+  mpc_emit_fn_t f;
+  const char *name;
+} mpc_emit_name_t;
+
+#define MPC_EMIT_NAME(f) { (mpc_emit_fn_t)f, #f }
+
+static const mpc_emit_name_t mpc_emit_names[] = {
+  MPC_EMIT_NAME(free),
+  MPC_EMIT_NAME(mpcf_dtor_null),
+  MPC_EMIT_NAME(mpcf_ctor_null),
+  MPC_EMIT_NAME(mpcf_ctor_str),
+  MPC_EMIT_NAME(mpcf_free),
+  MPC_EMIT_NAME(mpcf_int),
+  MPC_EMIT_NAME(mpcf_hex),
+  MPC_EMIT_NAME(mpcf_oct),
+  MPC_EMIT_NAME(mpcf_float),
+  MPC_EMIT_NAME(mpcf_strtriml),
+  MPC_EMIT_NAME(mpcf_strtrimr),
+  MPC_EMIT_NAME(mpcf_strtrim),
+  MPC_EMIT_NAME(mpcf_escape),
+  MPC_EMIT_NAME(mpcf_escape_regex),
+  MPC_EMIT_NAME(mpcf_escape_string_raw),
+  MPC_EMIT_NAME(mpcf_escape_char_raw),
+  MPC_EMIT_NAME(mpcf_unescape),
+  MPC_EMIT_NAME(mpcf_unescape_regex),
+  MPC_EMIT_NAME(mpcf_unescape_string_raw),
+  MPC_EMIT_NAME(mpcf_unescape_char_raw),
+  MPC_EMIT_NAME(mpcf_null),
+  MPC_EMIT_NAME(mpcf_fst),
+  MPC_EMIT_NAME(mpcf_snd),
+  MPC_EMIT_NAME(mpcf_trd),
+  MPC_EMIT_NAME(mpcf_fst_free),
+  MPC_EMIT_NAME(mpcf_snd_free),
+  MPC_EMIT_NAME(mpcf_trd_free),
+  MPC_EMIT_NAME(mpcf_all_free),
+  MPC_EMIT_NAME(mpcf_strfold),
+  MPC_EMIT_NAME(mpcf_maths),
+  MPC_EMIT_NAME(mpcf_str_ast),
+  MPC_EMIT_NAME(mpcf_state_ast),
+  MPC_EMIT_NAME(mpcf_fold_ast),
+  MPC_EMIT_NAME(mpcf_tag_id),
+  MPC_EMIT_NAME(mpcf_add_tag_id),
+  MPC_EMIT_NAME(mpc_ast_delete),
+  MPC_EMIT_NAME(mpc_ast_add_root),
+  MPC_EMIT_NAME(mpc_ast_tag),
+  MPC_EMIT_NAME(mpc_ast_add_tag),
+  MPC_EMIT_NAME(mpc_boundary_anchor),
+  MPC_EMIT_NAME(mpc_boundary_newline_anchor),
+  { NULL, NULL }
+};
+
+#undef MPC_EMIT_NAME
+
+typedef struct {
+  FILE *f;
+  mpc_parser_t **ps;
+  int ps_num;
+  int ps_slots;
+  int failed;
+} mpc_emit_t;
+
+static void mpc_emit_fail(mpc_emit_t *s, mpc_parser_t *p, const char *what) {
+  if (s->failed) { return; }
+  fprintf(s->f, "#error \"mpc_emit: parser '%s' has %s that cannot be written out\"\n",
+    p->name ? p->name : "<unnamed>", what);
+  s->failed = 1;
+}
+
+static int mpc_emit_index(mpc_emit_t *s, mpc_parser_t *p) {
+  int i;
+  for (i = 0; i < s->ps_num; i++) {
+    if (s->ps[i] == p) { return i; }
+  }
+  return -1;
+}
+
+static mpc_parser_t **mpc_emit_children(mpc_parser_t *p, int *n) {
+  *n = 1;
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:     return &p->data.expect.x;
+    case MPC_TYPE_APPLY:      return &p->data.apply.x;
+    case MPC_TYPE_APPLY_TO:   return &p->data.apply_to.x;
+    case MPC_TYPE_CHECK:      return &p->data.check.x;
+    case MPC_TYPE_CHECK_WITH: return &p->data.check_with.x;
+    case MPC_TYPE_PREDICT:    return &p->data.predict.x;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:      return &p->data.not.x;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:      return &p->data.repeat.x;
+    case MPC_TYPE_OR:  *n = p->data.or.n;  return p->data.or.xs;
+    case MPC_TYPE_AND: *n = p->data.and.n; return p->data.and.xs;
+    default: *n = 0; return NULL;
+  }
+}
+
+static void mpc_emit_collect(mpc_emit_t *s, mpc_parser_t *p) {
+
+  int i, n;
+  mpc_parser_t **xs;
+
+  if (mpc_emit_index(s, p) >= 0) { return; }
+
+  if (s->ps_num == s->ps_slots) {
+    s->ps_slots = s->ps_slots ? s->ps_slots * 2 : 64;
+    s->ps = realloc(s->ps, sizeof(mpc_parser_t*) * s->ps_slots);
+  }
+  s->ps[s->ps_num++] = p;
+
+  xs = mpc_emit_children(p, &n);
+  for (i = 0; i < n; i++) { mpc_emit_collect(s, xs[i]); }
+}
+
+static void mpc_emit_string(mpc_emit_t *s, const char *x, size_t n) {
+  size_t i;
+  if (x == NULL) { fprintf(s->f, "NULL"); return; }
+  fputc('"', s->f);
+  for (i = 0; i < n; i++) {
+    unsigned char c = (unsigned char)x[i];
+    if (c == '"' || c == '\\') { fprintf(s->f, "\\%c", c); }
+    else if (c >= 32 && c < 127 && c != '?') { fputc(c, s->f); }
+    else { fprintf(s->f, "\\%03o", c); }
+  }
+  fputc('"', s->f);
+}
+
+static void mpc_emit_fn(mpc_emit_t *s, mpc_parser_t *p, mpc_emit_fn_t f, const char *cast) {
+  int i;
+  if (f == NULL) { fprintf(s->f, "NULL"); return; }
+  for (i = 0; mpc_emit_names[i].f; i++) {
+    if (mpc_emit_names[i].f == f) {
+      fprintf(s->f, "(%s)%s", cast, mpc_emit_names[i].name);
+      return;
+    }
+  }
+  fprintf(s->f, "NULL");
+  mpc_emit_fail(s, p, "a function");
+}
+
+static void mpc_emit_bytes(mpc_emit_t *s, const unsigned char *m, int n) {
+  int i;
+  fprintf(s->f, "{");
+  for (i = 0; i < n; i++) { fprintf(s->f, "%s%u", i ? "," : "", m[i]); }
+  fprintf(s->f, "}");
+}
+
+static void mpc_emit_ref(mpc_emit_t *s, mpc_parser_t *p) {
+  fprintf(s->f, "&mpc_static_ps[%d]", mpc_emit_index(s, p));
+}
+
+/* Writes the arrays a parser points to, ahead of the parsers themselves */
+static void mpc_emit_arrays(mpc_emit_t *s, int k) {
+
+  int i;
+  mpc_parser_t *p = s->ps[k];
+
+  switch (p->type) {
+
+    case MPC_TYPE_OR:
+      fprintf(s->f, "static mpc_parser_t *mpc_static_xs%d[] = {", k);
+      for (i = 0; i < p->data.or.n; i++) {
+        fprintf(s->f, "%s", i ? ", " : " ");
+        mpc_emit_ref(s, p->data.or.xs[i]);
+      }
+      fprintf(s->f, " };\n");
+      if (p->data.or.jump) {
+        fprintf(s->f, "static unsigned char mpc_static_jump%d[256] = ", k);
+        mpc_emit_bytes(s, p->data.or.jump, 256);
+        fprintf(s->f, ";\n");
+      }
+      break;
+
+    case MPC_TYPE_AND:
+      fprintf(s->f, "static mpc_parser_t *mpc_static_xs%d[] = {", k);
+      for (i = 0; i < p->data.and.n; i++) {
+        fprintf(s->f, "%s", i ? ", " : " ");
+        mpc_emit_ref(s, p->data.and.xs[i]);
+      }
+      fprintf(s->f, " };\n");
+      if (p->data.and.n > 1) {
+        fprintf(s->f, "static mpc_dtor_t mpc_static_dxs%d[] = {", k);
+        for (i = 0; i < p->data.and.n-1; i++) {
+          fprintf(s->f, "%s", i ? ", " : " ");
+          mpc_emit_fn(s, p, (mpc_emit_fn_t)p->data.and.dxs[i], "mpc_dtor_t");
+        }
+        fprintf(s->f, " };\n");
+      }
+      break;
+
+    case MPC_TYPE_DFA:
+      fprintf(s->f, "static short mpc_static_dfa%d[] = {", k);
+      for (i = 0; i < p->data.dfa.n * 256; i++) {
+        fprintf(s->f, "%s%d", i == 0 ? "\n  " : i % 32 ? "," : ",\n  ", p->data.dfa.t[i]);
+      }
+      fprintf(s->f, "\n};\n");
+      break;
+
+    default: break;
+  }
+}
+
+static void mpc_emit_parser(mpc_emit_t *s, int k) {
+
+  mpc_parser_t *p = s->ps[k];
+  FILE *f = s->f;
+
+  fprintf(f, "  { ");
+  mpc_emit_string(s, p->name, p->name ? strlen(p->name) : 0);
+  fprintf(f, ", { ");
+
+  switch (p->type) {
+
+    case MPC_TYPE_FAIL:
+      fprintf(f, ".fail = { ");
+      mpc_emit_string(s, p->data.fail.m, strlen(p->data.fail.m));
+      fprintf(f, " }");
+      break;
+
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+      if (p->data.lift.x) { mpc_emit_fail(s, p, "a lifted value"); }
+      fprintf(f, ".lift = { ");
+      mpc_emit_fn(s, p, (mpc_emit_fn_t)p->data.lift.lf, "mpc_ctor_t");
+      fprintf(f, ", NULL }");
+      break;
+
+    case MPC_TYPE_EXPECT:
+      fprintf(f, ".expect = { ");
+      mpc_emit_ref(s, p->data.expect.x);
+      fprintf(f, ", ");
+      mpc_emit_string(s, p->data.expect.m, strlen(p->data.expect.m));
+      fprintf(f, " }");
+      break;
+
+    case MPC_TYPE_ANCHOR:
+      fprintf(f, ".anchor = { ");
+      mpc_emit_fn(s, p, (mpc_emit_fn_t)p->data.anchor.f, "int(*)(char,char)");
+      fprintf(f, " }");
+      break;
+
+    case MPC_TYPE_SINGLE:
+      fprintf(f, ".single = { %d }", p->data.single.x);
+      break;
+
+    case MPC_TYPE_RANGE:
+      fprintf(f, ".range = { %d, %d, ", p->data.range.x, p->data.range.y);
+      mpc_emit_bytes(s, p->data.range.m, 32);
+      fprintf(f, " }");
+      break;
+
+    case MPC_TYPE_SATISFY:
+      fprintf(f, ".satisfy = { ");
+      mpc_emit_fn(s, p, (mpc_emit_fn_t)p->data.satisfy.f, "int(*)(char)");
+      fprintf(f, " }");
+      break;
+
+    case MPC_TYPE_STRING:
+      fprintf(f, ".string = { ");
+      mpc_emit_string(s, p->data.string.x, p->data.string.n);
+      fprintf(f, ", %lu }", (unsigned long)p->data.string.n);
+      break;
+
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      fprintf(f, ".set = { ");
+      mpc_emit_string(s, p->data.set.x, strlen(p->data.set.x));
+      fprintf(f, ", ");
+      mpc_emit_bytes(s, p->data.set.m, 32);
+      fprintf(f, " }");
+      break;
+
+    case MPC_TYPE_APPLY:
+      fprintf(f, ".apply = { ");
+      mpc_emit_ref(s, p->data.apply.x);
+      fprintf(f, ", ");
+      mpc_emit_fn(s, p, (mpc_emit_fn_t)p->data.apply.f, "mpc_apply_t");
+      fprintf(f, " }");
+      break;
+
+    case MPC_TYPE_APPLY_TO:
+      fprintf(f, ".apply_to = { ");
+      mpc_emit_ref(s, p->data.apply_to.x);
+      fprintf(f, ", ");
+      mpc_emit_fn(s, p, (mpc_emit_fn_t)p->data.apply_to.f, "mpc_apply_to_t");
+      fprintf(f, ", ");
+      if (p->data.apply_to.f == mpcf_tag_id || p->data.apply_to.f == mpcf_add_tag_id) {
+        fprintf(f, "(void*)%lu", (unsigned long)(size_t)p->data.apply_to.d);
+      } else if (p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_tag
+             ||  p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_add_tag) {
+        mpc_emit_string(s, p->data.apply_to.d, strlen(p->data.apply_to.d));
+      } else {
+        fprintf(f, "NULL");
+        if (p->data.apply_to.d) { mpc_emit_fail(s, p, "user data"); }
+      }
+      fprintf(f, " }");
+      break;
+
+    case MPC_TYPE_CHECK:
+      fprintf(f, ".check = { ");
+      mpc_emit_ref(s, p->data.check.x);
+      fprintf(f, ", ");
+      mpc_emit_fn(s, p, (mpc_emit_fn_t)p->data.check.dx, "mpc_dtor_t");
+      fprintf(f, ", ");
+      mpc_emit_fn(s, p, (mpc_emit_fn_t)p->data.check.f, "mpc_check_t");
+      fprintf(f, ", ");
+      mpc_emit_string(s, p->data.check.e, strlen(p->data.check.e));
+      fprintf(f, " }");
+      break;
+
+    case MPC_TYPE_CHECK_WITH:
+      mpc_emit_fail(s, p, "a check with user data");
+      break;
+
+    case MPC_TYPE_PREDICT:
+      fprintf(f, ".predict = { ");
+      mpc_emit_ref(s, p->data.predict.x);
+      fprintf(f, " }");
+      break;
+
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      fprintf(f, ".not = { ");
+      mpc_emit_ref(s, p->data.not.x);
+      fprintf(f, ", ");
+      mpc_emit_fn(s, p, (mpc_emit_fn_t)p->data.not.dx, "mpc_dtor_t");
+      fprintf(f, ", ");
+      mpc_emit_fn(s, p, (mpc_emit_fn_t)p->data.not.lf, "mpc_ctor_t");
+      fprintf(f, " }");
+      break;
+
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      fprintf(f, ".repeat = { %d, ", p->data.repeat.n);
+      mpc_emit_fn(s, p, (mpc_emit_fn_t)p->data.repeat.f, "mpc_fold_t");
+      fprintf(f, ", ");
+      mpc_emit_ref(s, p->data.repeat.x);
+      fprintf(f, ", ");
+      mpc_emit_fn(s, p, (mpc_emit_fn_t)p->data.repeat.dx, "mpc_dtor_t");
+      fprintf(f, " }");
+      break;
+
+    case MPC_TYPE_OR:
+      fprintf(f, ".or = { %d, mpc_static_xs%d, ", p->data.or.n, k);
+      if (p->data.or.jump) { fprintf(f, "mpc_static_jump%d }", k); }
+      else { fprintf(f, "NULL }"); }
+      break;
+
+    case MPC_TYPE_AND:
+      fprintf(f, ".and = { %d, ", p->data.and.n);
+      mpc_emit_fn(s, p, (mpc_emit_fn_t)p->data.and.f, "mpc_fold_t");
+      fprintf(f, ", mpc_static_xs%d, ", k);
+      if (p->data.and.n > 1) { fprintf(f, "mpc_static_dxs%d }", k); }
+      else { fprintf(f, "NULL }"); }
+      break;
+
+    case MPC_TYPE_DFA:
+      fprintf(f, ".dfa = { %d, mpc_static_dfa%d }", p->data.dfa.n, k);
+      break;
+
+    case MPC_TYPE_SPAN:
+      fprintf(f, ".span = { %d, %d, ", p->data.span.min, p->data.span.skip);
+      mpc_emit_bytes(s, p->data.span.m, 32);
+      fprintf(f, " }");
+      break;
+
+    default:
+      fprintf(f, ".fail = { NULL }");
+      break;
+  }
+
+  fprintf(f, " }, %d, %d, %d, %d, 1, %d },\n", p->type, p->retained, p->ast, p->flat, p->nodes);
+}
+
+int mpc_emit(FILE *f, const char *name, int n, ...) {
+
+  int i;
+  mpc_emit_t s;
+  mpc_parser_t **roots = malloc(sizeof(mpc_parser_t*) * n);
+  va_list va;
+
+  s.f = f;
+  s.ps = NULL;
+  s.ps_num = 0;
+  s.ps_slots = 0;
+  s.failed = 0;
+
+  va_start(va, n);
+  for (i = 0; i < n; i++) {
+    roots[i] = va_arg(va, mpc_parser_t*);
+    mpc_emit_collect(&s, roots[i]);
+  }
+  va_end(va);
+
+  fprintf(f, "/*\n** Generated by mpc_emit from the grammar \"%s\".\n", name);
+  fprintf(f, "** Compile into mpc.c by defining MPC_GRAMMAR.\n*/\n\n");
+
+  fprintf(f, "static const char *mpc_static_name = ");
+  mpc_emit_string(&s, name, strlen(name));
+  fprintf(f, ";\n\n");
+
+  fprintf(f, "static mpc_parser_t mpc_static_ps[%d];\n\n", s.ps_num);
+  for (i = 0; i < s.ps_num; i++) { mpc_emit_arrays(&s, i); }
+
+  fprintf(f, "\nstatic mpc_parser_t mpc_static_ps[%d] = {\n", s.ps_num);
+  for (i = 0; i < s.ps_num; i++) { mpc_emit_parser(&s, i); }
+  fprintf(f, "};\n\n");
+
+  fprintf(f, "static mpc_parser_t *mpc_static_roots[] = {");
+  for (i = 0; i < n; i++) {
+    fprintf(f, "%s", i ? ", " : " ");
+    mpc_emit_ref(&s, roots[i]);
+  }
+  fprintf(f, " };\n\n");
+
+  /* Tag IDs are baked into the parsers, so the table goes with them */
+  fprintf(f, "static char *mpc_static_tags[] = {\n");
+  mpc_tag_intern(">");
+  for (i = 0; i < mpc_tag_names_num; i++) {
+    fprintf(f, "  ");
+    mpc_emit_string(&s, mpc_tag_names[i], strlen(mpc_tag_names[i]));
+    fprintf(f, ",\n");
+  }
+  fprintf(f, "};\n");
+
+  free(s.ps);
+  free(roots);
+  return !s.failed;
+}
+
+#ifdef MPC_GRAMMAR
+#include MPC_GRAMMAR
+
+int mpc_static(const char *name, int n, ...) {
+
+  int i, tags_num = sizeof(mpc_static_tags) / sizeof(char*);
+  va_list va;
+
+  if (strcmp(name, mpc_static_name) != 0) { return 0; }
+  if (n != (int)(sizeof(mpc_static_roots) / sizeof(mpc_parser_t*))) { return 0; }
+
+  /* Adopt the tag table, unless some other grammar has already used IDs */
+  if (mpc_tag_names_num == 0) {
+    mpc_tag_names = mpc_static_tags;
+    mpc_tag_names_num = tags_num;
+    mpc_tag_names_static = 1;
+  } else {
+    for (i = 0; i < tags_num; i++) {
+      if (mpc_tag_intern(mpc_static_tags[i]) != i) { return 0; }
+    }
+  }
+
+  va_start(va, n);
+  for (i = 0; i < n; i++) { *va_arg(va, mpc_parser_t**) = mpc_static_roots[i]; }
+  va_end(va);
+
+  return 1;
+}
+
+#else
+
+int mpc_static(const char *name, int n, ...) {
+  (void) name;
+  (void) n;
+  return 0;
 }
 
+#endif
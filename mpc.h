@@ -65,7 +65,75 @@ typedef union {
 struct mpc_parser_t;
 typedef struct mpc_parser_t mpc_parser_t;
 
+/*
+** Parse Modes
+**
+** `MPC_PARSE_PACKRAT` caches the result of each named
+** parser at each input position for the duration of
+** one parse, so that backtracking never parses the
+** same rule at the same place twice.
+**
+** `MPC_PARSE_AST_ARENA` places every AST node built
+** by the parse into one arena owned by the result,
+** which `mpc_ast_delete` on the root frees at once.
+** It is meant for grammars built with `mpca_lang`;
+** for any other parser it is ignored.
+**
+** `MPC_PARSE_LAZY_ERRORS` first parses without
+** building any errors. Only if that parse fails is
+** it run again from the start to build the error,
+** which is then the same as in the default mode.
+**
+** `MPC_PARSE_POSITIONS` skips counting rows and
+** columns for each character consumed. They are
+** worked out from the byte offset instead, for the
+** error reported and for every state captured with
+** `mpc_state` (every tagged node in `mpca_lang`
+** grammars), and end up the same as in the default
+** mode. Marks still save the whole state. It has
+** not been measured to parse any faster.
+*/
+
+enum {
+  MPC_PARSE_DEFAULT     = 0,
+  MPC_PARSE_PACKRAT     = 1,
+  MPC_PARSE_AST_ARENA   = 2,
+  MPC_PARSE_LAZY_ERRORS = 4,
+  MPC_PARSE_POSITIONS   = 8
+};
+
+typedef struct {
+  long memo_lookups;
+  long memo_hits;
+  long memo_stores;
+  long memo_evictions;
+  long arena_hits;
+  long arena_mallocs;
+  long arena_pages;
+  long error_replays;
+} mpc_parse_stats_t;
+
+void mpc_parse_stats_print(mpc_parse_stats_t *s);
+
+/*
+** Reentrancy
+**
+** Parsing only ever reads the parser graph. All the
+** state a parse changes (position, marks, memo table,
+** value stacks, arenas, stats) lives in the input it
+** creates for itself, so any number of threads may
+** parse with the same parsers at once.
+**
+** What is not safe is changing the graph while it is
+** in use: building, defining, optimising or deleting
+** parsers, and `mpca_lang` and `mpc_static`, which
+** intern rule names into the global tag table. Build
+** every grammar first, then share it. A result, and
+** the AST in it, belongs to the thread that parsed it.
+*/
+
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
+int mpc_parse_mode(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r, int mode, mpc_parse_stats_t *stats);
 int mpc_nparse(const char *filename, const char *string, size_t length, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
@@ -266,12 +334,19 @@ mpc_val_t *mpcf_maths(int n, mpc_val_t** xs);
 ** Regular Expression Parsers
 */
 
+/*
+** Simple regular expressions are compiled into
+** a DFA table. Use `MPC_RE_COMBINATOR` to always
+** build them out of combinators instead.
+*/
+
 enum {
-  MPC_RE_DEFAULT   = 0,
-  MPC_RE_M         = 1,
-  MPC_RE_S         = 2,
-  MPC_RE_MULTILINE = 1,
-  MPC_RE_DOTALL    = 2
+  MPC_RE_DEFAULT    = 0,
+  MPC_RE_M          = 1,
+  MPC_RE_S          = 2,
+  MPC_RE_MULTILINE  = 1,
+  MPC_RE_DOTALL     = 2,
+  MPC_RE_COMBINATOR = 4
 };
 
 mpc_parser_t *mpc_re(const char *re);
@@ -281,14 +356,41 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode);
 ** AST
 */
 
+enum {
+  MPC_AST_TAGS_MAX = 8
+};
+
 typedef struct mpc_ast_t {
   char *tag;
   char *contents;
   mpc_state_t state;
   int children_num;
   struct mpc_ast_t** children;
+  int tags_num;
+  int tags[MPC_AST_TAGS_MAX];
+  struct mpc_ast_arena_t *arena;
 } mpc_ast_t;
 
+/*
+** Tag IDs
+**
+** With `MPCA_LANG_TAG_IDS` nodes hold their tags as
+** interned IDs and `tag` is NULL until rendered by
+** printing or by the string based functions below.
+** Use `mpc_ast_has_tag` to test for a rule in either
+** representation.
+*/
+
+enum {
+  MPC_TAG_ROOT   = 0,
+  MPC_TAG_REGEX  = 1,
+  MPC_TAG_CHAR   = 2,
+  MPC_TAG_STRING = 3
+};
+
+int mpc_tag_intern(const char *name);
+const char *mpc_tag_name(int id);
+
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents);
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...);
 mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a);
@@ -298,6 +400,10 @@ mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t);
 mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s);
 
+mpc_ast_t *mpc_ast_tag_id(mpc_ast_t *a, int id);
+mpc_ast_t *mpc_ast_add_tag_id(mpc_ast_t *a, int id);
+int mpc_ast_has_tag(mpc_ast_t *a, int id);
+
 void mpc_ast_delete(mpc_ast_t *a);
 void mpc_ast_print(mpc_ast_t *a);
 void mpc_ast_print_to(mpc_ast_t *a, FILE *fp);
@@ -326,6 +432,49 @@ mpc_ast_t *mpc_ast_traverse_next(mpc_ast_trav_t **trav);
 
 void mpc_ast_traverse_free(mpc_ast_trav_t **trav);
 
+/*
+** AST Iterators
+**
+** Walk a tree in pre or post order without
+** allocating per node. The stack of frames lives
+** in `buf` if given, else inside the iterator, and
+** only moves to the heap when the tree is deeper.
+** Call `mpc_ast_iter_free` to release it.
+**
+** `mpc_ast_visit` walks the whole tree and hands
+** the nodes to `f` in batches in the chosen order.
+** A nonzero return from `f` stops the walk and is
+** returned.
+*/
+
+enum {
+  MPC_AST_ITER_LOCAL = 32,
+  MPC_AST_VISIT_BATCH = 64
+};
+
+typedef struct {
+  mpc_ast_t *node;
+  int child;
+} mpc_ast_iter_frame_t;
+
+typedef struct {
+  mpc_ast_trav_order_t order;
+  mpc_ast_iter_frame_t *stack;
+  int depth;
+  int size;
+  int owned;
+  mpc_ast_iter_frame_t local[MPC_AST_ITER_LOCAL];
+} mpc_ast_iter_t;
+
+typedef int (*mpc_ast_visit_t)(mpc_ast_t **nodes, int n, void *data);
+
+void mpc_ast_iter_init(mpc_ast_iter_t *it, mpc_ast_t *ast, mpc_ast_trav_order_t order,
+                       mpc_ast_iter_frame_t *buf, int size);
+mpc_ast_t *mpc_ast_iter_next(mpc_ast_iter_t *it);
+void mpc_ast_iter_free(mpc_ast_iter_t *it);
+
+int mpc_ast_visit(mpc_ast_t *ast, mpc_ast_trav_order_t order, mpc_ast_visit_t f, void *data);
+
 /*
 ** Warning: This function currently doesn't test for equality of the `state` member!
 */
@@ -337,6 +486,8 @@ mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs);
 
 mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t);
 mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t);
+mpc_parser_t *mpca_tag_id(mpc_parser_t *a, int id);
+mpc_parser_t *mpca_add_tag_id(mpc_parser_t *a, int id);
 mpc_parser_t *mpca_root(mpc_parser_t *a);
 mpc_parser_t *mpca_state(mpc_parser_t *a);
 mpc_parser_t *mpca_total(mpc_parser_t *a);
@@ -354,7 +505,9 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_RE_COMBINATOR        = 4,
+  MPCA_LANG_TAG_IDS              = 8
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
@@ -364,6 +517,13 @@ mpc_err_t *mpca_lang_file(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_pipe(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...);
 
+/*
+** Static Grammars
+*/
+
+int mpc_emit(FILE *f, const char *name, int n, ...);
+int mpc_static(const char *name, int n, ...);
+
 /*
 ** Misc
 */
@@ -0,0 +1,193 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mpc.h"
+#include "reader.h"
+
+// Parses generated blisp source with the blisp grammar, once for each
+// parse mode and input kind, and then on a number of threads sharing the
+// grammar, and reports the throughput of each. Running it before and
+// after a change to mpc shows what the change is worth.
+typedef struct {
+  const char* name;
+  int mode;
+} lbench_mode;
+
+static const lbench_mode lbench_modes[] = {
+  { "default", MPC_PARSE_DEFAULT },
+  { "packrat", MPC_PARSE_PACKRAT },
+  { "arena", MPC_PARSE_AST_ARENA },
+  { "lazy-errors", MPC_PARSE_LAZY_ERRORS },
+  { "positions", MPC_PARSE_POSITIONS },
+  { NULL, 0 }
+};
+
+static long lclock() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+// Source of about `size` bytes: definitions, arithmetic and nested lists,
+// the mix a prelude or script has
+static char* lsource(size_t size) {
+  static const char* lines[] = {
+    "(def {fib} (\\ {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}}))\n",
+    "(+ 1 (* 2 3) (- 10 4) (/ 100 -5))\n",
+    "(list {a b c} {1 {2 {3 {4}}}} (head {x y z}))\n",
+    "(map (\\ {x} {* x x}) {1 2 3 4 5 6 7 8 9 10})\n",
+  };
+  char* s = malloc(size + 128);
+  size_t len = 0;
+  for (int i = 0; len < size; i++) {
+    const char* line = lines[i % 4];
+    memcpy(s + len, line, strlen(line));
+    len += strlen(line);
+  }
+  s[len] = '\0';
+  return s;
+}
+
+static int lparse(mpc_parser_t* p, const char* src, FILE* pipe, int mode) {
+  mpc_result_t r;
+  int ok = pipe ? mpc_parse_pipe("<bench>", pipe, p, &r)
+    : mpc_parse_mode("<bench>", src, p, &r, mode, NULL);
+  if (ok) {
+    mpc_ast_delete(r.output);
+  } else {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+  }
+  return ok;
+}
+
+// Parse `src` `runs` times and print how fast that went
+static int lbench(const char* grammar, mpc_parser_t* p, const char* src,
+    const char* name, int mode, int piped, long runs) {
+  size_t len = strlen(src);
+  long start = lclock();
+  for (long i = 0; i < runs; i++) {
+    FILE* pipe = NULL;
+    if (piped) {
+      pipe = tmpfile();
+      fwrite(src, 1, len, pipe);
+      rewind(pipe);
+    }
+    int ok = lparse(p, src, pipe, mode);
+    if (pipe) fclose(pipe);
+    if (!ok) return 0;
+  }
+  double seconds = (lclock() - start) / 1e9;
+
+  printf("%-8s %-12s %-6s %8.1f parses/s %8.2f MB/s\n", grammar, name,
+    piped ? "pipe" : "string", runs / seconds, runs * len / seconds / 1e6);
+  return 1;
+}
+
+// One of the threads parsing with a grammar they all share
+typedef struct {
+  mpc_parser_t* p;
+  const char* src;
+  long runs;
+  int ok;
+  pthread_t thread;
+} lworker;
+
+static void* lworker_run(void* arg) {
+  lworker* w = arg;
+  w->ok = 1;
+  for (long i = 0; w->ok && i < w->runs; i++) {
+    w->ok = lparse(w->p, w->src, NULL, MPC_PARSE_DEFAULT);
+  }
+  return NULL;
+}
+
+// Parse `src` `runs` times on each of 1 to `threads` threads at once, and
+// print the total parses/s and how that compares to one thread. Scaling
+// is only linear while there is a free CPU for each thread.
+static int lbench_threads(mpc_parser_t* p, const char* src, long runs,
+    long threads) {
+  lworker* workers = malloc(sizeof(lworker) * threads);
+  double single = 0;
+  int ok = 1;
+
+  printf("\nthreads  (%ld CPUs online)\n", sysconf(_SC_NPROCESSORS_ONLN));
+  for (long n = 1; ok && n <= threads; n++) {
+    long start = lclock();
+    for (long i = 0; i < n; i++) {
+      workers[i].p = p;
+      workers[i].src = src;
+      workers[i].runs = runs;
+      pthread_create(&workers[i].thread, NULL, lworker_run, &workers[i]);
+    }
+    for (long i = 0; i < n; i++) {
+      pthread_join(workers[i].thread, NULL);
+      ok = ok && workers[i].ok;
+    }
+    double rate = n * runs / ((lclock() - start) / 1e9);
+    if (n == 1) single = rate;
+
+    printf("%-8ld %8.1f parses/s %6.2fx of one thread\n", n, rate,
+      rate / single);
+  }
+
+  free(workers);
+  return ok;
+}
+
+static void lusage() {
+  fputs("usage: parsebench [-s bytes] [-n runs] [-t threads]\n", stderr);
+  exit(2);
+}
+
+int main(int argc, char** argv) {
+  size_t size = 64 * 1024;
+  long runs = 20;
+  long threads = 4;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      size = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      runs = strtol(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      threads = strtol(argv[++i], NULL, 10);
+    } else {
+      lusage();
+    }
+  }
+  if (size < 1 || runs < 1 || threads < 1) lusage();
+
+  char* src = lsource(size);
+  printf("input    %zu bytes, %ld runs\n\n", strlen(src), runs);
+
+  // The parsers compiled in with MPC_GRAMMAR, when there are any, and the
+  // ones mpca_lang builds and optimises from the grammar text
+  lreader* fixed = lreader_new();
+  lreader* built = malloc(sizeof(lreader));
+  lreader_build(built);
+  mpc_stats(built->blisp);
+  printf("\n");
+
+  int ok = 1;
+  for (int i = 0; ok && lbench_modes[i].name; i++) {
+    ok = lbench("built", built->blisp, src, lbench_modes[i].name,
+        lbench_modes[i].mode, 0, runs)
+      && lbench("fixed", fixed->blisp, src, lbench_modes[i].name,
+        lbench_modes[i].mode, 0, runs);
+  }
+  ok = ok && lbench("built", built->blisp, src, "default", 0, 1, runs)
+    && lbench("fixed", fixed->blisp, src, "default", 0, 1, runs);
+  ok = ok && lbench_threads(fixed->blisp, src, runs, threads);
+
+  lreader_del(built);
+  lreader_del(fixed);
+  free(src);
+  return ok ? 0 : 1;
+}
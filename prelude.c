@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blc.h"
+#include "mpc.h"
+#include "reader.h"
+
+// Reads the prelude, a {name value} form for each binding, and writes the
+// bindings out as an image in static C data, to be compiled into blisp.c
+// with BLISP_PRELUDE so blisp starts with them without reading anything
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    fputs("usage: prelude prelude.blisp\n", stderr);
+    return 2;
+  }
+
+  lreader* reader = lreader_new();
+  mpc_result_t result;
+  if (!mpc_parse_contents(argv[1], reader->blisp, &result)) {
+    mpc_err_print_to(result.error, stderr);
+    mpc_err_delete(result.error);
+    lreader_del(reader);
+    return 1;
+  }
+  lval* forms = lval_read(reader, result.output);
+  mpc_ast_delete(result.output);
+  lreader_del(reader);
+
+  // Values are evaluated here, so the prelude holds their results, and
+  // each may use the bindings before it
+  lenv* env = lenv_new();
+  int ok = 1;
+  for (int i = 0; i < forms->count && ok; i++) {
+    lval* form = forms->cell[i];
+    if (form->type != LVAL_QEXPR || form->count != 2 ||
+        form->cell[0]->type != LVAL_SYM) {
+      fprintf(stderr, "%s: form %d is not {name value}\n", argv[1], i + 1);
+      ok = 0;
+      break;
+    }
+
+    lval* val = lval_eval(env, lval_copy(form->cell[1]));
+    if (val->type == LVAL_ERR) {
+      fprintf(stderr, "%s: form %d: %s\n", argv[1], i + 1, val->err);
+      ok = 0;
+    } else {
+      lenv_put(env, form->cell[0], val);
+    }
+    lval_del(val);
+  }
+  lval_del(forms);
+
+  // Write the image to a scratch file and read it back as words, so the
+  // array holding it is aligned for the nodes
+  FILE* f = tmpfile();
+  ok = ok && f && lblc_write_image(env, NULL, NULL, f);
+  lenv_del(env);
+
+  long size = ok ? ftell(f) : 0;
+  size_t words = (size + 3) / 4;
+  unsigned int* data = calloc(words + 1, 4);
+  if (ok) {
+    rewind(f);
+    ok = fread(data, 1, size, f) == (size_t)size;
+  }
+  if (f) fclose(f);
+
+  if (ok) {
+    printf("/*\n * Generated by prelude.c from %s.\n", argv[1]);
+    printf(" * Compile into blisp.c by defining BLISP_PRELUDE.\n */\n\n");
+    printf("#include <stdint.h>\n\n");
+    printf("static const uint32_t blisp_prelude[] = {");
+    for (size_t i = 0; i < words; i++) {
+      printf("%s0x%08x,", i % 6 ? " " : "\n  ", data[i]);
+    }
+    printf("\n};\n\n");
+    printf("static const size_t blisp_prelude_size = %ld;\n", size);
+  }
+
+  free(data);
+  return ok ? 0 : 1;
+}
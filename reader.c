@@ -0,0 +1,184 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "reader.h"
+
+lreader* lreader_new() {
+  lreader* reader = malloc(sizeof(lreader));
+
+  // Use the parsers compiled in at build time when there are any,
+  // otherwise build them from the grammar below
+  if (!mpc_static("blisp", 5, &reader->symbol, &reader->sexpr,
+        &reader->qexpr, &reader->expr, &reader->blisp)) {
+    lreader_build(reader);
+  }
+
+  reader->symbol_tag = mpc_tag_intern("symbol");
+  reader->sexpr_tag = mpc_tag_intern("sexpr");
+  reader->qexpr_tag = mpc_tag_intern("qexpr");
+
+  return reader;
+}
+
+void lreader_build(lreader* reader) {
+  // Create parsers
+  reader->symbol = mpc_new("symbol");
+  reader->sexpr = mpc_new("sexpr");
+  reader->qexpr = mpc_new("qexpr");
+  reader->expr = mpc_new("expr");
+  reader->blisp = mpc_new("blisp");
+
+  // Define the parsers
+  /*
+   * NOTE: on the 'symbol' regex below.
+   * We need to ignore some characters inside the regex.
+   * To do that, we need to use the backslash.
+   * However, since this is a c-string, the backslash itself
+   * has to be ignored.
+   * Therefore, there are two backslashes everywhere that needs one.
+   * The real regex looks like follows:
+   *    /[a-zA-Z0-9_.+\-*%^\/\\=<>!&]+/
+   *
+   * Numbers are read from symbol tokens too, so a token like
+   * 2024.log is one symbol rather than a number and a symbol.
+   *
+   * The AST carries interned tag IDs rather than tag strings,
+   * so lval_read can match rules with an integer compare.
+   */
+  mpca_lang(
+    MPCA_LANG_TAG_IDS,
+    "                                                     \
+      symbol:   /[a-zA-Z0-9_.+\\-*%^\\/\\\\=<>!&]+/ ;     \
+      sexpr:    '(' <expr>* ')' ;                         \
+      qexpr:    '{' <expr>* '}' ;                         \
+      expr:     <symbol> | <sexpr> | <qexpr> ;            \
+      blisp:    /^/ <expr>* /$/ ;                         \
+    ",
+    reader->symbol,
+    reader->sexpr,
+    reader->qexpr,
+    reader->expr,
+    reader->blisp
+  );
+}
+
+void lreader_del(lreader* reader) {
+  mpc_cleanup(5, reader->symbol, reader->sexpr, reader->qexpr,
+    reader->expr, reader->blisp);
+  free(reader);
+}
+
+// True if the node is tagged with exactly this one ID
+static int ltag_is(mpc_ast_t* ast, int id) {
+  return ast->tags_num == 1 && ast->tags[0] == id;
+}
+
+// A token is a number if it is all digits, after an optional '-', and a
+// symbol otherwise. The token must be NUL-terminated.
+static lval* lval_read_token(char* start, char* end) {
+  char* c = start;
+  if (*c == '-' && c + 1 < end) c++;
+  while (c < end && *c >= '0' && *c <= '9') c++;
+  if (c < end) return lval_sym(start);
+
+  errno = 0;
+  long val = strtol(start, NULL, 10);
+  return errno != ERANGE ? lval_num(val) : lval_err("Invalid number");
+}
+
+// True if a list node leaves this child out of its cells
+static int lval_read_skip(mpc_ast_t* ast) {
+  if (strcmp(ast->contents, "(") == 0) return 1;
+  if (strcmp(ast->contents, ")") == 0) return 1;
+  if (strcmp(ast->contents, "{") == 0) return 1;
+  if (strcmp(ast->contents, "}") == 0) return 1;
+  return ltag_is(ast, MPC_TAG_REGEX);
+}
+
+lval* lval_read(lreader* reader, mpc_ast_t* ast) {
+  // Walk the tree in post order, so the children of every node have
+  // been read onto the stack by the time the node itself is visited
+  mpc_ast_iter_t it;
+  mpc_ast_iter_init(&it, ast, mpc_ast_trav_order_post, NULL, 0);
+
+  lval** stack = NULL;
+  int count = 0;
+  int size = 0;
+
+  mpc_ast_t* node;
+  while ((node = mpc_ast_iter_next(&it))) {
+    // Skipped children never reach a cell, so don't read them
+    if (node != ast && lval_read_skip(node)) continue;
+
+    lval* val = NULL;
+    if (mpc_ast_has_tag(node, reader->symbol_tag)) {
+      char* token = node->contents;
+      val = lval_read_token(token, token + strlen(token));
+    } else {
+      // Lists nested deeper than this would run eval, copy and delete,
+      // which recurse, out of C stack. The deepest are visited first.
+      if (it.depth > LVAL_READ_DEPTH_MAX) {
+        while (count > 0) lval_del(stack[--count]);
+        free(stack);
+        mpc_ast_iter_free(&it);
+        return lval_err("Expression nested too deeply");
+      }
+
+      // If root ('>') or sexpr then create an empty list
+      if (ltag_is(node, MPC_TAG_ROOT)) val = lval_sexpr();
+      if (mpc_ast_has_tag(node, reader->sexpr_tag)) val = lval_sexpr();
+      if (mpc_ast_has_tag(node, reader->qexpr_tag)) val = lval_qexpr();
+
+      // Move the cells read for the children off the top of the stack
+      int n = 0;
+      for (int i = 0; i < node->children_num; i++) {
+        if (!lval_read_skip(node->children[i])) n++;
+      }
+      if (n > 0) {
+        val->count = n;
+        val->cell = malloc(sizeof(lval*) * n);
+        memcpy(val->cell, stack + count - n, sizeof(lval*) * n);
+        count -= n;
+      }
+    }
+
+    if (count == size) {
+      size = size ? size * 2 : 16;
+      stack = realloc(stack, sizeof(lval*) * size);
+    }
+    stack[count++] = val;
+  }
+
+  lval* val = count ? stack[0] : NULL;
+  free(stack);
+  mpc_ast_iter_free(&it);
+  return val;
+}
+
+static int lval_is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+lval* lval_read_fields(char* start, char* end) {
+  lval* fields = lval_qexpr();
+
+  // Count the fields first, so the cells are allocated once
+  int count = 0;
+  for (char* c = start; c < end; count++) {
+    while (c < end && lval_is_space(*c)) c++;
+    if (c == end) break;
+    while (c < end && !lval_is_space(*c)) c++;
+  }
+  if (count == 0) return fields;
+
+  fields->cell = malloc(sizeof(lval*) * count);
+  char* c = start;
+  while (fields->count < count) {
+    while (lval_is_space(*c)) c++;
+    char* field = c;
+    while (c < end && !lval_is_space(*c)) c++;
+    *c++ = '\0';
+    fields->cell[fields->count++] = lval_read_token(field, c - 1);
+  }
+  return fields;
+}
@@ -0,0 +1,46 @@
+#ifndef BLISP_READER_H
+#define BLISP_READER_H
+
+#include "mpc.h"
+#include "lval.h"
+
+// The blisp grammar, along with the interned tag IDs of its rules
+typedef struct {
+  mpc_parser_t* symbol;
+  mpc_parser_t* sexpr; // S-Expression
+  mpc_parser_t* qexpr; // Q-Expression
+  mpc_parser_t* expr;
+  mpc_parser_t* blisp;
+
+  int symbol_tag;
+  int sexpr_tag;
+  int qexpr_tag;
+} lreader;
+
+// Create the parsers and define the blisp grammar
+lreader* lreader_new();
+
+// Build the parsers from the grammar text, even when they were
+// compiled in with MPC_GRAMMAR
+void lreader_build(lreader* reader);
+
+// Undefine and delete the parsers
+void lreader_del(lreader* reader);
+
+// How deep lists can be nested in what lval_read reads
+#define LVAL_READ_DEPTH_MAX 1024
+
+/*
+ * Read the AST without recursion and create a containing lval. Lists
+ * nested more than LVAL_READ_DEPTH_MAX deep are read as an error.
+ */
+lval* lval_read(lreader* reader, mpc_ast_t* ast);
+
+/*
+ * Read text as a Q-expression of its whitespace-separated fields, without
+ * the grammar: numbers where a field is one, and symbols otherwise. Each
+ * field is terminated in place, so the byte at END must be writable.
+ */
+lval* lval_read_fields(char* start, char* end);
+
+#endif
@@ -0,0 +1,641 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "blisp.h"
+#include "lval.h"
+#include "server.h"
+
+// Connections sending a request longer than this are closed
+#define SERVER_MAX_REQUEST (1 << 20)
+
+// How much is read from a connection at a time, at least
+#define SERVER_READ_SIZE 65536
+
+// How many events are taken from epoll at a time
+#define SERVER_EVENTS 64
+
+typedef struct sconn sconn;
+typedef struct sjob sjob;
+
+// A request handed to the evaluators, which comes back with its response
+struct sjob {
+  sconn* conn;
+  char* input;
+  int framed;
+
+  char* output;
+  size_t output_len;
+
+  sjob* next;
+};
+
+// A client connection, with the input not yet made into requests and the
+// output not yet written
+struct sconn {
+  int fd;
+
+  char* in;
+  size_t in_pos;
+  size_t in_len;
+  size_t in_size;
+
+  char* out;
+  size_t out_pos;
+  size_t out_len;
+  size_t out_size;
+
+  // Set while one of its requests is with the evaluators. Only one is
+  // handed out at a time, so responses go back in order.
+  int busy;
+  // Set when the client has shut down its side of the connection
+  int eof;
+  // Set when EPOLLOUT is being watched for
+  int writing;
+  // Set when EPOLLIN is not watched for, as a request is out and a whole
+  // request's worth of input is already waiting
+  int paused;
+
+  // All open connections, so they can be closed on shutdown, or the
+  // connections closed since the last events were handled
+  sconn* prev;
+  sconn* next;
+};
+
+// A queue of jobs between threads. Popping blocks until there is a job,
+// or the queue is stopped.
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  sjob* head;
+  sjob* tail;
+  int stop;
+} squeue;
+
+typedef struct sserver sserver;
+
+// An evaluator thread, with its own interpreter context
+typedef struct {
+  sserver* server;
+  blisp_ctx* ctx;
+  pthread_t thread;
+} sworker;
+
+struct sserver {
+  int epoll_fd;
+  int listen_fd;
+  // Evaluators count finished jobs here, to wake the event loop
+  int event_fd;
+  int signal_fd;
+
+  // Jobs waiting to be evaluated, and jobs with a response to send
+  squeue todo;
+  squeue done;
+
+  sworker* workers;
+  int workers_num;
+
+  // Open connections, and closed ones that events taken from epoll may
+  // still point to, which are freed once those have been handled
+  sconn* conns;
+  sconn* closed;
+};
+
+static void squeue_init(squeue* q) {
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->ready, NULL);
+  q->head = NULL;
+  q->tail = NULL;
+  q->stop = 0;
+}
+
+static void squeue_free(squeue* q) {
+  pthread_mutex_destroy(&q->lock);
+  pthread_cond_destroy(&q->ready);
+}
+
+static void squeue_push(squeue* q, sjob* job) {
+  job->next = NULL;
+  pthread_mutex_lock(&q->lock);
+  if (q->tail) {
+    q->tail->next = job;
+  } else {
+    q->head = job;
+  }
+  q->tail = job;
+  pthread_cond_signal(&q->ready);
+  pthread_mutex_unlock(&q->lock);
+}
+
+static sjob* squeue_pop(squeue* q) {
+  pthread_mutex_lock(&q->lock);
+  while (q->head == NULL && !q->stop) {
+    pthread_cond_wait(&q->ready, &q->lock);
+  }
+  sjob* job = q->head;
+  if (job) {
+    q->head = job->next;
+    if (q->head == NULL) q->tail = NULL;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return job;
+}
+
+// Take every job in the queue at once, without waiting
+static sjob* squeue_take(squeue* q) {
+  pthread_mutex_lock(&q->lock);
+  sjob* jobs = q->head;
+  q->head = NULL;
+  q->tail = NULL;
+  pthread_mutex_unlock(&q->lock);
+  return jobs;
+}
+
+static void squeue_stop(squeue* q) {
+  pthread_mutex_lock(&q->lock);
+  q->stop = 1;
+  pthread_cond_broadcast(&q->ready);
+  pthread_mutex_unlock(&q->lock);
+}
+
+static void sjob_del(sjob* job) {
+  free(job->input);
+  free(job->output);
+  free(job);
+}
+
+// Evaluate a request and write out its response, on an evaluator thread
+static void server_eval(blisp_ctx* ctx, sjob* job) {
+  lval* result = blisp_eval_string(ctx, "<request>", job->input);
+
+  char* text;
+  size_t len;
+  if (result) {
+    len = lval_to_string(result, NULL, 0);
+    text = malloc(len + 1);
+    lval_to_string(result, text, len + 1);
+    lval_del(result);
+  } else {
+    // Parse errors are sent as errors, without their trailing newline
+    const char* error = blisp_error(ctx);
+    size_t error_len = strlen(error);
+    while (error_len && error[error_len - 1] == '\n') error_len--;
+    len = strlen("[ERROR] ") + error_len;
+    text = malloc(len + 1);
+    strcpy(text, "[ERROR] ");
+    memcpy(text + strlen("[ERROR] "), error, error_len);
+  }
+
+  job->output = malloc(len + 32);
+  if (job->framed) {
+    job->output_len = sprintf(job->output, "@%zu\n", len);
+    memcpy(job->output + job->output_len, text, len);
+    job->output_len += len;
+  } else {
+    // A line response must stay on one line
+    for (size_t i = 0; i < len; i++) {
+      if (text[i] == '\n') text[i] = ' ';
+    }
+    memcpy(job->output, text, len);
+    job->output[len] = '\n';
+    job->output_len = len + 1;
+  }
+
+  free(text);
+}
+
+static void* server_worker(void* arg) {
+  sworker* worker = arg;
+  sserver* server = worker->server;
+
+  sjob* job;
+  while ((job = squeue_pop(&server->todo)) != NULL) {
+    server_eval(worker->ctx, job);
+    squeue_push(&server->done, job);
+
+    uint64_t one = 1;
+    ssize_t n = write(server->event_fd, &one, sizeof(one));
+    (void)n;
+  }
+
+  return NULL;
+}
+
+// Watch a connection for what it is waiting on: input until the client
+// shuts down its side, and room to write while output is backed up
+static void server_watch(sserver* server, sconn* conn) {
+  struct epoll_event ev;
+  ev.events = (conn->eof || conn->paused ? 0 : EPOLLIN)
+    | (conn->writing ? EPOLLOUT : 0);
+  ev.data.ptr = conn;
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+static void sconn_free(sconn* conn) {
+  free(conn->in);
+  free(conn->out);
+  free(conn);
+}
+
+// Put a closed connection on the list to be freed
+static void server_release(sserver* server, sconn* conn) {
+  conn->next = server->closed;
+  server->closed = conn;
+}
+
+// Free the closed connections
+static void server_reap(sserver* server) {
+  while (server->closed) {
+    sconn* next = server->closed->next;
+    sconn_free(server->closed);
+    server->closed = next;
+  }
+}
+
+/*
+ * Close a connection. One with a request still being evaluated is only
+ * released when the job comes back.
+ */
+static void server_close(sserver* server, sconn* conn) {
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  conn->fd = -1;
+
+  if (conn->prev) conn->prev->next = conn->next;
+  else server->conns = conn->next;
+  if (conn->next) conn->next->prev = conn->prev;
+
+  if (!conn->busy) server_release(server, conn);
+}
+
+// Write as much of the output as the socket takes. Returns 0 if the
+// connection was closed.
+static int server_write(sserver* server, sconn* conn) {
+  while (conn->out_pos < conn->out_len) {
+    ssize_t n = send(conn->fd, conn->out + conn->out_pos,
+      conn->out_len - conn->out_pos, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (!conn->writing) {
+        conn->writing = 1;
+        server_watch(server, conn);
+      }
+      return 1;
+    }
+    if (n < 0) {
+      server_close(server, conn);
+      return 0;
+    }
+    conn->out_pos += n;
+  }
+
+  conn->out_pos = 0;
+  conn->out_len = 0;
+  if (conn->writing) {
+    conn->writing = 0;
+    server_watch(server, conn);
+  }
+  return 1;
+}
+
+/*
+ * Take the next whole request from the input. Returns 1 and sets the job's
+ * input if there is one, 0 if more input is needed, or -1 if the input is
+ * malformed.
+ */
+static int server_request(sconn* conn, sjob* job) {
+  char* start = conn->in + conn->in_pos;
+  size_t avail = conn->in_len - conn->in_pos;
+  char* nl = memchr(start, '\n', avail);
+
+  size_t skip;
+  size_t len;
+  size_t used;
+  if (avail > 0 && start[0] == '@') {
+    // A frame: '@', the length in decimal, a newline, then the input
+    if (nl == NULL) return avail > 24 ? -1 : 0;
+
+    char* end;
+    unsigned long long n = strtoull(start + 1, &end, 10);
+    if (end == start + 1 || end != nl || n > SERVER_MAX_REQUEST) return -1;
+
+    skip = nl - start + 1;
+    len = n;
+    if (avail - skip < len) return 0;
+    used = skip + len;
+    job->framed = 1;
+  } else if (nl) {
+    // A line, which may end with a carriage return as well
+    skip = 0;
+    len = nl - start;
+    used = len + 1;
+    job->framed = 0;
+  } else {
+    // The last line may be left unterminated when the client shuts down
+    if (avail > SERVER_MAX_REQUEST) return -1;
+    if (!conn->eof || avail == 0) return 0;
+    skip = 0;
+    len = avail;
+    used = len;
+    job->framed = 0;
+  }
+
+  job->input = malloc(len + 1);
+  memcpy(job->input, start + skip, len);
+  job->input[len] = '\0';
+  if (!job->framed && len > 0 && job->input[len - 1] == '\r') {
+    job->input[len - 1] = '\0';
+  }
+
+  conn->in_pos += used;
+  if (conn->in_pos == conn->in_len) {
+    conn->in_pos = 0;
+    conn->in_len = 0;
+  }
+  return 1;
+}
+
+/*
+ * Hand the connection's next request to the evaluators, if it has a whole
+ * one and none is out already. A connection the client has shut down is
+ * closed once everything it sent has been answered. Returns 0 if the
+ * connection was closed.
+ */
+static int server_dispatch(sserver* server, sconn* conn) {
+  if (conn->busy) return 1;
+
+  sjob* job = malloc(sizeof(sjob));
+  job->conn = conn;
+  job->input = NULL;
+  job->output = NULL;
+  job->output_len = 0;
+
+  int found = server_request(conn, job);
+  if (found <= 0) {
+    free(job);
+    if (found < 0 || (conn->eof && conn->out_len == 0)) {
+      server_close(server, conn);
+      return 0;
+    }
+    return 1;
+  }
+
+  conn->busy = 1;
+  squeue_push(&server->todo, job);
+  return 1;
+}
+
+static void server_read(sserver* server, sconn* conn) {
+  while (conn->in_len - conn->in_pos <= SERVER_MAX_REQUEST + SERVER_READ_SIZE) {
+    // Move the unused input to the front, then make room to read into
+    if (conn->in_pos > 0) {
+      memmove(conn->in, conn->in + conn->in_pos, conn->in_len - conn->in_pos);
+      conn->in_len -= conn->in_pos;
+      conn->in_pos = 0;
+    }
+    if (conn->in_size - conn->in_len < SERVER_READ_SIZE) {
+      conn->in_size = conn->in_len + SERVER_READ_SIZE * 2;
+      conn->in = realloc(conn->in, conn->in_size);
+    }
+
+    ssize_t n = read(conn->fd, conn->in + conn->in_len,
+      conn->in_size - conn->in_len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    if (n < 0) {
+      server_close(server, conn);
+      return;
+    }
+    if (n == 0) {
+      conn->eof = 1;
+      server_watch(server, conn);
+      break;
+    }
+    conn->in_len += n;
+  }
+
+  // Stop reading from a client that is far ahead of its answers
+  if (conn->busy && !conn->eof
+  &&  conn->in_len - conn->in_pos > SERVER_MAX_REQUEST + SERVER_READ_SIZE) {
+    conn->paused = 1;
+    server_watch(server, conn);
+  }
+
+  server_dispatch(server, conn);
+}
+
+// Send the response of a job that has come back from the evaluators, then
+// hand out the connection's next request
+static void server_finish(sserver* server, sjob* job) {
+  sconn* conn = job->conn;
+  conn->busy = 0;
+
+  if (conn->fd < 0) {
+    server_release(server, conn);
+    sjob_del(job);
+    return;
+  }
+
+  if (conn->paused) {
+    conn->paused = 0;
+    server_watch(server, conn);
+  }
+
+  if (conn->out_len + job->output_len > conn->out_size) {
+    conn->out_size = (conn->out_len + job->output_len) * 2;
+    conn->out = realloc(conn->out, conn->out_size);
+  }
+  memcpy(conn->out + conn->out_len, job->output, job->output_len);
+  conn->out_len += job->output_len;
+  sjob_del(job);
+
+  if (server_write(server, conn)) {
+    server_dispatch(server, conn);
+  }
+}
+
+static void server_accept(sserver* server) {
+  while (1) {
+    int fd = accept4(server->listen_fd, NULL, NULL,
+      SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) return;
+
+    sconn* conn = calloc(1, sizeof(sconn));
+    conn->fd = fd;
+    conn->next = server->conns;
+    if (server->conns) server->conns->prev = conn;
+    server->conns = conn;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  }
+}
+
+static int server_listen(const char* path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  // Replace a socket left behind by an earlier server, but nothing else
+  struct stat st;
+  if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0
+  ||  listen(fd, SOMAXCONN) < 0) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+// Watch one of the server's own fds. The event points at where the fd is
+// kept in the server, which tells it apart from a connection.
+static void server_add(sserver* server, int* fd) {
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = fd;
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, *fd, &ev);
+}
+
+int blisp_serve(const char* path, int threads) {
+  sserver server;
+  memset(&server, 0, sizeof(server));
+
+  // Take SIGINT and SIGTERM through the event loop. The evaluator threads
+  // inherit the blocked mask, so the signals only come in there.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+  server.listen_fd = server_listen(path);
+  if (server.listen_fd < 0) {
+    fprintf(stderr, "main: %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  server.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  server.signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  squeue_init(&server.todo);
+  squeue_init(&server.done);
+
+  // The contexts are all created here, before any thread starts
+  server.workers_num = threads;
+  server.workers = malloc(sizeof(sworker) * threads);
+  for (int i = 0; i < threads; i++) {
+    server.workers[i].server = &server;
+    server.workers[i].ctx = blisp_ctx_new();
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_create(&server.workers[i].thread, NULL, server_worker,
+      &server.workers[i]);
+  }
+
+  server_add(&server, &server.listen_fd);
+  server_add(&server, &server.event_fd);
+  server_add(&server, &server.signal_fd);
+
+  printf("Serving on %s with %d evaluator threads\n", path, threads);
+  fflush(stdout);
+
+  struct epoll_event events[SERVER_EVENTS];
+  int running = 1;
+  while (running) {
+    int n = epoll_wait(server.epoll_fd, events, SERVER_EVENTS, -1);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) break;
+
+    for (int k = 0; k < n; k++) {
+      void* ptr = events[k].data.ptr;
+      if (ptr == &server.listen_fd) {
+        server_accept(&server);
+      } else if (ptr == &server.event_fd) {
+        uint64_t count;
+        ssize_t r = read(server.event_fd, &count, sizeof(count));
+        (void)r;
+        sjob* job = squeue_take(&server.done);
+        while (job) {
+          sjob* next = job->next;
+          server_finish(&server, job);
+          job = next;
+        }
+      } else if (ptr == &server.signal_fd) {
+        running = 0;
+      } else {
+        // Once a client has gone entirely there is nothing left to answer
+        sconn* conn = ptr;
+        if (conn->fd < 0) continue;
+        if ((events[k].events & EPOLLERR)
+        ||  ((events[k].events & EPOLLHUP) && conn->eof)) {
+          server_close(&server, conn);
+          continue;
+        }
+        if (events[k].events & EPOLLOUT) {
+          if (!server_write(&server, conn)) continue;
+          if (!server_dispatch(&server, conn)) continue;
+        }
+        if (events[k].events & (EPOLLIN | EPOLLHUP)) {
+          server_read(&server, conn);
+        }
+      }
+    }
+
+    server_reap(&server);
+  }
+
+  // Let the evaluators finish what they have, then drop every job and
+  // connection left without answering
+  squeue_stop(&server.todo);
+  for (int i = 0; i < threads; i++) {
+    pthread_join(server.workers[i].thread, NULL);
+    blisp_ctx_del(server.workers[i].ctx);
+  }
+
+  sjob* job = squeue_take(&server.done);
+  while (job) {
+    sjob* next = job->next;
+    job->conn->busy = 0;
+    if (job->conn->fd < 0) server_release(&server, job->conn);
+    sjob_del(job);
+    job = next;
+  }
+  while (server.conns) server_close(&server, server.conns);
+  server_reap(&server);
+
+  squeue_free(&server.todo);
+  squeue_free(&server.done);
+  free(server.workers);
+  close(server.signal_fd);
+  close(server.event_fd);
+  close(server.epoll_fd);
+  close(server.listen_fd);
+  unlink(path);
+
+  return running ? 1 : 0;
+}
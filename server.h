@@ -0,0 +1,23 @@
+#ifndef BLISP_SERVER_H
+#define BLISP_SERVER_H
+
+/*
+ * Serve evaluation requests on a Unix domain socket at PATH, with THREADS
+ * evaluator threads. Each thread owns its own interpreter context.
+ *
+ * A request is either a single line, answered with the printed result on
+ * one line, or a length-delimited frame for input that spans lines:
+ *
+ *     @<length>\n<length bytes of input>
+ *
+ * which is answered with a frame holding the result the same way. Requests
+ * on one connection are answered in the order they were sent, and may be
+ * pipelined. Parse errors are answered as "[ERROR] <message>". A malformed
+ * frame header, or a request over 1 MiB, closes the connection.
+ *
+ * Runs until SIGINT or SIGTERM, then removes the socket. Returns 0 on a
+ * clean shutdown, or 1 if the server could not be started.
+ */
+int blisp_serve(const char* path, int threads);
+
+#endif
@@ -0,0 +1,575 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../blc.h"
+#include "../blisp.h"
+#include "../reader.h"
+
+// Regression tests for the interpreter, through the blisp_ctx API. Each
+// check that fails prints what was expected, and the program exits
+// non-zero if any did.
+
+static int failures = 0;
+
+// Evaluate INPUT and check that it prints as EXPECTED
+static void check_eval(blisp_ctx* ctx, const char* input,
+    const char* expected, int line) {
+  char got[256] = "";
+  lval* res = blisp_eval_string(ctx, "<test>", input);
+  if (res) {
+    lval_to_string(res, got, sizeof(got));
+    lval_del(res);
+  } else {
+    snprintf(got, sizeof(got), "%s", blisp_error(ctx));
+  }
+
+  if (strcmp(got, expected) != 0) {
+    fprintf(stderr, "%s:%d: %s\n  expected %s\n  got      %s\n",
+      __FILE__, line, input, expected, got);
+    failures++;
+  }
+}
+
+#define CHECK_EVAL(ctx, input, expected) \
+  check_eval(ctx, input, expected, __LINE__)
+
+// lval_to_string fills BUF like snprintf, cutting the text short
+static void check_to_string(lval* val, size_t size, const char* expected,
+    size_t total, int line) {
+  char buf[64];
+  memset(buf, '#', sizeof(buf));
+  size_t got = lval_to_string(val, size ? buf : NULL, size);
+
+  if (got != total || (size > 0 && strcmp(buf, expected) != 0)
+      || (size < sizeof(buf) && buf[size] != '#')) {
+    fprintf(stderr, "%s:%d: lval_to_string into %zu bytes\n"
+      "  expected %zu \"%s\"\n  got      %zu \"%.*s\"\n",
+      __FILE__, line, size, total, expected, got, (int)size, buf);
+    failures++;
+  }
+}
+
+#define CHECK_TO_STRING(val, size, expected, total) \
+  check_to_string(val, size, expected, total, __LINE__)
+
+static void test_to_string(void) {
+  lval* list = lval_add(lval_add(lval_qexpr(), lval_num(12)),
+    lval_add(lval_qexpr(), lval_sym("ab")));
+  CHECK_TO_STRING(list, 0, "", 9);
+  CHECK_TO_STRING(list, 1, "", 9);
+  CHECK_TO_STRING(list, 2, "{", 9);
+  CHECK_TO_STRING(list, 9, "{12 {ab}", 9);
+  CHECK_TO_STRING(list, 10, "{12 {ab}}", 9);
+  CHECK_TO_STRING(list, 64, "{12 {ab}}", 9);
+  lval_del(list);
+
+  lval* num = lval_num(LONG_MIN);
+  char expected[32];
+  int len = snprintf(expected, sizeof(expected), "%ld", LONG_MIN);
+  CHECK_TO_STRING(num, sizeof(expected), expected, (size_t)len);
+  expected[len - 1] = '\0';
+  CHECK_TO_STRING(num, (size_t)len, expected, (size_t)len);
+  lval_del(num);
+
+  num = lval_num(LONG_MAX);
+  len = snprintf(expected, sizeof(expected), "%ld", LONG_MAX);
+  CHECK_TO_STRING(num, sizeof(expected), expected, (size_t)len);
+  lval_del(num);
+
+  // Lists nested far deeper than the printer's frames on the C stack
+  int depth = 100000;
+  lval* deep = lval_num(7);
+  for (int i = 0; i < depth; i++) {
+    deep = lval_add(i % 2 ? lval_qexpr() : lval_sexpr(), deep);
+  }
+  size_t size = 2 * (size_t)depth + 2;
+  char* buf = malloc(size);
+  size_t got = lval_to_string(deep, buf, size);
+  if (got != size - 1 || buf[depth - 1] != '(' || buf[depth] != '7'
+      || buf[depth + 1] != ')' || buf[size - 2] != '}') {
+    fprintf(stderr, "%s:%d: deep list printed wrong (%zu bytes)\n",
+      __FILE__, __LINE__, got);
+    failures++;
+  }
+  CHECK_TO_STRING(deep, 4, "{({", size - 1);
+  free(buf);
+  lval_del(deep);
+}
+
+// Printing to a stream writes the same text lval_to_string gives, all of
+// it by the time the call returns
+static void test_print(void) {
+  lval* list = lval_qexpr();
+  for (int i = 0; i < 3000; i++) list = lval_add(list, lval_num(i));
+
+  size_t len = lval_to_string(list, NULL, 0);
+  char* expected = malloc(len + 2);
+  lval_to_string(list, expected, len + 1);
+  strcat(expected, "\n");
+
+  char* got = NULL;
+  size_t got_len = 0;
+  FILE* out = open_memstream(&got, &got_len);
+  lval_println(list, out);
+  fflush(out);
+  if (got_len != len + 1 || strcmp(got, expected) != 0) {
+    fprintf(stderr, "%s:%d: lval_println printed %zu bytes, not %zu\n",
+      __FILE__, __LINE__, got_len, len + 1);
+    failures++;
+  }
+  fclose(out);
+
+  free(got);
+  free(expected);
+  lval_del(list);
+}
+
+// Lists are read up to LVAL_READ_DEPTH_MAX deep, and deeper ones are an
+// error rather than a crash in eval
+// A token is a number only when it is all digits, so one that starts with
+// digits and goes on with symbol characters is a single symbol
+static void test_read_tokens(void) {
+  blisp_ctx* ctx = blisp_ctx_new();
+  CHECK_EVAL(ctx, "list 1.5 2024.log 5a -3 - -x 7",
+    "{1.5 2024.log 5a -3 - -x 7}");
+  CHECK_EVAL(ctx, "+ 1 -2 (- 10)", "-11");
+  CHECK_EVAL(ctx, "99999999999999999999", "[ERROR] Invalid number");
+  blisp_ctx_del(ctx);
+}
+
+static void test_read_depth(void) {
+  blisp_ctx* ctx = blisp_ctx_new();
+  int depths[] = { LVAL_READ_DEPTH_MAX, LVAL_READ_DEPTH_MAX + 1, 100000 };
+  const char* expected[] = { "3", "[ERROR] Expression nested too deeply",
+    "[ERROR] Expression nested too deeply" };
+
+  for (int k = 0; k < 3; k++) {
+    int n = depths[k];
+    char* input = malloc(2 * n + 8);
+    memset(input, '(', n);
+    strcpy(input + n, "+ 1 2");
+    memset(input + n + 5, ')', n);
+    input[2 * n + 5] = '\0';
+    CHECK_EVAL(ctx, input, expected[k]);
+    free(input);
+  }
+
+  blisp_ctx_del(ctx);
+}
+
+// Write a script of LINES lines, most forms on one line and some over
+// three, with BAD put in place of line BAD_LINE (from 1) if it is given
+static void write_script(const char* path, int lines, int bad_line,
+    const char* bad) {
+  FILE* f = fopen(path, "w");
+  for (int row = 1; row <= lines; row++) {
+    if (row == bad_line) {
+      fprintf(f, "%s\n", bad);
+    } else if (row % 7 == 1 && row + 2 < lines
+        && (bad_line == 0 || row + 2 < bad_line)) {
+      fprintf(f, "(join {%d a}\n  (list (* %d 3)\n    (- %d)))\n", row,
+        row, row);
+      row += 2;
+    } else {
+      fprintf(f, "(+ %d (* 2 (eval (head {%d 1}))))\n", row, row);
+    }
+  }
+  fclose(f);
+}
+
+// Run a script with blisp_eval_file or blisp_eval_file_pipelined, and
+// return what it printed, its result, and the error if it had none
+static char* run_script(const char* path, int pipelined, char* result,
+    size_t size) {
+  char* out = NULL;
+  size_t out_len = 0;
+  FILE* f = open_memstream(&out, &out_len);
+  blisp_ctx* ctx = blisp_ctx_new();
+  blisp_ctx_output(ctx, f);
+
+  lval* res = pipelined ? blisp_eval_file_pipelined(ctx, path)
+    : blisp_eval_file(ctx, path);
+  if (res) {
+    lval_to_string(res, result, size);
+    lval_del(res);
+  } else {
+    snprintf(result, size, "%s", blisp_error(ctx));
+  }
+
+  blisp_ctx_del(ctx);
+  fclose(f);
+  return out;
+}
+
+// The pipelined evaluator prints and returns what blisp_eval_file does
+// for a script of several chunks, and reports errors at the same place
+static void test_pipelined(void) {
+  char path[] = "/tmp/blisp-pipe-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    fprintf(stderr, "%s: can't create %s\n", __FILE__, path);
+    failures++;
+    return;
+  }
+  close(fd);
+
+  // About 240 KB, so four or five chunks, with forms that cross lines
+  int lines = 8000;
+  struct { int bad_line; const char* bad; int parse_error; } cases[] = {
+    { 0, NULL, 0 },
+    { 7990, "(head {})", 0 },
+    { 7990, "(+ 1 2))", 1 },
+  };
+
+  for (int k = 0; k < 3; k++) {
+    write_script(path, lines, cases[k].bad_line, cases[k].bad);
+    char result[2][256];
+    char* out[2];
+    for (int j = 0; j < 2; j++) {
+      out[j] = run_script(path, j, result[j], sizeof(result[j]));
+    }
+
+    if (strcmp(result[0], result[1]) != 0) {
+      fprintf(stderr, "%s:%d: case %d: results differ\n  file      %s\n"
+        "  pipeline  %s\n", __FILE__, __LINE__, k, result[0], result[1]);
+      failures++;
+    }
+
+    if (cases[k].parse_error) {
+      // The pipeline has printed the forms before the error, which the
+      // whole-file reader never evaluates
+      char where[64];
+      snprintf(where, sizeof(where), "%s:%d:", path, cases[k].bad_line);
+      if (strncmp(result[1], where, strlen(where)) != 0) {
+        fprintf(stderr, "%s:%d: parse error not at %s\n  got %s\n",
+          __FILE__, __LINE__, where, result[1]);
+        failures++;
+      }
+    } else if (strcmp(out[0], out[1]) != 0 || strlen(out[0]) < 30000) {
+      fprintf(stderr, "%s:%d: case %d: printed %zu bytes, pipeline %zu\n",
+        __FILE__, __LINE__, k, strlen(out[0]), strlen(out[1]));
+      failures++;
+    }
+
+    free(out[0]);
+    free(out[1]);
+  }
+
+  unlink(path);
+}
+
+// Read a whole file into a buffer of its exact size
+static char* read_all(const char* path, size_t* size) {
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) return NULL;
+  fseek(f, 0, SEEK_END);
+  *size = (size_t)ftell(f);
+  rewind(f);
+  char* data = malloc(*size);
+  if (fread(data, 1, *size, f) != *size) {
+    free(data);
+    data = NULL;
+  }
+  fclose(f);
+  return data;
+}
+
+// Check lblc_read rejects DATA, copied to a buffer of its own size so
+// reading past the end is caught under ASan
+static void check_blc_rejected(const char* data, size_t size,
+    const char* what, int line) {
+  char* copy = malloc(size ? size : 1);
+  memcpy(copy, data, size);
+  lval* val = lblc_read(copy, size);
+  if (val) {
+    fprintf(stderr, "%s:%d: compiled file read despite %s\n", __FILE__,
+      line, what);
+    failures++;
+    lval_del(val);
+  }
+  free(copy);
+}
+
+// A compiled script runs as its source does, numbers of all widths
+// included, and a damaged one is rejected rather than misread
+static void test_compiled(void) {
+  char src[] = "/tmp/blisp-blc-XXXXXX";
+  int fd = mkstemp(src);
+  if (fd < 0) {
+    fprintf(stderr, "%s: can't create %s\n", __FILE__, src);
+    failures++;
+    return;
+  }
+  const char* script =
+    "(list 9223372036854775807 -9223372036854775808 7 {a {b c}})\n"
+    "(+ 2147483647 1)\n"
+    "(join {x} {-2147483649 4294967296})\n";
+  if (write(fd, script, strlen(script)) != (ssize_t)strlen(script)) {
+    failures++;
+  }
+  close(fd);
+
+  char blc[sizeof(src) + 4];
+  snprintf(blc, sizeof(blc), "%s.blc", src);
+  blisp_ctx* ctx = blisp_ctx_new();
+  if (!blisp_compile_file(ctx, src, blc)) {
+    fprintf(stderr, "%s:%d: compile failed: %s\n", __FILE__, __LINE__,
+      blisp_error(ctx));
+    failures++;
+  }
+  blisp_ctx_del(ctx);
+
+  char result[2][256];
+  char* out[2];
+  out[0] = run_script(src, 0, result[0], sizeof(result[0]));
+  out[1] = run_script(blc, 0, result[1], sizeof(result[1]));
+  const char* expected =
+    "{9223372036854775807 -9223372036854775808 7 {a {b c}}}\n"
+    "2147483648\n"
+    "{x -2147483649 4294967296}\n";
+  if (strcmp(out[0], expected) != 0 || strcmp(out[1], expected) != 0
+      || strcmp(result[0], result[1]) != 0) {
+    fprintf(stderr, "%s:%d: compiled script ran differently\n"
+      "  source   %s  compiled %s", __FILE__, __LINE__, out[0], out[1]);
+    failures++;
+  }
+  free(out[0]);
+  free(out[1]);
+
+  size_t size;
+  char* data = read_all(blc, &size);
+  if (data == NULL) {
+    failures++;
+  } else {
+    // Cut short anywhere
+    for (size_t n = 0; n < size; n++) {
+      check_blc_rejected(data, n, "truncation", __LINE__);
+    }
+
+    // A header field that doesn't match the rest: the version, the node
+    // count, the wide number count and the symbol table size, in turn
+    for (int field = 1; field < 5; field++) {
+      uint32_t x;
+      memcpy(&x, data + 4 * field, 4);
+      x++;
+      memcpy(data + 4 * field, &x, 4);
+      check_blc_rejected(data, size, "a bad header", __LINE__);
+      x--;
+      memcpy(data + 4 * field, &x, 4);
+    }
+
+    // Any other damage may be read as different forms, but never out of
+    // bounds
+    for (size_t n = 0; n < size; n++) {
+      char* copy = malloc(size);
+      memcpy(copy, data, size);
+      copy[n] ^= 0x5a;
+      lval* val = lblc_read(copy, size);
+      if (val) lval_del(val);
+      free(copy);
+    }
+
+    // Through the API, damage is reported as such
+    data[size - 1] = 'x';
+    FILE* f = fopen(blc, "wb");
+    fwrite(data, 1, size, f);
+    fclose(f);
+    ctx = blisp_ctx_new();
+    lval* res = blisp_eval_file(ctx, blc);
+    if (res || strstr(blisp_error(ctx), "not a valid compiled file") == NULL) {
+      fprintf(stderr, "%s:%d: damaged compiled file not rejected\n",
+        __FILE__, __LINE__);
+      failures++;
+    }
+    if (res) lval_del(res);
+    blisp_ctx_del(ctx);
+    free(data);
+  }
+
+  unlink(blc);
+  unlink(src);
+}
+
+static lval* builtin_twice(lenv* env, lval* val) {
+  (void)env;
+  LASSERT(val, val->count == 1 && val->cell[0]->type == LVAL_NUM,
+    "Function 'twice' passed incorrect types");
+  lval* res = lval_num(val->cell[0]->num * 2);
+  lval_del(val);
+  return res;
+}
+
+// Bindings survive an image, and natives it names come back bound where
+// they are registered first, and as an error where they aren't
+static void test_image(void) {
+  char path[] = "/tmp/blisp-image-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    fprintf(stderr, "%s: can't create %s\n", __FILE__, path);
+    failures++;
+    return;
+  }
+  close(fd);
+
+  blisp_ctx* ctx = blisp_ctx_new();
+  blisp_register(ctx, "twice", builtin_twice);
+  lval* val = lval_num(LONG_MIN);
+  blisp_define(ctx, "small", val);
+  lval_del(val);
+  val = blisp_eval_string(ctx, "<test>", "list a {-1 {}} 4294967296");
+  blisp_define(ctx, "nested", val);
+  lval_del(val);
+  val = lval_fun(builtin_twice);
+  blisp_define(ctx, "double", val);
+  lval_del(val);
+  if (!blisp_save_image(ctx, path)) {
+    fprintf(stderr, "%s:%d: save failed: %s\n", __FILE__, __LINE__,
+      blisp_error(ctx));
+    failures++;
+  }
+  blisp_ctx_del(ctx);
+
+  char small[32];
+  snprintf(small, sizeof(small), "%ld", LONG_MIN);
+  for (int registered = 0; registered < 2; registered++) {
+    ctx = blisp_ctx_new();
+    if (registered) blisp_register(ctx, "twice", builtin_twice);
+    if (!blisp_load_image(ctx, path)) {
+      fprintf(stderr, "%s:%d: load failed: %s\n", __FILE__, __LINE__,
+        blisp_error(ctx));
+      failures++;
+    }
+
+    CHECK_EVAL(ctx, "small", small);
+    CHECK_EVAL(ctx, "nested", "{a {-1 {}} 4294967296}");
+    CHECK_EVAL(ctx, "+ 1 2", "3");
+    if (registered) {
+      CHECK_EVAL(ctx, "twice 3", "6");
+      CHECK_EVAL(ctx, "double 4", "8");
+    } else {
+      CHECK_EVAL(ctx, "twice 3", "[ERROR] Native function not registered");
+      CHECK_EVAL(ctx, "double 4", "[ERROR] Native function not registered");
+    }
+    blisp_ctx_del(ctx);
+  }
+
+  unlink(path);
+}
+
+// Run blisp_eval_each over INPUT, and check what it printed and returned
+static void check_each(const char* expr, const char* input,
+    const char* expected, int errors, int line) {
+  FILE* in = fmemopen((void*)input, strlen(input), "r");
+  char* out = NULL;
+  size_t out_len = 0;
+  FILE* f = open_memstream(&out, &out_len);
+  blisp_ctx* ctx = blisp_ctx_new();
+  blisp_ctx_output(ctx, f);
+
+  int got = blisp_eval_each(ctx, expr, in);
+  fclose(f);
+  if (got != errors || strcmp(out, expected) != 0) {
+    fprintf(stderr, "%s:%d: each %s\n  expected %d errors, %.200s\n"
+      "  got      %d errors, %.200s\n", __FILE__, line, expr, errors,
+      expected, got, out);
+    failures++;
+  }
+
+  blisp_ctx_del(ctx);
+  free(out);
+  fclose(in);
+}
+
+#define CHECK_EACH(expr, input, expected, errors) \
+  check_each(expr, input, expected, errors, __LINE__)
+
+static void test_each(void) {
+  // Fields are split on spaces and tabs, CRLF ends a line as LF does, a
+  // blank line has no fields, and the last line needs no newline
+  const char* input = "a 12  b\r\n\n\t-3 x.y\r\n5\nlast 7";
+  CHECK_EACH("line", input, "{a 12 b}\n{}\n{-3 x.y}\n{5}\n{last 7}\n", 0);
+
+  // Every line is evaluated, and those that fail are counted
+  CHECK_EACH("+ 1 (eval (head line))", input,
+    "[ERROR] Expected a numerical value to operate on\n"
+    "[ERROR] Function 'head' passed {}\n"
+    "-2\n6\n"
+    "[ERROR] Expected a numerical value to operate on\n", 3);
+
+  // An expression that can't be parsed runs on no lines
+  CHECK_EACH("(+ 1", input, "", -1);
+  CHECK_EACH("line", "", "", 0);
+
+  // A line longer than the input buffer starts out
+  size_t fields = 40000;
+  char* big = malloc(2 * fields + 1);
+  for (size_t i = 0; i < fields; i++) memcpy(big + 2 * i, "1 ", 2);
+  big[2 * fields - 1] = '\0';
+  CHECK_EACH("eval (join {+} line)", big, "40000\n", 0);
+  free(big);
+}
+
+// Files can be named by relative and dotted paths
+static void test_file_paths(void) {
+  char dir[] = "/tmp/blisp-test.XXXXXX";
+  if (mkdtemp(dir) == NULL || chdir(dir) != 0 || mkdir("sub", 0777) != 0) {
+    fprintf(stderr, "%s: can't set up %s\n", __FILE__, dir);
+    failures++;
+    return;
+  }
+
+  blisp_ctx* ctx = blisp_ctx_new();
+  blisp_register_files(ctx);
+
+  CHECK_EVAL(ctx, "write-file ./sub/data.txt {1 two {3 4}}", "12");
+  CHECK_EVAL(ctx, "read-lines sub/data.txt", "{{1} {two} {{3 4}}}");
+  CHECK_EVAL(ctx, "read-file ./sub/../sub/data.txt", "{1 two {3 4}}");
+  CHECK_EVAL(ctx, "write-file 2024.log {7}", "2");
+  CHECK_EVAL(ctx, "read-file 2024.log", "{7}");
+
+  char expr[128];
+  snprintf(expr, sizeof(expr), "read-file {%s/sub/data.txt ./nope.txt}",
+    dir);
+  CHECK_EVAL(ctx, expr,
+    "{{1 two {3 4}} [ERROR] Cannot read './nope.txt'}");
+
+  if (chdir("sub") == 0) {
+    CHECK_EVAL(ctx, "write-file ../up.txt {-5}", "3");
+    CHECK_EVAL(ctx, "eval (join {+ 1} (read-file ../up.txt))", "-4");
+    if (chdir("..") != 0) failures++;
+  }
+  blisp_ctx_del(ctx);
+
+  // Contexts that haven't asked for the file functions don't have them
+  ctx = blisp_ctx_new();
+  CHECK_EVAL(ctx, "write-file ./sub/data.txt {1}", "[ERROR] Unknown function");
+  CHECK_EVAL(ctx, "read-file ./sub/data.txt", "[ERROR] Unknown function");
+  blisp_ctx_del(ctx);
+
+  unlink("sub/data.txt");
+  unlink("up.txt");
+  rmdir("sub");
+  if (chdir("/") == 0) rmdir(dir);
+}
+
+int main(void) {
+  test_to_string();
+  test_print();
+  test_read_tokens();
+  test_read_depth();
+  test_pipelined();
+  test_each();
+  test_compiled();
+  test_image();
+  test_file_paths();
+
+  if (failures) fprintf(stderr, "%d failed\n", failures);
+  return failures ? 1 : 0;
+}
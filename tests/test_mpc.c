@@ -0,0 +1,283 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../mpc.h"
+
+// Regression tests for the parser library. Each check that fails prints
+// what was expected, and the program exits non-zero if any did.
+
+static int failures = 0;
+
+#define CHECK(cond, msg) \
+  do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, msg); \
+      failures++; \
+    } \
+  } while (0)
+
+// A parser that doesn't build ASTs returns its own output in arena mode
+static void test_arena_without_ast(void) {
+  mpc_parser_t* re = mpc_re("a|b");
+  mpc_result_t r;
+
+  int ok = mpc_parse_mode("<test>", "b", re, &r, MPC_PARSE_AST_ARENA, NULL);
+  CHECK(ok, "mpc_re parse failed in arena mode");
+  if (ok) {
+    CHECK(strcmp(r.output, "b") == 0, "mpc_re output changed in arena mode");
+    free(r.output);
+  } else {
+    mpc_err_delete(r.error);
+  }
+
+  mpc_delete(re);
+}
+
+// A grammar's AST is still built in, and freed with, the arena
+static void test_arena_with_ast(void) {
+  mpc_parser_t* word = mpc_new("word");
+  mpc_parser_t* words = mpc_new("words");
+  mpca_lang(MPCA_LANG_DEFAULT,
+    " word  : /[a-z]+/ ;        "
+    " words : /^/ <word>* /$/ ; ",
+    word, words, NULL);
+
+  mpc_result_t r;
+  int ok = mpc_parse_mode("<test>", "one two three", words, &r,
+    MPC_PARSE_AST_ARENA, NULL);
+  CHECK(ok, "grammar parse failed in arena mode");
+  if (ok) {
+    mpc_ast_t* ast = r.output;
+    CHECK(ast->children_num == 5, "grammar AST has the wrong children");
+    CHECK(strcmp(ast->children[2]->contents, "two") == 0,
+      "grammar AST has the wrong contents");
+    mpc_ast_delete(ast);
+  } else {
+    mpc_err_delete(r.error);
+  }
+
+  mpc_cleanup(2, word, words);
+}
+
+// Backtracking over a shared prefix replays it from the packrat cache, and
+// the tree it goes into must be the same in every mode
+static void test_arena_packrat_replay(void) {
+  mpc_parser_t* w = mpc_new("w");
+  mpc_parser_t* a = mpc_new("a");
+  mpca_lang(MPCA_LANG_DEFAULT,
+    " w : /[a-z]+/ ;             "
+    " a : <w> 'x' | <w> 'y' ;    ",
+    w, a, NULL);
+
+  const int modes[] = {
+    MPC_PARSE_PACKRAT, MPC_PARSE_AST_ARENA,
+    MPC_PARSE_PACKRAT | MPC_PARSE_AST_ARENA,
+    MPC_PARSE_PACKRAT | MPC_PARSE_AST_ARENA | MPC_PARSE_LAZY_ERRORS
+  };
+
+  mpc_result_t expected;
+  int ok = mpc_parse("<test>", "foo y", a, &expected);
+  CHECK(ok, "backtracking parse failed");
+
+  for (int k = 0; ok && k < 4; k++) {
+    mpc_result_t r;
+    if (mpc_parse_mode("<test>", "foo y", a, &r, modes[k], NULL)) {
+      CHECK(mpc_ast_eq(r.output, expected.output),
+        "backtracking parse differs from the default mode");
+      mpc_ast_delete(r.output);
+    } else {
+      CHECK(0, "backtracking parse failed");
+      mpc_err_delete(r.error);
+    }
+  }
+  if (ok) mpc_ast_delete(expected.output);
+
+  mpc_cleanup(2, w, a);
+}
+
+// Join the contents of an AST's leaves with spaces
+static void ast_leaves(mpc_ast_t* ast, char* out) {
+  if (ast->children_num == 0) {
+    if (*out) strcat(out, " ");
+    strcat(out, ast->contents);
+  }
+  for (int i = 0; i < ast->children_num; i++) {
+    ast_leaves(ast->children[i], out);
+  }
+}
+
+// Parsing a pipe one form at a time leaves the rest of it in the stream
+static void test_pipe_parses(void) {
+  mpc_parser_t* number = mpc_new("number");
+  mpc_parser_t* symbol = mpc_new("symbol");
+  mpc_parser_t* sexpr = mpc_new("sexpr");
+  mpc_parser_t* qexpr = mpc_new("qexpr");
+  mpc_parser_t* expr = mpc_new("expr");
+  mpc_parser_t* one = mpc_new("one");
+  mpca_lang(MPCA_LANG_DEFAULT,
+    " number : /-?[0-9]+/ ;                               "
+    " symbol : /[a-z+]+/ ;                                "
+    " sexpr  : '(' <expr>* ')' ;                          "
+    " qexpr  : '{' <expr>* '}' ;                          "
+    " expr   : <number> | <symbol> | <sexpr> | <qexpr> ;  "
+    " one    : <expr> ;                                   ",
+    number, symbol, sexpr, qexpr, expr, one, NULL);
+
+  // A real pipe, so the stream is block buffered and reads ahead
+  int fds[2];
+  CHECK(pipe(fds) == 0, "pipe failed");
+  const char* input = "(+ 1 2) {a b}\n(x\n y) 7 8\n";
+  CHECK(write(fds[1], input, strlen(input)) == (ssize_t)strlen(input),
+    "write to pipe failed");
+  close(fds[1]);
+  FILE* f = fdopen(fds[0], "r");
+
+  const char* expected[] = { "( + 1 2 )", "{ a b }", "( x y )", "7", "8" };
+  for (int i = 0; i < 5; i++) {
+    mpc_result_t r;
+    char got[64] = "";
+    if (mpc_parse_pipe("<pipe>", f, one, &r)) {
+      ast_leaves(r.output, got);
+      mpc_ast_delete(r.output);
+    } else {
+      mpc_err_delete(r.error);
+    }
+    if (strcmp(got, expected[i]) != 0) {
+      fprintf(stderr, "parse %d of the pipe: expected '%s', got '%s'\n",
+        i + 1, expected[i], got);
+    }
+    CHECK(strcmp(got, expected[i]) == 0, "pipe parse lost input");
+  }
+  CHECK(fgetc(f) == EOF, "pipe not read to the end");
+  fclose(f);
+
+  mpc_cleanup(6, number, symbol, sexpr, qexpr, expr, one);
+}
+
+// A string folded only to be freed parses the same once optimised
+static void test_optimise_freed_strfold(void) {
+  const char* inputs[] = { "ab", "abx1x2", "abx", "a", NULL };
+  mpc_parser_t* ps[2];
+  for (int k = 0; k < 2; k++) {
+    ps[k] = mpc_apply(mpc_and(2, mpcf_strfold,
+      mpc_string("ab"),
+      mpc_many(mpcf_strfold, mpc_and(2, mpcf_strfold,
+        mpc_char('x'), mpc_many1(mpcf_strfold, mpc_digit()), free)),
+      free), mpcf_free);
+    ps[k] = mpc_whole(ps[k], mpcf_dtor_null);
+  }
+  mpc_optimise(ps[1]);
+
+  for (int j = 0; inputs[j]; j++) {
+    mpc_result_t r[2];
+    int ok[2];
+    for (int k = 0; k < 2; k++) {
+      ok[k] = mpc_parse("<test>", inputs[j], ps[k], &r[k]);
+      if (ok[k]) {
+        CHECK(r[k].output == NULL, "freed strfold produced output");
+      } else {
+        mpc_err_delete(r[k].error);
+      }
+    }
+    CHECK(ok[0] == ok[1], "optimised freed strfold parsed differently");
+  }
+
+  mpc_delete(ps[0]);
+  mpc_delete(ps[1]);
+}
+
+// Add up what a parse produced, so threads can compare their results
+static long parse_sum(mpc_parser_t* p, const char* input, int mode) {
+  mpc_result_t r;
+  long sum;
+  if (mpc_parse_mode("<thread>", input, p, &r, mode, NULL)) {
+    char leaves[256] = "";
+    ast_leaves(r.output, leaves);
+    sum = (long)strlen(leaves) * 31 + leaves[0];
+    mpc_ast_delete(r.output);
+  } else {
+    char* err = mpc_err_string(r.error);
+    sum = -(long)strlen(err);
+    free(err);
+    mpc_err_delete(r.error);
+  }
+  return sum;
+}
+
+static const char* thread_inputs[] = {
+  "(+ 1 (* 2 3) {a b c})", "{1 {2 {3}}}", "(+ 1", "}", "(eval {+ 1 2})", NULL
+};
+
+static const int thread_modes[] = {
+  MPC_PARSE_DEFAULT, MPC_PARSE_PACKRAT, MPC_PARSE_AST_ARENA,
+  MPC_PARSE_LAZY_ERRORS, MPC_PARSE_POSITIONS,
+  MPC_PARSE_PACKRAT | MPC_PARSE_AST_ARENA | MPC_PARSE_LAZY_ERRORS
+};
+
+static long parse_all(mpc_parser_t* p) {
+  long sum = 0;
+  for (int k = 0; k < 200; k++) {
+    for (int j = 0; thread_inputs[j]; j++) {
+      sum += parse_sum(p, thread_inputs[j], thread_modes[(k + j) % 6]);
+    }
+  }
+  return sum;
+}
+
+static void* parse_thread(void* p) {
+  long* sum = malloc(sizeof(long));
+  *sum = parse_all(p);
+  return sum;
+}
+
+// Threads parsing with one shared grammar in every mode get the same
+// results as a single thread does
+static void test_parse_threads(void) {
+  mpc_parser_t* number = mpc_new("number");
+  mpc_parser_t* symbol = mpc_new("symbol");
+  mpc_parser_t* sexpr = mpc_new("sexpr");
+  mpc_parser_t* qexpr = mpc_new("qexpr");
+  mpc_parser_t* expr = mpc_new("expr");
+  mpc_parser_t* all = mpc_new("all");
+  mpca_lang(MPCA_LANG_DEFAULT,
+    " number : /-?[0-9]+/ ;                               "
+    " symbol : /[a-z+*]+/ ;                               "
+    " sexpr  : '(' <expr>* ')' ;                          "
+    " qexpr  : '{' <expr>* '}' ;                          "
+    " expr   : <number> | <symbol> | <sexpr> | <qexpr> ;  "
+    " all    : /^/ <expr>* /$/ ;                          ",
+    number, symbol, sexpr, qexpr, expr, all, NULL);
+
+  long expected = parse_all(all);
+
+  pthread_t threads[8];
+  for (int i = 0; i < 8; i++) {
+    CHECK(pthread_create(&threads[i], NULL, parse_thread, all) == 0,
+      "pthread_create failed");
+  }
+  for (int i = 0; i < 8; i++) {
+    long* sum;
+    pthread_join(threads[i], (void**)&sum);
+    CHECK(*sum == expected, "thread parsed differently to a single thread");
+    free(sum);
+  }
+
+  mpc_cleanup(6, number, symbol, sexpr, qexpr, expr, all);
+}
+
+int main(void) {
+  test_arena_without_ast();
+  test_arena_with_ast();
+  test_arena_packrat_replay();
+  test_pipe_parses();
+  test_optimise_freed_strfold();
+  test_parse_threads();
+
+  if (failures) fprintf(stderr, "%d failed\n", failures);
+  return failures ? 1 : 0;
+}
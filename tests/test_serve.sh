@@ -0,0 +1,71 @@
+#!/bin/sh
+# Smoke test for `main --serve`. Starts a server with a few evaluator
+# threads, drives it with loadgen over many connections, with line and
+# framed requests, and fails if any request errors or goes unanswered.
+#
+# usage: tests/test_serve.sh build/main build/loadgen
+
+MAIN=${1:-build/main}
+LOADGEN=${2:-build/loadgen}
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/blisp-XXXXXX")
+SOCK=$DIR/blisp.sock
+
+$MAIN --serve "$SOCK" --threads 4 &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null; wait $SERVER 2>/dev/null; rm -rf "$DIR"' EXIT
+
+# Wait up to five seconds for the socket to appear
+tries=0
+while [ ! -S "$SOCK" ]; do
+  tries=$((tries + 1))
+  if [ $tries -gt 50 ] || ! kill -0 $SERVER 2>/dev/null; then
+    echo "test_serve: server did not start" >&2
+    exit 1
+  fi
+  sleep 0.1
+done
+
+status=0
+for mode in "" -f; do
+  out=$($LOADGEN "$SOCK" -c 16 -n 20000 -e "list (+ 1 (* 2 3)) {a b}" $mode)
+  echo "$out"
+  if ! echo "$out" | grep -q "(0 errors, 0 unanswered)"; then
+    echo "test_serve: loadgen $mode saw errors" >&2
+    status=1
+  fi
+done
+
+# Nesting too deep to evaluate is answered with an error, and the server
+# carries on
+DEEP=$(awk 'BEGIN {
+  for (i = 0; i < 50000; i++) printf "("
+  printf "+ 1 2"
+  for (i = 0; i < 50000; i++) printf ")"
+}')
+out=$($LOADGEN "$SOCK" -c 1 -n 1 -e "$DEEP")
+if ! echo "$out" | grep -q "(1 errors, 0 unanswered)"; then
+  echo "test_serve: deep nesting was not answered with an error" >&2
+  status=1
+fi
+out=$($LOADGEN "$SOCK" -c 1 -n 1 -e "+ 1 2")
+if ! echo "$out" | grep -q "(0 errors, 0 unanswered)"; then
+  echo "test_serve: server stopped answering after deep nesting" >&2
+  status=1
+fi
+
+# Clients can't reach the server's files
+$LOADGEN "$SOCK" -c 1 -n 1 -e "write-file $DIR/written {1}" > /dev/null
+if [ -e "$DIR/written" ]; then
+  echo "test_serve: a client wrote a file" >&2
+  status=1
+fi
+
+# The server shuts down cleanly on SIGTERM, removing its socket
+kill $SERVER
+wait $SERVER || status=1
+if [ -S "$SOCK" ]; then
+  echo "test_serve: socket left behind" >&2
+  status=1
+fi
+
+exit $status